@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "attrcodec.h"
+
+#include <cstring>
+#include <QDebug>
+#include <QHash>
+#include <QMutex>
+
+static void writeDigits(char* dst, int value, int count)
+{
+    for (int i = count - 1; i >= 0; --i)
+    {
+        dst[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+static bool readDigits(const char* src, int count, int& value)
+{
+    value = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (src[i] < '0' || src[i] > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (src[i] - '0');
+    }
+    return true;
+}
+
+// yyyyMMdd, empty for an invalid date
+//
+static int formatDate(char* dst, const QDate& value)
+{
+    if (!value.isValid() || value.year() < 0 || value.year() > 9999)
+    {
+        return 0;
+    }
+
+    writeDigits(dst,     value.year(),  4);
+    writeDigits(dst + 4, value.month(), 2);
+    writeDigits(dst + 6, value.day(),   2);
+    return 8;
+}
+
+// HHmmss, empty for an invalid time
+//
+static int formatTime(char* dst, const QTime& value)
+{
+    if (!value.isValid())
+    {
+        return 0;
+    }
+
+    writeDigits(dst,     value.hour(),   2);
+    writeDigits(dst + 2, value.minute(), 2);
+    writeDigits(dst + 4, value.second(), 2);
+    return 6;
+}
+
+static QDate parseDate(const char* str, size_t len)
+{
+    int y, m, d;
+    if (len == 8 && readDigits(str, 4, y) && readDigits(str + 4, 2, m) && readDigits(str + 6, 2, d))
+    {
+        return QDate(y, m, d);
+    }
+    return QDate();
+}
+
+static QTime parseTime(const char* str, size_t len)
+{
+    int h, m, s;
+    if (len == 6 && readDigits(str, 2, h) && readDigits(str + 2, 2, m) && readDigits(str + 4, 2, s))
+    {
+        return QTime(h, m, s);
+    }
+    return QTime();
+}
+
+static QDateTime parseDateTime(const char* str, size_t len)
+{
+    if (len != 14)
+    {
+        return QDateTime();
+    }
+
+    auto date = parseDate(str, 8);
+    auto time = parseTime(str + 8, 6);
+    return date.isValid() && time.isValid()? QDateTime(date, time): QDateTime();
+}
+
+OFCondition AttrCodec::put(DcmItem* item, const DcmTag& tag, const QDate& value)
+{
+    char buf[16];
+    buf[formatDate(buf, value)] = '\0';
+    return item->putAndInsertString(tag, buf);
+}
+
+OFCondition AttrCodec::put(DcmItem* item, const DcmTag& tag, const QTime& value)
+{
+    char buf[16];
+    buf[formatTime(buf, value)] = '\0';
+    return item->putAndInsertString(tag, buf);
+}
+
+OFCondition AttrCodec::put(DcmItem* item, const DcmTag& tag, const QDateTime& value)
+{
+    char buf[16];
+    auto len = formatDate(buf, value.date());
+    auto timeLen = len? formatTime(buf + len, value.time()): 0;
+    buf[timeLen? len + timeLen: 0] = '\0';
+    return item->putAndInsertString(tag, buf);
+}
+
+OFCondition AttrCodec::get(DcmItem* item, const DcmTag& tag, QDate& value)
+{
+    const char* str = nullptr;
+    auto cond = item->findAndGetString(tag, str);
+    if (cond.good())
+    {
+        value = str? parseDate(str, strlen(str)): QDate();
+    }
+    return cond;
+}
+
+OFCondition AttrCodec::get(DcmItem* item, const DcmTag& tag, QTime& value)
+{
+    const char* str = nullptr;
+    auto cond = item->findAndGetString(tag, str);
+    if (cond.good())
+    {
+        value = str? parseTime(str, strlen(str)): QTime();
+    }
+    return cond;
+}
+
+OFCondition AttrCodec::get(DcmItem* item, const DcmTag& tag, QDateTime& value)
+{
+    const char* str = nullptr;
+    auto cond = item->findAndGetString(tag, str);
+    if (cond.good())
+    {
+        value = str? parseDateTime(str, strlen(str)): QDateTime();
+    }
+    return cond;
+}
+
+// Codecs of the text values, one per VR
+//
+template <typename T> static OFCondition putNumber(DcmItem* item, const DcmTag& tag, const QString& text)
+{
+    return AttrCodec::put(item, tag, (T)text.toDouble());
+}
+
+template <typename T> static OFCondition getNumber(DcmItem* item, const DcmTag& tag, QVariant& value)
+{
+    T number = 0;
+    auto cond = AttrCodec::get(item, tag, number);
+    if (cond.good())
+    {
+        value.setValue(number);
+    }
+    return cond;
+}
+
+static OFCondition putDate(DcmItem* item, const DcmTag& tag, const QString& text)
+{
+    auto latin = text.toLatin1();
+    auto date = parseDate(latin.constData(), latin.size());
+    return AttrCodec::put(item, tag, text.length() == 8? date: QDate::fromString(text, Qt::ISODate));
+}
+
+static OFCondition putTime(DcmItem* item, const DcmTag& tag, const QString& text)
+{
+    auto latin = text.toLatin1();
+    auto time = parseTime(latin.constData(), latin.size());
+    return AttrCodec::put(item, tag, text.length() == 6? time: QTime::fromString(text, Qt::ISODate));
+}
+
+static OFCondition putDateTime(DcmItem* item, const DcmTag& tag, const QString& text)
+{
+    auto latin = text.toLatin1();
+    auto dt = parseDateTime(latin.constData(), latin.size());
+    return AttrCodec::put(item, tag, text.length() == 14? dt: QDateTime::fromString(text, Qt::ISODate));
+}
+
+template <typename T> static OFCondition getDateOrTime(DcmItem* item, const DcmTag& tag, QVariant& value)
+{
+    T dt;
+    auto cond = AttrCodec::get(item, tag, dt);
+    if (cond.good())
+    {
+        value.setValue(dt);
+    }
+    return cond;
+}
+
+static OFCondition putString(DcmItem* item, const DcmTag& tag, const QString& text)
+{
+    return item->putAndInsertString(tag, text.toUtf8());
+}
+
+static OFCondition getString(DcmItem* item, const DcmTag& tag, QVariant& value)
+{
+    const char* str = nullptr;
+    auto cond = item->findAndGetString(tag, str);
+    if (cond.good())
+    {
+        value.setValue(QString::fromUtf8(str));
+    }
+    return cond;
+}
+
+static OFCondition putUnsupported(DcmItem*, const DcmTag& tag, const QString&)
+{
+    qDebug() << "VR" << tag.getVRName() << "not implemented";
+    return EC_IllegalParameter;
+}
+
+static OFCondition getUnsupported(DcmItem*, const DcmTag& tag, QVariant&)
+{
+    qDebug() << "VR" << tag.getVRName() << "not implemented";
+    return EC_IllegalParameter;
+}
+
+TextAttr TextAttr::byTag(const DcmTag& tag)
+{
+    TextAttr attr;
+    attr.dcmTag = tag;
+
+    switch (tag.getEVR())
+    {
+    case EVR_FL:
+    case EVR_OF:
+        attr.putFn = putNumber<Float32>;
+        attr.getFn = getNumber<Float32>;
+        break;
+    case EVR_FD:
+        attr.putFn = putNumber<Float64>;
+        attr.getFn = getNumber<Float64>;
+        break;
+    case EVR_SL:
+        attr.putFn = putNumber<Sint32>;
+        attr.getFn = getNumber<Sint32>;
+        break;
+    case EVR_UL:
+        attr.putFn = putNumber<Uint32>;
+        attr.getFn = getNumber<Uint32>;
+        break;
+    case EVR_SS:
+        attr.putFn = putNumber<Sint16>;
+        attr.getFn = getNumber<Sint16>;
+        break;
+    case EVR_US:
+        attr.putFn = putNumber<Uint16>;
+        attr.getFn = getNumber<Uint16>;
+        break;
+    case EVR_DA:
+        attr.putFn = putDate;
+        attr.getFn = getDateOrTime<QDate>;
+        break;
+    case EVR_TM:
+        attr.putFn = putTime;
+        attr.getFn = getDateOrTime<QTime>;
+        break;
+    case EVR_DT:
+        attr.putFn = putDateTime;
+        attr.getFn = getDateOrTime<QDateTime>;
+        break;
+    default:
+        if (tag.getVR().isaString())
+        {
+            attr.putFn = putString;
+            attr.getFn = getString;
+        }
+        else
+        {
+            attr.putFn = putUnsupported;
+            attr.getFn = getUnsupported;
+        }
+        break;
+    }
+
+    return attr;
+}
+
+TextAttr TextAttr::byName(const QString& name)
+{
+    // Names come from a small fixed vocabulary (settings, web service responses),
+    // so each one is looked up in the dictionary once per process.
+    //
+    static QMutex lock;
+    static QHash<QString, TextAttr> known;
+
+    QMutexLocker locker(&lock);
+    auto it = known.find(name);
+    if (it == known.end())
+    {
+        DcmTag tag;
+        if (DcmTag::findTagFromName(name.toUtf8(), tag).good())
+        {
+            it = known.insert(name, byTag(tag));
+        }
+        else
+        {
+            qDebug() << "Unknown DCM tag" << name;
+            it = known.insert(name, TextAttr());
+        }
+    }
+
+    return it.value();
+}
+
+bool TextAttr::isString() const
+{
+    return putFn == putString;
+}
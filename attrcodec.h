@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATTRCODEC_H
+#define ATTRCODEC_H
+
+#include <QDateTime>
+#include <QString>
+#include <QVariant>
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dcitem.h>
+#include <dcmtk/dcmdata/dctag.h>
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+// Typed access to the dataset attributes, without QVariant boxing.
+// Dates and times are written and read digit by digit, the way DICOM keeps them,
+// not through the QString formatting.
+//
+namespace AttrCodec
+{
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Uint16 value) { return item->putAndInsertUint16(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Sint16 value) { return item->putAndInsertSint16(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Uint32 value) { return item->putAndInsertUint32(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Sint32 value) { return item->putAndInsertSint32(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Float32 value) { return item->putAndInsertFloat32(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, Float64 value) { return item->putAndInsertFloat64(tag, value); }
+    inline OFCondition put(DcmItem* item, const DcmTag& tag, const char* value) { return item->putAndInsertString(tag, value); }
+    OFCondition put(DcmItem* item, const DcmTag& tag, const QDate& value);
+    OFCondition put(DcmItem* item, const DcmTag& tag, const QTime& value);
+    OFCondition put(DcmItem* item, const DcmTag& tag, const QDateTime& value);
+
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Uint16& value) { return item->findAndGetUint16(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Sint16& value) { return item->findAndGetSint16(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Uint32& value) { return item->findAndGetUint32(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Sint32& value) { return item->findAndGetSint32(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Float32& value) { return item->findAndGetFloat32(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, Float64& value) { return item->findAndGetFloat64(tag, value); }
+    inline OFCondition get(DcmItem* item, const DcmTag& tag, const char*& value) { return item->findAndGetString(tag, value); }
+    OFCondition get(DcmItem* item, const DcmTag& tag, QDate& value);
+    OFCondition get(DcmItem* item, const DcmTag& tag, QTime& value);
+    OFCondition get(DcmItem* item, const DcmTag& tag, QDateTime& value);
+}
+
+// The value type of each VR, resolved at compile time.
+// All other VRs are strings.
+//
+template <DcmEVR VR> struct AttrValue { typedef const char* Type; };
+template <> struct AttrValue<EVR_US> { typedef Uint16    Type; };
+template <> struct AttrValue<EVR_SS> { typedef Sint16    Type; };
+template <> struct AttrValue<EVR_UL> { typedef Uint32    Type; };
+template <> struct AttrValue<EVR_SL> { typedef Sint32    Type; };
+template <> struct AttrValue<EVR_FL> { typedef Float32   Type; };
+template <> struct AttrValue<EVR_OF> { typedef Float32   Type; };
+template <> struct AttrValue<EVR_FD> { typedef Float64   Type; };
+template <> struct AttrValue<EVR_DA> { typedef QDate     Type; };
+template <> struct AttrValue<EVR_TM> { typedef QTime     Type; };
+template <> struct AttrValue<EVR_DT> { typedef QDateTime Type; };
+
+// An attribute with the VR known at compile time, like
+//
+// static const Attr<EVR_DA> studyDate(DCM_StudyDate);
+// studyDate.put(dataset, QDate::currentDate());
+//
+template <DcmEVR VR> class Attr
+{
+public:
+    typedef typename AttrValue<VR>::Type Type;
+
+    explicit Attr(const DcmTagKey& key) : tag(key, DcmVR(VR)) {}
+
+    OFCondition put(DcmItem* item, const Type& value) const { return AttrCodec::put(item, tag, value); }
+    OFCondition get(DcmItem* item, Type& value) const { return AttrCodec::get(item, tag, value); }
+
+private:
+    DcmTag tag;
+};
+
+// An attribute known by name, for the settings and the web service.
+// The name is looked up in the DICOM dictionary and the codec of the VR is chosen
+// once per process, after that the values go to and from the text directly.
+//
+class TextAttr
+{
+public:
+    typedef OFCondition (*PutFn)(DcmItem* item, const DcmTag& tag, const QString& text);
+    typedef OFCondition (*GetFn)(DcmItem* item, const DcmTag& tag, QVariant& value);
+
+    TextAttr() : putFn(nullptr), getFn(nullptr) {}
+
+    /** @return the attribute of a DICOM keyword, like PatientName,
+     *  invalid if there is no such one in the dictionary.
+     *  It takes a process wide lock, so resolve the names once, not for each image.
+     */
+    static TextAttr byName(const QString& name);
+
+    /** @return the attribute of a tag.
+     */
+    static TextAttr byTag(const DcmTag& tag);
+
+    bool isValid() const { return putFn != nullptr; }
+
+    /** @return true if the value is a string, not a number or a date.
+     */
+    bool isString() const;
+
+    const DcmTag& tag() const { return dcmTag; }
+
+    /** stores the text value to the item. Dates and times are accepted in the DICOM
+     *  way (20141225, 175959, 20141225175959) as well as ISO 8601.
+     *  @param item to store to
+     *  @param text the value
+     *  @return status
+     */
+    OFCondition put(DcmItem* item, const QString& text) const
+    {
+        return putFn? putFn(item, dcmTag, text): EC_IllegalParameter;
+    }
+
+    /** reads the value from the item. Numbers become numbers, dates and times
+     *  become QDate/QTime/QDateTime, the rest are strings.
+     *  @param item to read from
+     *  @param value the value
+     *  @return status
+     */
+    OFCondition get(DcmItem* item, QVariant& value) const
+    {
+        return getFn? getFn(item, dcmTag, value): EC_IllegalParameter;
+    }
+
+private:
+    DcmTag dcmTag;
+    PutFn putFn;
+    GetFn getFn;
+};
+
+#endif // ATTRCODEC_H
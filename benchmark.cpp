@@ -0,0 +1,1123 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "attrcodec.h"
+#include "benchmark.h"
+#include "glyphmatcher.h"
+#include "ocrengine.h"
+#include "ocrimage.h"
+#include "product.h"
+
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QMutex>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+#include <QUtf8Settings>
+#include <QVector>
+
+#include <algorithm>
+#include <unistd.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dcdatset.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcsequen.h>
+#include <dcmtk/dcmdata/dcuid.h>
+#include <dcmtk/dcmimgle/dcmimage.h>
+#include <dcmtk/dcmnet/dimse.h>
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+#ifdef WITH_TESSERACT
+#include <tesseract/baseapi.h>
+#endif
+
+#define DEFAULT_BENCHMARK_ITERATIONS 3
+#define FILM_WIDTH  2048
+#define FILM_HEIGHT 1536
+#define FILM_NOISE  6
+
+#define DEFAULT_BENCHMARK_FILMS    20
+#define DEFAULT_BENCHMARK_BOXES    4
+#define DEFAULT_BENCHMARK_PARALLEL 2
+
+#define DEFAULT_BENCHMARK_CODEC_ITERATIONS 100000
+
+// Classic 5x7 font, the top row first, the leftmost column is 0x10
+//
+static const struct
+{
+    char ch;
+    uchar rows[7];
+}
+font5x7[] =
+{
+    {'0', {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}}, {'1', {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E}},
+    {'2', {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}}, {'3', {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E}},
+    {'4', {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}}, {'5', {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E}},
+    {'6', {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}}, {'7', {0x1F,0x01,0x02,0x04,0x08,0x08,0x08}},
+    {'8', {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}}, {'9', {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C}},
+    {'A', {0x0E,0x11,0x11,0x11,0x1F,0x11,0x11}}, {'B', {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E}},
+    {'C', {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E}}, {'D', {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C}},
+    {'E', {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F}}, {'F', {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10}},
+    {'G', {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F}}, {'H', {0x11,0x11,0x11,0x1F,0x11,0x11,0x11}},
+    {'I', {0x0E,0x04,0x04,0x04,0x04,0x04,0x0E}}, {'J', {0x07,0x02,0x02,0x02,0x02,0x12,0x0C}},
+    {'K', {0x11,0x12,0x14,0x18,0x14,0x12,0x11}}, {'L', {0x10,0x10,0x10,0x10,0x10,0x10,0x1F}},
+    {'M', {0x11,0x1B,0x15,0x15,0x11,0x11,0x11}}, {'N', {0x11,0x11,0x19,0x15,0x13,0x11,0x11}},
+    {'O', {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E}}, {'P', {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10}},
+    {'Q', {0x0E,0x11,0x11,0x11,0x15,0x12,0x0D}}, {'R', {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11}},
+    {'S', {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E}}, {'T', {0x1F,0x04,0x04,0x04,0x04,0x04,0x04}},
+    {'U', {0x11,0x11,0x11,0x11,0x11,0x11,0x0E}}, {'V', {0x11,0x11,0x11,0x11,0x11,0x0A,0x04}},
+    {'W', {0x11,0x11,0x11,0x15,0x15,0x15,0x0A}}, {'X', {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11}},
+    {'Y', {0x11,0x11,0x11,0x0A,0x04,0x04,0x04}}, {'Z', {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F}},
+    {'.', {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}}, {',', {0x00,0x00,0x00,0x00,0x0C,0x04,0x08}},
+    {':', {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}}, {'-', {0x00,0x00,0x00,0x1F,0x00,0x00,0x00}},
+    {'/', {0x00,0x01,0x02,0x04,0x08,0x10,0x00}},
+};
+
+// Typical header fields
+//
+static const char* const sampleTexts[] =
+{
+    "DOE JOHN",
+    "MRN 00843967",
+    "1965-03-12 M",
+    "ROOM 130/2, 7.5 MHZ",
+};
+
+// A font for the synthetic films: glyphs as ink masks of the same height
+//
+struct BenchmarkFont
+{
+    QString name;
+    QString tableName; // Glyph table to match with, empty for the built-in font
+    int glyphWidth;
+    int glyphHeight;
+    QMap<QChar, QByteArray> glyphs;
+};
+
+static BenchmarkFont builtinFont(bool bold)
+{
+    BenchmarkFont font;
+    font.name = bold? "builtin-5x7-bold": "builtin-5x7";
+    font.glyphWidth = bold? 6: 5;
+    font.glyphHeight = 7;
+
+    for (size_t i = 0; i < sizeof(font5x7) / sizeof(font5x7[0]); ++i)
+    {
+        QByteArray pixels(font.glyphWidth * font.glyphHeight, 0);
+        for (int y = 0; y < 7; ++y)
+        {
+            for (int x = 0; x < 5; ++x)
+            {
+                if (font5x7[i].rows[y] & (0x10 >> x))
+                {
+                    pixels[y * font.glyphWidth + x] = (char)0xFF;
+                    if (bold)
+                    {
+                        pixels[y * font.glyphWidth + x + 1] = (char)0xFF;
+                    }
+                }
+            }
+        }
+        font.glyphs[font5x7[i].ch] = pixels;
+    }
+
+    return font;
+}
+
+static QList<BenchmarkFont> glyphTableFonts()
+{
+    QList<BenchmarkFont> fonts;
+    auto path = QUtf8Settings().value("glyphs-path", DEFAULT_GLYPHS_PATH).toString();
+    Q_FOREACH (auto file, QDir(path).entryInfoList(QStringList() << "*.glyphs", QDir::Files))
+    {
+        GlyphMatcher matcher(file.completeBaseName());
+        if (!matcher.load())
+        {
+            continue;
+        }
+
+        BenchmarkFont font;
+        font.name = font.tableName = file.completeBaseName();
+        font.glyphWidth = GLYPH_WIDTH;
+        font.glyphHeight = GLYPH_HEIGHT;
+        Q_FOREACH (const auto& glyph, matcher.glyphList())
+        {
+            if (!font.glyphs.contains(glyph.ch))
+            {
+                font.glyphs[glyph.ch] = glyph.pixels;
+            }
+        }
+        fonts.append(font);
+    }
+    return fonts;
+}
+
+// Draws the text, returns the box of it and the text as drawn (unknown characters dropped)
+//
+static QRect drawText(QByteArray& film, const BenchmarkFont& font, int scale, int left, int top,
+                      const QString& text, uchar ink, QString& drawn)
+{
+    auto x = left;
+    auto advance = (font.glyphWidth + qMax(1, font.glyphWidth / 5)) * scale;
+    drawn.clear();
+
+    Q_FOREACH (auto ch, text)
+    {
+        if (ch == ' ')
+        {
+            x += advance;
+            drawn.append(ch);
+            continue;
+        }
+
+        if (!font.glyphs.contains(ch))
+        {
+            continue;
+        }
+
+        // Keep off the right edge
+        //
+        if (x + font.glyphWidth * scale > FILM_WIDTH)
+        {
+            break;
+        }
+
+        auto glyph = font.glyphs.value(ch);
+        for (int y = 0; y < font.glyphHeight * scale; ++y)
+        {
+            auto dst = (uchar*)film.data() + (top + y) * FILM_WIDTH + x;
+            auto src = (const uchar*)glyph.constData() + (y / scale) * font.glyphWidth;
+            for (int gx = 0; gx < font.glyphWidth * scale; ++gx)
+            {
+                if (src[gx / scale])
+                {
+                    dst[gx] = ink;
+                }
+            }
+        }
+        x += advance;
+        drawn.append(ch);
+    }
+
+    // Leave a margin around the text, like the tag rules usually do
+    //
+    auto margin = 4 * scale;
+    return QRect(left - margin, top - margin, x - left + 2 * margin, font.glyphHeight * scale + 2 * margin);
+}
+
+static int editDistance(const QString& a, const QString& b)
+{
+    QVector<int> prev(b.size() + 1), curr(b.size() + 1);
+    for (int j = 0; j <= b.size(); ++j)
+    {
+        prev[j] = j;
+    }
+
+    for (int i = 1; i <= a.size(); ++i)
+    {
+        curr[0] = i;
+        for (int j = 1; j <= b.size(); ++j)
+        {
+            curr[j] = qMin(qMin(prev[j] + 1, curr[j - 1] + 1), prev[j - 1] + (a[i - 1] == b[j - 1]? 0: 1));
+        }
+        prev.swap(curr);
+    }
+
+    return prev[b.size()];
+}
+
+static qint64 peakMemoryKb()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return usage.ru_maxrss;
+    }
+#endif
+    return -1;
+}
+
+// Makes the dataset a grayscale film of 8 bits per pixel
+//
+static void putFilm(DcmDataset* dataset, const QByteArray& film, int width, int height)
+{
+    dataset->putAndInsertString(DCM_PhotometricInterpretation, "MONOCHROME2");
+    dataset->putAndInsertUint16(DCM_SamplesPerPixel, 1);
+    dataset->putAndInsertUint16(DCM_Rows, height);
+    dataset->putAndInsertUint16(DCM_Columns, width);
+    dataset->putAndInsertUint16(DCM_BitsAllocated, 8);
+    dataset->putAndInsertUint16(DCM_BitsStored, 8);
+    dataset->putAndInsertUint16(DCM_HighBit, 7);
+    dataset->putAndInsertUint16(DCM_PixelRepresentation, 0);
+    dataset->putAndInsertUint8Array(DCM_PixelData, (const Uint8*)film.constData(), film.size());
+}
+
+// Typical film sizes, in pixels
+//
+static const struct
+{
+    int width;
+    int height;
+} renderSizes[] =
+{
+    { 2048, 1536 },
+    { 2560, 3072 },
+    { 4096, 5120 },
+};
+
+// Renders whole films the way the OCR did it before (32 bit AWT bitmap)
+// and the way it does now (8 bits per pixel), without the OCR itself.
+//
+static QJsonArray benchmarkRender(int iterations)
+{
+    QJsonArray results;
+    for (size_t i = 0; i < sizeof(renderSizes) / sizeof(renderSizes[0]); ++i)
+    {
+        auto width = renderSizes[i].width;
+        auto height = renderSizes[i].height;
+        QByteArray film(width * height, 0);
+        for (int p = 0; p < film.size(); ++p)
+        {
+            film[p] = (char)(p * 7 % 251);
+        }
+
+        DcmDataset dataset;
+        putFilm(&dataset, film, width, height);
+
+        qint64 time32 = 0, time8 = 0;
+        qint64 size32 = 0, size8 = 0;
+        for (int iteration = 0; iteration < iterations; ++iteration)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            {
+                DicomImage di(&dataset, EXS_LittleEndianExplicit);
+                void *img = nullptr;
+                size32 = di.createJavaAWTBitmap(img, 0, 32);
+                delete[] (Uint32*)img;
+            }
+            time32 += timer.nsecsElapsed();
+
+            timer.restart();
+            {
+                DicomImage di(&dataset, EXS_LittleEndianExplicit);
+                size8 = di.getOutputData(8)? di.getOutputDataSize(8): 0;
+            }
+            time8 += timer.nsecsElapsed();
+        }
+
+        QJsonObject result;
+        result["width"] = width;
+        result["height"] = height;
+        result["awt32-ms"] = time32 / 1e6 / iterations;
+        result["awt32-buffer-kb"] = size32 / 1024;
+        result["gray8-ms"] = time8 / 1e6 / iterations;
+        result["gray8-buffer-kb"] = size8 / 1024;
+        results.append(result);
+    }
+
+    return results;
+}
+
+int benchmarkOcr(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto iterations = args.isEmpty()? DEFAULT_BENCHMARK_ITERATIONS: args[0].toInt();
+    if (iterations < 1)
+    {
+        out << "Usage: " << PRODUCT_SHORT_NAME << " --benchmark-ocr [iterations]" << endl;
+        return 1;
+    }
+
+    QUtf8Settings settings;
+    auto lang = settings.value("ocr-lang", DEFAULT_OCR_LANG).toString();
+    auto& pool = OcrEnginePool::instance();
+
+    QList<BenchmarkFont> fonts;
+    fonts << builtinFont(false) << builtinFont(true) << glyphTableFonts();
+
+    // The configured preprocessing, or a typical one if it is off in the settings
+    //
+    ImagePrepOptions preps[2];
+    preps[1] = ImagePrepOptions::fromSettings(settings);
+    if (!preps[1].isEnabled())
+    {
+        preps[1].polarity = ImagePrepOptions::PolarityAuto;
+        preps[1].upscale = 2;
+        preps[1].binarize = true;
+    }
+    const QString prepNames[2] = { "off", preps[1].toString() };
+
+    QJsonArray cases;
+    qint64 totalRender[2] = { 0, 0 }, totalOcr[2] = { 0, 0 };
+    int totalChars[2] = { 0, 0 }, totalErrors[2] = { 0, 0 }, totalCases[2] = { 0, 0 };
+
+    Q_FOREACH (auto font, fonts)
+    {
+        for (int scale = 2; scale <= 4; ++scale)
+        {
+            for (int inverted = 0; inverted < 2; ++inverted)
+            {
+                // Tesseract for all fonts, the glyph table for its own font as well
+                //
+                QStringList engines("tesseract");
+                if (!font.tableName.isEmpty())
+                {
+                    engines << "glyphs";
+                }
+
+                // Each case with the preprocessing off and on
+                //
+                for (int prepIdx = 0; prepIdx < 2; ++prepIdx)
+                {
+                    pool.setImagePrep(preps[prepIdx]);
+                    Q_FOREACH (auto engine, engines)
+                    {
+                        qint64 renderTime = 0, ocrTime = 0;
+                        int chars = 0, errors = 0;
+                        QJsonArray fields;
+
+                        for (int iteration = 0; iteration < iterations; ++iteration)
+                        {
+                            // Light text over dark background, as most modalities print,
+                            // or the other way around. The noise differs between iterations,
+                            // so the OCR cache does not hide the recognition cost.
+                            //
+                            uchar background = inverted? 220: 30;
+                            uchar ink = inverted? 20: 230;
+                            QByteArray film(FILM_WIDTH * FILM_HEIGHT, 0);
+                            quint32 seed = 12345 + iteration;
+                            for (int i = 0; i < film.size(); ++i)
+                            {
+                                seed = seed * 1103515245 + 12345;
+                                film[i] = (char)qBound(0, background + (int)((seed >> 16) % (2 * FILM_NOISE + 1)) - FILM_NOISE, 255);
+                            }
+
+                            QList<OcrRegion> regions;
+                            QStringList expected;
+                            auto top = 20;
+                            for (size_t i = 0; i < sizeof(sampleTexts) / sizeof(sampleTexts[0]); ++i)
+                            {
+                                QString drawn;
+                                OcrRegion region;
+                                region.rect = drawText(film, font, scale, 20, top, sampleTexts[i], ink, drawn);
+                                region.params.lang = lang;
+                                if (engine == "glyphs")
+                                {
+                                    region.params.font = font.tableName;
+                                }
+                                regions.append(region);
+                                expected.append(drawn);
+                                top += region.rect.height() + 8 * scale;
+                            }
+
+                            DcmDataset dataset;
+                            putFilm(&dataset, film, FILM_WIDTH, FILM_HEIGHT);
+
+                            // Same stages as webQuery does
+                            //
+                            QElapsedTimer timer;
+                            timer.start();
+                            DicomImage di(&dataset, EXS_LittleEndianExplicit);
+                            OcrImage img(&di);
+                            QList<QRect> rects;
+                            Q_FOREACH (auto region, regions)
+                            {
+                                rects.append(img.resolve(region.rect));
+                            }
+                            img.setRegions(rects);
+                            renderTime += timer.nsecsElapsed();
+
+                            timer.restart();
+                            auto texts = pool.recognize(img, regions);
+                            ocrTime += timer.nsecsElapsed();
+
+                            for (int i = 0; i < texts.size(); ++i)
+                            {
+                                auto text = texts[i].simplified();
+                                auto distance = editDistance(text, expected[i]);
+                                chars += expected[i].size();
+                                errors += distance;
+                                if (iteration == 0)
+                                {
+                                    QJsonObject field;
+                                    field["expected"] = expected[i];
+                                    field["recognized"] = text;
+                                    field["errors"] = distance;
+                                    fields.append(field);
+                                }
+                            }
+                        }
+
+                        QJsonObject result;
+                        result["font"] = font.name;
+                        result["scale"] = scale;
+                        result["polarity"] = inverted? "dark-on-light": "light-on-dark";
+                        result["engine"] = engine;
+                        result["preprocessing"] = prepNames[prepIdx];
+                        result["render-ms"] = renderTime / 1e6 / iterations;
+                        result["ocr-ms"] = ocrTime / 1e6 / iterations;
+                        result["char-error-rate"] = chars? (double)errors / chars: 0.0;
+                        result["peak-memory-kb"] = peakMemoryKb();
+                        result["fields"] = fields;
+                        cases.append(result);
+
+                        totalRender[prepIdx] += renderTime;
+                        totalOcr[prepIdx] += ocrTime;
+                        totalChars[prepIdx] += chars;
+                        totalErrors[prepIdx] += errors;
+                        ++totalCases[prepIdx];
+                    }
+                }
+            }
+        }
+    }
+
+    QJsonObject config;
+    Q_FOREACH (auto key, QStringList() << "ocr-lang" << "ocr-threads" << "ocr-polarity" << "ocr-upscale"
+               << "ocr-binarize" << "ocr-region-timeout-ms" << "ocr-image-timeout-ms" << "glyph-confidence")
+    {
+        config[key] = settings.value(key).toString();
+    }
+
+    // The configured preprocessing stays for the rest of the process
+    //
+    pool.setImagePrep(ImagePrepOptions::fromSettings(settings));
+
+    QJsonObject summary;
+    for (int prepIdx = 0; prepIdx < 2; ++prepIdx)
+    {
+        auto films = totalCases[prepIdx] * iterations;
+        QJsonObject prepSummary;
+        prepSummary["preprocessing"] = prepNames[prepIdx];
+        prepSummary["films"] = films;
+        prepSummary["render-ms"] = totalRender[prepIdx] / 1e6 / qMax(1, films);
+        prepSummary["ocr-ms"] = totalOcr[prepIdx] / 1e6 / qMax(1, films);
+        prepSummary["char-error-rate"] = totalChars[prepIdx]? (double)totalErrors[prepIdx] / totalChars[prepIdx]: 0.0;
+        summary[prepIdx? "preprocessing-on": "preprocessing-off"] = prepSummary;
+    }
+    summary["peak-memory-kb"] = peakMemoryKb();
+
+    QJsonObject report;
+    report["version"] = PRODUCT_VERSION_STR;
+#ifdef WITH_TESSERACT
+    report["tesseract"] = tesseract::TessBaseAPI::Version();
+#endif
+    report["iterations"] = iterations;
+    report["settings"] = config;
+    report["summary"] = summary;
+    report["cases"] = cases;
+    report["render"] = benchmarkRender(iterations);
+
+    out << QJsonDocument(report).toJson();
+    return 0;
+}
+
+// The stages of a film, in the order they are done
+//
+static const char* const printStages[] =
+{
+    "associate", "film-session", "film-box", "image-box", "print", "delete", "release",
+};
+
+struct PrintBenchmark
+{
+    QString aetitle;
+    QString address;
+    int films;
+    int boxes;
+    QAtomicInt nextFilm;
+    QMutex lock;
+    QMap<QString, QVector<double> > stages; // Milliseconds
+    int failed;
+};
+
+// Same as the printer does with the upstream: send the request, wait for the response
+//
+static OFCondition sendPrintRequest(T_ASC_Association* assoc, T_DIMSE_Message& rq, DcmDataset* rqDataset,
+                                    DcmDataset** rspDataset)
+{
+    auto cond = DIMSE_sendMessageUsingMemoryData(assoc, 1, &rq, nullptr, rqDataset, nullptr, nullptr);
+    if (cond.bad())
+    {
+        return cond;
+    }
+
+    T_DIMSE_Message rsp;
+    T_ASC_PresentationContextID presId = 0;
+    DcmDataset* statusDetail = nullptr;
+    cond = DIMSE_receiveCommand(assoc, DIMSE_BLOCKING, 0, &presId, &rsp, &statusDetail);
+    delete statusDetail;
+    if (cond.bad())
+    {
+        return cond;
+    }
+
+    DIC_US status = STATUS_Success;
+    T_DIMSE_DataSetType dataSetType = DIMSE_DATASET_NULL;
+    switch (rsp.CommandField)
+    {
+    case DIMSE_N_CREATE_RSP:
+        status = rsp.msg.NCreateRSP.DimseStatus;
+        dataSetType = rsp.msg.NCreateRSP.DataSetType;
+        if (rq.CommandField == DIMSE_N_CREATE_RQ)
+        {
+            strncpy(rq.msg.NCreateRQ.AffectedSOPInstanceUID, rsp.msg.NCreateRSP.AffectedSOPInstanceUID, sizeof(DIC_UI));
+        }
+        break;
+    case DIMSE_N_SET_RSP:
+        status = rsp.msg.NSetRSP.DimseStatus;
+        dataSetType = rsp.msg.NSetRSP.DataSetType;
+        break;
+    case DIMSE_N_ACTION_RSP:
+        status = rsp.msg.NActionRSP.DimseStatus;
+        dataSetType = rsp.msg.NActionRSP.DataSetType;
+        break;
+    case DIMSE_N_DELETE_RSP:
+        status = rsp.msg.NDeleteRSP.DimseStatus;
+        dataSetType = rsp.msg.NDeleteRSP.DataSetType;
+        break;
+    default:
+        return DIMSE_BADCOMMANDTYPE;
+    }
+
+    DcmDataset* dataset = nullptr;
+    if (dataSetType != DIMSE_DATASET_NULL)
+    {
+        cond = DIMSE_receiveDataSetInMemory(assoc, DIMSE_BLOCKING, 0, &presId, &dataset, nullptr, nullptr);
+        if (cond.bad())
+        {
+            return cond;
+        }
+    }
+
+    if (rspDataset)
+    {
+        *rspDataset = dataset;
+    }
+    else
+    {
+        delete dataset;
+    }
+
+    return status == STATUS_Success? EC_Normal: makeOFCondition(0, 2, OF_error, "Print request failed");
+}
+
+static DcmItem* benchmarkImage(const QByteArray& film)
+{
+    auto item = new DcmItem;
+    item->putAndInsertUint16(DCM_SamplesPerPixel, 1);
+    item->putAndInsertString(DCM_PhotometricInterpretation, "MONOCHROME2");
+    item->putAndInsertUint16(DCM_Rows, FILM_HEIGHT);
+    item->putAndInsertUint16(DCM_Columns, FILM_WIDTH);
+    item->putAndInsertUint16(DCM_BitsAllocated, 8);
+    item->putAndInsertUint16(DCM_BitsStored, 8);
+    item->putAndInsertUint16(DCM_HighBit, 7);
+    item->putAndInsertUint16(DCM_PixelRepresentation, 0);
+    item->putAndInsertUint8Array(DCM_PixelData, (const Uint8*)film.constData(), film.size());
+
+    // The DICOM stub measures the way to the storage from here
+    //
+    item->putAndInsertString(DCM_ImageComments,
+        QString("BENCHMARK %1").arg(QDateTime::currentMSecsSinceEpoch()).toUtf8());
+    return item;
+}
+
+static bool printFilm(PrintBenchmark& bench, T_ASC_Network* net, int filmNo)
+{
+    QMap<QString, double> times;
+    QElapsedTimer timer;
+    timer.start();
+
+    // Same patient on every box of the film, a new one for every film
+    //
+    QByteArray film(FILM_WIDTH * FILM_HEIGHT, 30);
+    auto font = builtinFont(false);
+    QString drawn;
+    auto top = 20;
+    for (size_t i = 0; i < sizeof(sampleTexts) / sizeof(sampleTexts[0]); ++i)
+    {
+        QString text = i == 1? QString("MRN %1").arg(filmNo, 8, 10, QChar('0')): QString(sampleTexts[i]);
+        top += drawText(film, font, 3, 20, top, text, 230, drawn).height() + 24;
+    }
+
+    T_ASC_Parameters* params = nullptr;
+    auto cond = ASC_createAssociationParameters(&params, ASC_DEFAULTMAXPDU);
+    if (cond.bad())
+    {
+        return false;
+    }
+
+    DIC_NODENAME localHost;
+    gethostname(localHost, sizeof(localHost) - 1);
+    ASC_setAPTitles(params, "BENCHMARK", bench.aetitle.toUtf8(), nullptr);
+    ASC_setPresentationAddresses(params, localHost, bench.address.toUtf8());
+    const char* xfers[] = { UID_LittleEndianExplicitTransferSyntax, UID_LittleEndianImplicitTransferSyntax };
+    ASC_addPresentationContext(params, 1, UID_BasicGrayscalePrintManagementMetaSOPClass, xfers, 2);
+
+    T_ASC_Association* assoc = nullptr;
+    cond = ASC_requestAssociation(net, params, &assoc);
+    if (cond.bad() || ASC_countAcceptedPresentationContexts(assoc->params) == 0)
+    {
+        qDebug() << "Association to" << bench.aetitle << bench.address << "failed" << QString::fromLocal8Bit(cond.text());
+        ASC_destroyAssociation(&assoc);
+        return false;
+    }
+    times["associate"] = timer.nsecsElapsed() / 1e6;
+
+    T_DIMSE_Message rq;
+    DcmDataset* rspDataset = nullptr;
+
+    // Film session
+    //
+    timer.restart();
+    memset(&rq, 0, sizeof(rq));
+    rq.CommandField = DIMSE_N_CREATE_RQ;
+    rq.msg.NCreateRQ.MessageID = assoc->nextMsgID++;
+    strcpy(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmSessionSOPClass);
+    rq.msg.NCreateRQ.DataSetType = DIMSE_DATASET_PRESENT;
+    DcmDataset session;
+    session.putAndInsertString(DCM_NumberOfCopies, "1");
+    session.putAndInsertString(DCM_FilmSessionLabel, QString("BENCHMARK %1").arg(filmNo).toUtf8());
+    cond = sendPrintRequest(assoc, rq, &session, nullptr);
+    QString sessionUid = rq.msg.NCreateRQ.AffectedSOPInstanceUID;
+    times["film-session"] = timer.nsecsElapsed() / 1e6;
+
+    // Film box, the response lists the image boxes
+    //
+    QStringList imageBoxes;
+    QString filmBoxUid;
+    if (cond.good())
+    {
+        timer.restart();
+        memset(&rq, 0, sizeof(rq));
+        rq.CommandField = DIMSE_N_CREATE_RQ;
+        rq.msg.NCreateRQ.MessageID = assoc->nextMsgID++;
+        strcpy(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmBoxSOPClass);
+        rq.msg.NCreateRQ.DataSetType = DIMSE_DATASET_PRESENT;
+        DcmDataset filmBox;
+        filmBox.putAndInsertString(DCM_ImageDisplayFormat, QString("STANDARD\\%1,1").arg(bench.boxes).toUtf8());
+        auto ref = new DcmItem;
+        ref->putAndInsertString(DCM_ReferencedSOPClassUID, UID_BasicFilmSessionSOPClass);
+        ref->putAndInsertString(DCM_ReferencedSOPInstanceUID, sessionUid.toUtf8());
+        filmBox.insertSequenceItem(DCM_ReferencedFilmSessionSequence, ref);
+        cond = sendPrintRequest(assoc, rq, &filmBox, &rspDataset);
+        filmBoxUid = rq.msg.NCreateRQ.AffectedSOPInstanceUID;
+        times["film-box"] = timer.nsecsElapsed() / 1e6;
+
+        DcmItem* item = nullptr;
+        for (int i = 0; rspDataset && rspDataset->findAndGetSequenceItem(DCM_ReferencedImageBoxSequence, item, i).good(); ++i)
+        {
+            const char* uid = nullptr;
+            if (item->findAndGetString(DCM_ReferencedSOPInstanceUID, uid).good() && uid)
+            {
+                imageBoxes.append(QString::fromUtf8(uid));
+            }
+        }
+        delete rspDataset;
+        rspDataset = nullptr;
+    }
+
+    // Image boxes, the time is per box
+    //
+    for (int i = 0; cond.good() && i < imageBoxes.size(); ++i)
+    {
+        timer.restart();
+        memset(&rq, 0, sizeof(rq));
+        rq.CommandField = DIMSE_N_SET_RQ;
+        rq.msg.NSetRQ.MessageID = assoc->nextMsgID++;
+        strcpy(rq.msg.NSetRQ.RequestedSOPClassUID, UID_BasicGrayscaleImageBoxSOPClass);
+        strncpy(rq.msg.NSetRQ.RequestedSOPInstanceUID, imageBoxes[i].toUtf8(), sizeof(DIC_UI) - 1);
+        rq.msg.NSetRQ.DataSetType = DIMSE_DATASET_PRESENT;
+        DcmDataset imageBox;
+        imageBox.putAndInsertUint16(DCM_ImageBoxPosition, i + 1);
+        imageBox.insertSequenceItem(DCM_BasicGrayscaleImageSequence, benchmarkImage(film));
+        cond = sendPrintRequest(assoc, rq, &imageBox, nullptr);
+        times["image-box"] += timer.nsecsElapsed() / 1e6 / imageBoxes.size();
+    }
+
+    if (cond.good())
+    {
+        timer.restart();
+        memset(&rq, 0, sizeof(rq));
+        rq.CommandField = DIMSE_N_ACTION_RQ;
+        rq.msg.NActionRQ.MessageID = assoc->nextMsgID++;
+        strcpy(rq.msg.NActionRQ.RequestedSOPClassUID, UID_BasicFilmBoxSOPClass);
+        strncpy(rq.msg.NActionRQ.RequestedSOPInstanceUID, filmBoxUid.toUtf8(), sizeof(DIC_UI) - 1);
+        rq.msg.NActionRQ.ActionTypeID = 1; // Print
+        rq.msg.NActionRQ.DataSetType = DIMSE_DATASET_NULL;
+        cond = sendPrintRequest(assoc, rq, nullptr, nullptr);
+        times["print"] = timer.nsecsElapsed() / 1e6;
+    }
+
+    if (cond.good())
+    {
+        timer.restart();
+        memset(&rq, 0, sizeof(rq));
+        rq.CommandField = DIMSE_N_DELETE_RQ;
+        rq.msg.NDeleteRQ.MessageID = assoc->nextMsgID++;
+        strcpy(rq.msg.NDeleteRQ.RequestedSOPClassUID, UID_BasicFilmSessionSOPClass);
+        strncpy(rq.msg.NDeleteRQ.RequestedSOPInstanceUID, sessionUid.toUtf8(), sizeof(DIC_UI) - 1);
+        rq.msg.NDeleteRQ.DataSetType = DIMSE_DATASET_NULL;
+        cond = sendPrintRequest(assoc, rq, nullptr, nullptr);
+        times["delete"] = timer.nsecsElapsed() / 1e6;
+    }
+
+    timer.restart();
+    if (cond.good())
+    {
+        ASC_releaseAssociation(assoc);
+    }
+    else
+    {
+        qDebug() << "Film" << filmNo << "failed" << QString::fromLocal8Bit(cond.text());
+        ASC_abortAssociation(assoc);
+    }
+    ASC_destroyAssociation(&assoc);
+    times["release"] = timer.nsecsElapsed() / 1e6;
+
+    QMutexLocker locker(&bench.lock);
+    for (auto i = times.constBegin(); i != times.constEnd(); ++i)
+    {
+        bench.stages[i.key()].append(i.value());
+    }
+    return cond.good();
+}
+
+int benchmarkPrint(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto target = args.value(0).split('@');
+    PrintBenchmark bench;
+    bench.aetitle = target.value(0);
+    bench.address = target.value(1);
+    bench.films   = args.value(1, QString::number(DEFAULT_BENCHMARK_FILMS)).toInt();
+    bench.boxes   = args.value(2, QString::number(DEFAULT_BENCHMARK_BOXES)).toInt();
+    bench.failed  = 0;
+    auto parallel = args.value(3, QString::number(DEFAULT_BENCHMARK_PARALLEL)).toInt();
+
+    if (target.size() != 2 || bench.films < 1 || bench.boxes < 1 || parallel < 1)
+    {
+        out << "Usage: " << PRODUCT_SHORT_NAME
+            << " --benchmark-print <aetitle@host:port> [films] [boxes] [parallel]" << endl;
+        return 1;
+    }
+
+    // Every modality is a network client of its own
+    //
+    QThreadPool threads;
+    threads.setMaxThreadCount(parallel);
+    QElapsedTimer elapsed;
+    elapsed.start();
+    for (int i = 0; i < parallel; ++i)
+    {
+        QtConcurrent::run(&threads, [&bench]()
+        {
+            T_ASC_Network* net = nullptr;
+            if (ASC_initializeNetwork(NET_REQUESTOR, 0, 30, &net).bad())
+            {
+                return;
+            }
+
+            for (int filmNo = bench.nextFilm.fetchAndAddOrdered(1); filmNo < bench.films;
+                 filmNo = bench.nextFilm.fetchAndAddOrdered(1))
+            {
+                if (!printFilm(bench, net, filmNo))
+                {
+                    QMutexLocker locker(&bench.lock);
+                    ++bench.failed;
+                }
+            }
+            ASC_dropNetwork(&net);
+        });
+    }
+    threads.waitForDone();
+    auto elapsedMs = qMax(1LL, (qint64)elapsed.elapsed());
+
+    QJsonObject stages;
+    for (size_t i = 0; i < sizeof(printStages) / sizeof(printStages[0]); ++i)
+    {
+        auto stage = printStages[i];
+        auto times = bench.stages.value(stage);
+        std::sort(times.begin(), times.end());
+        double total = 0;
+        Q_FOREACH (auto time, times)
+        {
+            total += time;
+        }
+
+        QJsonObject result;
+        result["count"] = times.size();
+        result["mean-ms"] = times.isEmpty()? 0.0: total / times.size();
+        result["p50-ms"] = times.isEmpty()? 0.0: times[times.size() * 50 / 100];
+        result["p95-ms"] = times.isEmpty()? 0.0: times[qMin(times.size() - 1, times.size() * 95 / 100)];
+        result["p99-ms"] = times.isEmpty()? 0.0: times[qMin(times.size() - 1, times.size() * 99 / 100)];
+        stages[stage] = result;
+    }
+
+    auto printed = bench.films - bench.failed;
+    QJsonObject report;
+    report["version"] = PRODUCT_VERSION_STR;
+    report["target"] = args[0];
+    report["films"] = bench.films;
+    report["boxes-per-film"] = bench.boxes;
+    report["parallel"] = parallel;
+    report["failed-films"] = bench.failed;
+    report["elapsed-ms"] = elapsedMs;
+    report["films-per-second"] = printed * 1000.0 / elapsedMs;
+    report["images-per-second"] = printed * bench.boxes * 1000.0 / elapsedMs;
+    report["stages"] = stages;
+
+    out << QJsonDocument(report).toJson();
+    return bench.failed? 1: 0;
+}
+
+// The QVariant codec the printer used before the typed one, copied verbatim
+// from printscp.cpp, so the baseline is the real code. The tag is passed
+// as the key, so the dictionary is searched on each call, as it was.
+//
+static OFCondition putAndInsertVariant(DcmDataset* dataset, const DcmTag& tag, const QVariant& value)
+{
+    switch (tag.getEVR())
+    {
+    case EVR_FL:
+    case EVR_OF:
+        return dataset->putAndInsertFloat32(tag, value.toFloat());
+    case EVR_FD:
+        return dataset->putAndInsertFloat64(tag, value.toDouble());
+    case EVR_SL:
+        return dataset->putAndInsertSint32(tag, value.toInt());
+    case EVR_UL:
+        return dataset->putAndInsertUint32(tag, value.toUInt());
+    case EVR_SS:
+        return dataset->putAndInsertSint16(tag, (Sint16)value.toInt());
+    case EVR_US:
+        return dataset->putAndInsertUint16(tag, (Uint16)value.toUInt());
+    case EVR_DA:
+        return dataset->putAndInsertString(tag, value.toDate().toString("yyyyMMdd").toUtf8());
+    case EVR_DT:
+        return dataset->putAndInsertString(tag, value.toDateTime().toString("yyyyMMddHHmmss").toUtf8());
+    case EVR_TM:
+        return dataset->putAndInsertString(tag, value.toTime().toString("HHmmss").toUtf8());
+    default:
+        if (tag.getVR().isaString())
+        {
+            return dataset->putAndInsertString(tag, value.toString().toUtf8());
+        }
+        break;
+    }
+
+    qDebug() << "VR" << tag.getVRName() << "not implemented";
+    return EC_IllegalParameter;
+}
+
+static OFCondition findAndGetVariant(DcmDataset* dataset, const DcmTag& tag, QVariant& value)
+{
+    OFCondition cond;
+    switch (tag.getEVR())
+    {
+    case EVR_FL:
+    case EVR_OF:
+        {
+            float f = 0.0f;
+            cond = dataset->findAndGetFloat32(tag, f);
+            if (cond.good()) { value.setValue(f); }
+            break;
+        }
+    case EVR_FD:
+        {
+            double d = 0.0;
+            cond = dataset->findAndGetFloat64(tag, d);
+            if (cond.good()) { value.setValue(d); }
+            break;
+        }
+    case EVR_SL:
+        {
+            Sint32 i = 0;
+            cond = dataset->findAndGetSint32(tag, i);
+            if (cond.good()) { value.setValue(i); }
+            break;
+        }
+    case EVR_UL:
+        {
+            Uint32 u = 0;
+            cond = dataset->findAndGetUint32(tag, u);
+            if (cond.good()) { value.setValue(u); }
+            break;
+        }
+    case EVR_SS:
+        {
+            Sint16 i = 0;
+            cond = dataset->findAndGetSint16(tag, i);
+            if (cond.good()) { value.setValue(i); }
+            break;
+        }
+    case EVR_US:
+        {
+            Uint16 u = 0;
+            cond = dataset->findAndGetUint16(tag, u);
+            if (cond.good()) { value.setValue(u); }
+            break;
+        }
+    case EVR_DA:
+        {
+            const char* str = nullptr;
+            cond = dataset->findAndGetString(tag, str);
+            if (cond.good())
+            {
+                value.setValue(QDate::fromString(str, "yyyyMMdd"));
+            }
+            break;
+        }
+    case EVR_DT:
+        {
+            const char* str = nullptr;
+            cond = dataset->findAndGetString(tag, str);
+            if (cond.good())
+            {
+                value.setValue(QDateTime::fromString(str, "yyyyMMddHHmmss"));
+            }
+            break;
+        }
+    case EVR_TM:
+        {
+            const char* str = nullptr;
+            cond = dataset->findAndGetString(tag, str);
+            if (cond.good())
+            {
+                value.setValue(QTime::fromString(str, "HHmmss"));
+            }
+            break;
+        }
+    default:
+        if (tag.getVR().isaString())
+        {
+            const char* str = nullptr;
+            cond = dataset->findAndGetString(tag, str);
+            if (cond.good())
+            {
+                value.setValue(QString::fromUtf8(str));
+            }
+        }
+        else
+        {
+            qDebug() << "VR" << tag.getVRName() << "not implemented";
+            cond = EC_IllegalParameter;
+            break;
+        }
+    }
+
+    return cond;
+}
+
+// Runs the function the given number of times, returns nanoseconds per call
+//
+template <typename Fn> static double measureNs(int iterations, Fn fn)
+{
+    int failed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i)
+    {
+        failed += fn().bad();
+    }
+    auto elapsed = timer.nsecsElapsed();
+    if (failed)
+    {
+        qWarning() << failed << "of" << iterations << "calls failed";
+    }
+    return (double)elapsed / iterations;
+}
+
+template <DcmEVR VR> static QJsonObject benchmarkAttr(const DcmTagKey& key, const typename AttrValue<VR>::Type& value,
+                                                      const QVariant& variant, const QString& text, int iterations)
+{
+    typedef typename AttrValue<VR>::Type Type;
+    const Attr<VR> attr(key);
+    auto textAttr = TextAttr::byTag(DcmTag(key));
+    DcmDataset dataset;
+
+    QJsonObject result;
+    result["legacy-put-ns"] = measureNs(iterations, [&]() { return putAndInsertVariant(&dataset, key, variant); });
+    result["typed-put-ns"]  = measureNs(iterations, [&]() { return attr.put(&dataset, value); });
+    result["text-put-ns"]   = measureNs(iterations, [&]() { return textAttr.put(&dataset, text); });
+
+    QVariant out;
+    Type typed = Type();
+    result["legacy-get-ns"] = measureNs(iterations, [&]() { return findAndGetVariant(&dataset, key, out); });
+    result["typed-get-ns"]  = measureNs(iterations, [&]() { return attr.get(&dataset, typed); });
+    result["text-get-ns"]   = measureNs(iterations, [&]() { return textAttr.get(&dataset, out); });
+
+    // Both codecs must read back the same value
+    //
+    QVariant legacy;
+    findAndGetVariant(&dataset, key, legacy);
+    textAttr.get(&dataset, out);
+    result["same-value"] = legacy == out;
+    return result;
+}
+
+int benchmarkCodec(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto iterations = args.value(0, QString::number(DEFAULT_BENCHMARK_CODEC_ITERATIONS)).toInt();
+    if (iterations < 1)
+    {
+        out << "Usage: " << PRODUCT_SHORT_NAME << " --benchmark-codec [iterations]" << endl;
+        return 1;
+    }
+
+    auto now = QDateTime::fromString("2014-12-25T17:59:59", Qt::ISODate);
+
+    QJsonObject cases;
+    cases["US"] = benchmarkAttr<EVR_US>(DCM_Rows, 512, QVariant(512), "512", iterations);
+    cases["LO"] = benchmarkAttr<EVR_LO>(DCM_PatientID, "P-0012345", QVariant("P-0012345"), "P-0012345", iterations);
+    cases["DA"] = benchmarkAttr<EVR_DA>(DCM_StudyDate, now.date(), now, "20141225", iterations);
+    cases["TM"] = benchmarkAttr<EVR_TM>(DCM_StudyTime, now.time(), now, "175959", iterations);
+    cases["DT"] = benchmarkAttr<EVR_DT>(DCM_AcquisitionDateTime, now, now, "20141225175959", iterations);
+
+    QJsonObject report;
+    report["version"] = PRODUCT_VERSION_STR;
+    report["iterations"] = iterations;
+    report["cases"] = cases;
+
+    out << QJsonDocument(report).toJson();
+    return 0;
+}
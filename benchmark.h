@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QStringList>
+
+/** measures the OCR on synthetic films and prints the report as JSON.
+ *  The films carry known text in the built-in 5x7 font and in every glyph table
+ *  found in glyphs-path, at several sizes and both polarities. The films go through
+ *  the same render and OCR path as the printed ones, with the current settings.
+ *  Whole films of typical sizes are also rendered with the former 32 bit AWT bitmap
+ *  and with 8 bits per pixel, to compare the time and the buffer size.
+ *  @param args command line arguments after --benchmark-ocr: [iterations]
+ *  @return exit code
+ */
+int benchmarkOcr(const QStringList& args);
+
+/** prints synthetic films to the virtual printer, as a modality does,
+ *  and prints per-stage latencies and the throughput as JSON.
+ *  Each film is an association of its own: film session, film box, image boxes,
+ *  print and delete. With the DICOM stub (tests/stubs.h) behind the printer,
+ *  the stub reports the latency from the image box N-SET to the image stored.
+ *  @param args command line arguments after --benchmark-print:
+ *  <aetitle@host:port> [films] [boxes] [parallel]
+ *  @return exit code
+ */
+int benchmarkPrint(const QStringList& args);
+
+/** measures the dataset attribute codec and prints nanoseconds per call as JSON.
+ *  For a number, a string, a date, a time and a date-time, compares the QVariant codec
+ *  the printer used before with the typed (Attr) and the text (TextAttr) ones.
+ *  @param args command line arguments after --benchmark-codec: [iterations]
+ *  @return exit code
+ */
+int benchmarkCodec(const QStringList& args);
+
+#endif // BENCHMARK_H
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "demographics.h"
+#include "statistics.h"
+#include "webclient.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QRegExp>
+#include <QSaveFile>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+#include <QUtf8Settings>
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+
+DemographicsIndex& DemographicsIndex::instance()
+{
+    static DemographicsIndex index;
+    return index;
+}
+
+DemographicsIndex::DemographicsIndex()
+    : refreshInterval(DEFAULT_DEMOGRAPHICS_REFRESH_INTERVAL)
+    , table(new Table)
+    , fileModified(0)
+    , nextPull(0)
+    , refreshPid(0)
+    , pullFileModified(0)
+    , pullPid(0)
+    , listenerRefreshes(false)
+{
+    QUtf8Settings settings;
+    settings.beginGroup("demographics");
+    file            = settings.value("file").toString();
+    url             = settings.value("url").toUrl();
+    refreshInterval = settings.value("refresh-interval", refreshInterval).toInt();
+    pullFile        = settings.value("pull-file").toString();
+    if (pullFile.isEmpty())
+    {
+        pullFile = QDir::temp().filePath(QCoreApplication::applicationName() + "-demographics.json");
+    }
+
+    Q_FOREACH (auto param, settings.value("key").toStringList())
+    {
+        auto parts = param.split(QRegExp("=|:"));
+        keys.append(parts[0].trimmed());
+        fields.append(parts.value(1, parts[0]).trimmed());
+    }
+    settings.endGroup();
+}
+
+QString DemographicsIndex::key(const QStringList& values) const
+{
+    // The recognized text may differ from the RIS in case and spacing
+    //
+    QStringList normalized;
+    Q_FOREACH (auto value, values)
+    {
+        auto str = value.simplified().toUpper();
+        if (str.isEmpty())
+        {
+            return QString();
+        }
+        normalized.append(str);
+    }
+
+    return normalized.join(QChar(0x1F));
+}
+
+bool DemographicsIndex::find(const QVariantMap& queryParams, Record& record)
+{
+    if (isEmpty())
+    {
+        return false;
+    }
+
+    QStringList values;
+    Q_FOREACH (auto param, keys)
+    {
+        values.append(queryParams.value(param).toString());
+    }
+    auto k = key(values);
+
+    QSharedPointer<Table> current;
+    {
+        QMutexLocker locker(&lock);
+        startRefresh();
+        current = table;
+    }
+
+    // The table is never modified once published, so no lock is needed
+    //
+    if (k.isEmpty() || current->ambiguous.contains(k) || !current->records.contains(k))
+    {
+        countEvent("demographics-misses");
+        return false;
+    }
+
+    countEvent("demographics-hits");
+    record = current->records.value(k);
+    return true;
+}
+
+void DemographicsIndex::refreshIfDue()
+{
+    if (!isEmpty())
+    {
+        QMutexLocker locker(&lock);
+        startRefresh();
+    }
+}
+
+void DemographicsIndex::startRefresh()
+{
+    // The refresh started before fork() is not running in this process.
+    // Workers of the fork mode keep the records of the listener, it refreshes them.
+    //
+    if (refreshPid == getpid() || listenerRefreshes)
+    {
+        return;
+    }
+
+    auto due = !url.isEmpty() && QDateTime::currentMSecsSinceEpoch() >= nextPull;
+    if (!due && !file.isEmpty())
+    {
+        QFileInfo fi(file);
+        due = fi.exists() && fi.lastModified().toMSecsSinceEpoch() != fileModified;
+    }
+
+    if (due)
+    {
+        refreshPid = getpid();
+        QtConcurrent::run(QThreadPool::globalInstance(), [this]() { refresh(); });
+    }
+}
+
+QByteArray DemographicsIndex::readFile(const QString& path, qint64& modified)
+{
+    modified = 0;
+    if (path.isEmpty())
+    {
+        return QByteArray();
+    }
+
+    QFile f(path);
+    if (!f.exists())
+    {
+        return QByteArray();
+    }
+
+    modified = QFileInfo(f).lastModified().toMSecsSinceEpoch();
+    if (!f.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to read" << path << f.errorString();
+        return QByteArray();
+    }
+    return f.readAll();
+}
+
+QByteArray DemographicsIndex::pull() const
+{
+    QNetworkRequest rq(url);
+    rq.setRawHeader("Accept", "application/json");
+    auto reply = WebClient::instance().get(rq);
+
+    // A hung RIS must not stop the refresh forever
+    //
+    if (!WebClient::waitFor(reply, refreshInterval * 1000))
+    {
+        reply->abort();
+    }
+
+    QByteArray data;
+    if (reply->error())
+    {
+        qWarning() << "Failed to pull" << url << reply->errorString();
+    }
+    else
+    {
+        data = reply->readAll();
+    }
+    delete reply;
+    return data;
+}
+
+void DemographicsIndex::publish(const QByteArray& fileData, const QByteArray& pullData)
+{
+    QSharedPointer<Table> fresh(new Table);
+    load(fileData, *fresh);
+    load(pullData, *fresh);
+    qDebug() << "Demographics index has" << fresh->records.size() << "records";
+
+    QMutexLocker locker(&lock);
+    table = fresh;
+}
+
+void DemographicsIndex::refresh()
+{
+    qint64 modified = 0;
+    auto fileData = readFile(file, modified);
+
+    auto pulling = !url.isEmpty() && QDateTime::currentMSecsSinceEpoch() >= nextPull;
+    auto pullData = pulled;
+    if (pulling)
+    {
+        // Keep the records pulled before, if failed. Try again later
+        //
+        auto data = pull();
+        if (!data.isNull())
+        {
+            pullData = data;
+        }
+    }
+
+    publish(fileData, pullData);
+
+    QMutexLocker locker(&lock);
+    fileModified = modified;
+    pulled = pullData;
+    if (pulling)
+    {
+        nextPull = QDateTime::currentMSecsSinceEpoch() + refreshInterval * 1000LL;
+    }
+    refreshPid = 0;
+}
+
+void DemographicsIndex::refreshInListener()
+{
+    if (isEmpty())
+    {
+        return;
+    }
+
+#ifdef Q_OS_UNIX
+    listenerRefreshes = true;
+
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    if (!url.isEmpty() && now >= nextPull && pullPid == 0)
+    {
+        nextPull = now + refreshInterval * 1000LL;
+        auto pid = fork();
+        if (pid == 0)
+        {
+            // The helper: save the response for the listener and leave.
+            // A failed pull leaves the previous response in place.
+            //
+            auto data = pull();
+            QSaveFile f(pullFile);
+            if (!data.isNull() && !(f.open(QFile::WriteOnly) && f.write(data) == data.size() && f.commit()))
+            {
+                qWarning() << "Failed to save" << pullFile << f.errorString();
+            }
+            _exit(0);
+        }
+
+        if (pid < 0)
+        {
+            qWarning() << "fork() failed, err" << errno << "demographics are not pulled";
+        }
+        else
+        {
+            pullPid = pid;
+        }
+    }
+
+    // Local files only, so it is quick
+    //
+    QFileInfo fi(file), pfi(pullFile);
+    qint64 modified = !file.isEmpty() && fi.exists()? fi.lastModified().toMSecsSinceEpoch(): 0;
+    qint64 pullModified = !url.isEmpty() && pfi.exists()? pfi.lastModified().toMSecsSinceEpoch(): 0;
+    if (modified == fileModified && pullModified == pullFileModified)
+    {
+        return;
+    }
+
+    auto fileData = readFile(file, fileModified);
+    auto pullData = url.isEmpty()? QByteArray(): readFile(pullFile, pullFileModified);
+    publish(fileData, pullData);
+
+    // Forked workers inherit the same state the table was built from
+    //
+    QMutexLocker locker(&lock);
+    pulled = pullData;
+#else
+    refreshIfDue();
+#endif
+}
+
+void DemographicsIndex::childTerminated(int pid)
+{
+    if (pid == pullPid)
+    {
+        pullPid = 0;
+    }
+}
+
+void DemographicsIndex::load(const QByteArray& data, Table& target) const
+{
+    if (data.isEmpty())
+    {
+        return;
+    }
+
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+    Q_FOREACH (auto item, QJsonDocument::fromJson(data).array())
+    {
+        auto obj = item.toObject();
+        Record record;
+        for (auto i = obj.constBegin(); i != obj.constEnd(); ++i)
+        {
+            auto attr = TextAttr::byName(i.key());
+            if (attr.isValid())
+            {
+                auto value = i.value();
+                record.append(qMakePair(attr, value.isString()? value.toString(): value.toVariant().toString()));
+            }
+        }
+
+        QStringList values;
+        Q_FOREACH (auto field, fields)
+        {
+            values.append(obj.value(field).toString());
+        }
+
+        auto k = key(values);
+        if (k.isEmpty() || target.ambiguous.contains(k))
+        {
+            continue;
+        }
+
+        if (target.records.contains(k))
+        {
+            // Same patient scheduled twice, let the web service decide
+            //
+            target.records.remove(k);
+            target.ambiguous.insert(k);
+            continue;
+        }
+
+        target.records.insert(k, record);
+    }
+#else
+    qWarning() << "Demographics index requires Qt 5";
+#endif
+}
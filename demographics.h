@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEMOGRAPHICS_H
+#define DEMOGRAPHICS_H
+
+#include "attrcodec.h"
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QUrl>
+#include <QVariantMap>
+
+#define DEFAULT_DEMOGRAPHICS_REFRESH_INTERVAL 300 // In seconds
+
+// Local copy of the patients/studies scheduled by the RIS.
+//
+// [demographics]
+// file=/var/lib/virtual-dicom-printer/scheduled.json
+// url=http://ris/export/scheduled
+// refresh-interval=300
+// key=patientId:PatientID, patientName:PatientName
+//
+// Both the file and the response of the url are JSON arrays of objects,
+// one object per study, with DICOM keywords for the keys:
+// [{"PatientID": "12345", "PatientName": "DOE^JOHN", "AccessionNumber": "A1"}]
+//
+// The records are indexed by the query parameters listed in the key
+// (the recognized text), each one mapped to the record field it is compared with.
+// The web query is sent only if there is no such record, or there are many.
+// The file is reloaded when it changes, the url is pulled every refresh-interval
+// seconds, both in the background, so the lookups are never blocked.
+// Hits and misses are counted as demographics-hits and demographics-misses.
+//
+// The listener of the fork mode must stay single threaded, since it forks the workers.
+// It pulls the url in a helper process instead, which saves the response to
+// pull-file (in the temp directory by default), and loads the files by itself.
+//
+class DemographicsIndex
+{
+public:
+    // Attributes and values, in the DICOM way. Keywords are resolved on load,
+    // the unknown ones are dropped.
+    //
+    typedef QList<QPair<TextAttr, QString> > Record;
+
+    /** @return the index of this process.
+     */
+    static DemographicsIndex& instance();
+
+    /** @return true if neither file nor url is configured.
+     */
+    bool isEmpty() const { return keys.isEmpty() || (file.isEmpty() && url.isEmpty()); }
+
+    /** looks up the study by the query parameters.
+     *  @param queryParams the parameters of the web query
+     *  @param record the record found
+     *  @return true if exactly one record matches
+     */
+    bool find(const QVariantMap& queryParams, Record& record);
+
+    /** starts the background refresh, if the file was changed or the url is due.
+     *  The reactor calls it periodically.
+     */
+    void refreshIfDue();
+
+    /** refreshes the records without starting any thread, for the listener
+     *  that forks the workers, so they inherit fresh records. The url is pulled
+     *  by a helper process, the files are loaded right here.
+     */
+    void refreshInListener();
+
+    /** forgets the helper process, once it is terminated.
+     *  @param pid the process terminated
+     */
+    void childTerminated(int pid);
+
+private:
+    DemographicsIndex();
+
+    struct Table
+    {
+        QHash<QString, Record> records;
+        QSet<QString> ambiguous; // Keys of more than one record
+    };
+
+    QString key(const QStringList& values) const;
+    void startRefresh();
+    void refresh();
+    void load(const QByteArray& data, Table& target) const;
+    void publish(const QByteArray& fileData, const QByteArray& pullData);
+    QByteArray pull() const;
+    static QByteArray readFile(const QString& path, qint64& modified);
+
+    QString file;
+    QUrl url;
+    int refreshInterval;
+    QStringList keys;   // Query parameters
+    QStringList fields; // Record fields, one per query parameter
+
+    QMutex lock;
+    QSharedPointer<Table> table;
+    qint64 fileModified;
+    qint64 nextPull;
+    QByteArray pulled;  // The last response of the url
+    qint64 refreshPid;  // The process the refresh is running in, 0 if none
+    QString pullFile;   // Where the helper process saves the response of the url
+    qint64 pullFileModified;
+    int pullPid;        // The helper process, 0 if none
+    bool listenerRefreshes; // Set in the fork mode listener, its workers never refresh
+};
+
+#endif // DEMOGRAPHICS_H
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "glyphmatcher.h"
+#include "ocrimage.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QMutex>
+#include <QStringList>
+#include <QUtf8Settings>
+
+#include <limits.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define GLYPHS_MAGIC          0x474c5946 // GLYF
+#define GLYPHS_VERSION        1
+#define GLYPHS_RETRY_INTERVAL 60 // In seconds, for the tables failed to load
+#define MAX_GLYPH_VARIANTS    8
+
+// The region as an ink mask, 255 where the text is
+//
+struct InkImage
+{
+    int width;
+    int height;
+    QByteArray pixels;
+
+    const uchar* row(int y) const { return (const uchar*)pixels.constData() + y * width; }
+};
+
+static InkImage extractInk(const OcrCrop& crop, const QRect& rect)
+{
+    InkImage ink;
+    ink.width  = rect.width();
+    ink.height = rect.height();
+    ink.pixels.resize(ink.width * ink.height);
+
+    auto x = rect.left() - crop.rect.left();
+    auto y = rect.top() - crop.rect.top();
+
+    // Otsu threshold, bitmap fonts have just two levels anyway
+    //
+    int hist[256] = {0};
+    for (int row = 0; row < ink.height; ++row)
+    {
+        auto src = crop.data() + (y + row) * crop.bytesPerLine() + x;
+        for (int col = 0; col < ink.width; ++col)
+        {
+            ++hist[src[col]];
+        }
+    }
+
+    auto total = ink.width * ink.height;
+    double sumAll = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        sumAll += (double)i * hist[i];
+    }
+
+    int threshold = 0;
+    int countBelow = 0;
+    double sumBelow = 0;
+    double bestVariance = -1;
+    for (int i = 0; i < 256; ++i)
+    {
+        countBelow += hist[i];
+        sumBelow += (double)i * hist[i];
+        if (countBelow == 0 || countBelow == total)
+        {
+            continue;
+        }
+
+        auto meanBelow = sumBelow / countBelow;
+        auto meanAbove = (sumAll - sumBelow) / (total - countBelow);
+        auto variance = (double)countBelow * (total - countBelow) * (meanBelow - meanAbove) * (meanBelow - meanAbove);
+        if (variance > bestVariance)
+        {
+            bestVariance = variance;
+            threshold = i;
+        }
+    }
+
+    // Text is the minority, whatever the polarity is
+    //
+    int dark = 0;
+    for (int i = 0; i <= threshold; ++i)
+    {
+        dark += hist[i];
+    }
+    auto darkInk = dark * 2 < total;
+
+    auto dst = (uchar*)ink.pixels.data();
+    for (int row = 0; row < ink.height; ++row)
+    {
+        auto src = crop.data() + (y + row) * crop.bytesPerLine() + x;
+        for (int col = 0; col < ink.width; ++col)
+        {
+            *dst++ = ((src[col] <= threshold) == darkInk)? 0xFF: 0;
+        }
+    }
+
+    return ink;
+}
+
+static bool hasInk(const InkImage& ink, int col, int top, int bottom)
+{
+    for (int y = top; y < bottom; ++y)
+    {
+        if (ink.row(y)[col])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Splits the ink into lines, and lines into characters.
+// All boxes of a line have the height of the line, so `.' and `-' differ.
+//
+static QList<QList<QRect> > segment(const InkImage& ink)
+{
+    QList<QList<QRect> > lines;
+    int y = 0;
+    while (y < ink.height)
+    {
+        while (y < ink.height && !memchr(ink.row(y), 0xFF, ink.width))
+        {
+            ++y;
+        }
+        auto top = y;
+        while (y < ink.height && memchr(ink.row(y), 0xFF, ink.width))
+        {
+            ++y;
+        }
+        if (top == y)
+        {
+            break;
+        }
+
+        QList<QRect> boxes;
+        int x = 0;
+        while (x < ink.width)
+        {
+            while (x < ink.width && !hasInk(ink, x, top, y))
+            {
+                ++x;
+            }
+            auto left = x;
+            while (x < ink.width && hasInk(ink, x, top, y))
+            {
+                ++x;
+            }
+            if (left < x)
+            {
+                boxes.append(QRect(left, top, x - left, y - top));
+            }
+        }
+        lines.append(boxes);
+    }
+
+    return lines;
+}
+
+static QByteArray normalize(const InkImage& ink, const QRect& box)
+{
+    QByteArray pixels(GLYPH_WIDTH * GLYPH_HEIGHT, 0);
+    auto dst = (uchar*)pixels.data();
+    for (int y = 0; y < GLYPH_HEIGHT; ++y)
+    {
+        auto src = ink.row(box.top() + y * box.height() / GLYPH_HEIGHT) + box.left();
+        for (int x = 0; x < GLYPH_WIDTH; ++x)
+        {
+            *dst++ = src[x * box.width() / GLYPH_WIDTH];
+        }
+    }
+    return pixels;
+}
+
+// Sum of absolute differences of two glyphs
+//
+static int distance(const QByteArray& a, const QByteArray& b)
+{
+    auto pa = (const uchar*)a.constData();
+    auto pb = (const uchar*)b.constData();
+    int sum = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    auto acc = _mm_setzero_si128();
+    for (; i + 16 <= GLYPH_WIDTH * GLYPH_HEIGHT; i += 16)
+    {
+        auto va = _mm_loadu_si128((const __m128i*)(pa + i));
+        auto vb = _mm_loadu_si128((const __m128i*)(pb + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < GLYPH_WIDTH * GLYPH_HEIGHT; ++i)
+    {
+        sum += qAbs(pa[i] - pb[i]);
+    }
+    return sum;
+}
+
+static QMutex fontsLock;
+static QMap<QString, QSharedPointer<GlyphMatcher> > fonts;
+static QMap<QString, qint64> failedFonts; // When to try again, msecs since epoch
+
+QSharedPointer<GlyphMatcher> GlyphMatcher::forFont(const QString& font)
+{
+    QMutexLocker lock(&fontsLock);
+    auto it = fonts.find(font);
+    if (it != fonts.end())
+    {
+        return it.value();
+    }
+
+    // Remember the failure for a while, so the file is not read for each film,
+    // but a table that was missing or partially written is picked up later.
+    //
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    if (now < failedFonts.value(font))
+    {
+        return QSharedPointer<GlyphMatcher>();
+    }
+
+    QSharedPointer<GlyphMatcher> matcher(new GlyphMatcher(font));
+    if (!matcher->load())
+    {
+        failedFonts[font] = now + GLYPHS_RETRY_INTERVAL * 1000LL;
+        return QSharedPointer<GlyphMatcher>();
+    }
+
+    failedFonts.remove(font);
+    fonts[font] = matcher;
+    return matcher;
+}
+
+GlyphMatcher::GlyphMatcher(const QString& font)
+    : font(font)
+{
+    minConfidence = QUtf8Settings().value("glyph-confidence", DEFAULT_GLYPH_CONFIDENCE).toDouble();
+}
+
+QString GlyphMatcher::fileName() const
+{
+    auto path = QUtf8Settings().value("glyphs-path", DEFAULT_GLYPHS_PATH).toString();
+    return QString(path).append(QDir::separator()).append(font).append(".glyphs");
+}
+
+bool GlyphMatcher::recognize(const OcrCrop& crop, const QRect& rect, QString& text) const
+{
+    if (glyphs.isEmpty())
+    {
+        return false;
+    }
+
+    auto ink = extractInk(crop, rect);
+    QStringList lines;
+    Q_FOREACH (auto boxes, segment(ink))
+    {
+        QString line;
+        for (int i = 0; i < boxes.size(); ++i)
+        {
+            auto& box = boxes[i];
+
+            // A gap wider than a half of the line height is a space
+            //
+            if (i > 0 && box.left() - boxes[i - 1].right() > box.height() / 2)
+            {
+                line.append(' ');
+            }
+
+            auto pixels = normalize(ink, box);
+            int best = -1;
+            int bestDistance = INT_MAX;
+            for (int g = 0; g < glyphs.size(); ++g)
+            {
+                auto d = distance(pixels, glyphs[g].pixels);
+                if (d < bestDistance)
+                {
+                    bestDistance = d;
+                    best = g;
+                }
+            }
+
+            auto confidence = 1.0 - (double)bestDistance / (255 * GLYPH_WIDTH * GLYPH_HEIGHT);
+            if (confidence < minConfidence)
+            {
+                qDebug() << "Glyph at" << box << "of" << font << "is not confident" << confidence;
+                return false;
+            }
+            line.append(glyphs[best].ch);
+        }
+        lines.append(line);
+    }
+
+    text = lines.join("\n");
+    return true;
+}
+
+int GlyphMatcher::learn(const OcrCrop& crop, const QRect& rect, const QString& text)
+{
+    auto ink = extractInk(crop, rect);
+    auto lines = segment(ink);
+    auto textLines = text.split('\n', QString::SkipEmptyParts);
+
+    if (lines.size() != textLines.size())
+    {
+        qWarning() << "Found" << lines.size() << "lines of text instead of" << textLines.size();
+        return -1;
+    }
+
+    int learned = 0;
+    for (int l = 0; l < lines.size(); ++l)
+    {
+        auto chars = QString(textLines[l]).remove(' ');
+        if (chars.size() != lines[l].size())
+        {
+            qWarning() << "Found" << lines[l].size() << "characters instead of" << chars.size() << "at" << textLines[l];
+            return -1;
+        }
+
+        for (int i = 0; i < chars.size(); ++i)
+        {
+            Glyph glyph;
+            glyph.ch = chars[i];
+            glyph.pixels = normalize(ink, lines[l][i]);
+
+            int variants = 0;
+            bool known = false;
+            Q_FOREACH (const auto& other, glyphs)
+            {
+                if (other.ch == glyph.ch)
+                {
+                    ++variants;
+                    known = known || distance(other.pixels, glyph.pixels) == 0;
+                }
+            }
+
+            if (!known && variants < MAX_GLYPH_VARIANTS)
+            {
+                glyphs.append(glyph);
+                ++learned;
+            }
+        }
+    }
+
+    return learned;
+}
+
+bool GlyphMatcher::load()
+{
+    QFile file(fileName());
+    if (!file.open(QFile::ReadOnly))
+    {
+        qWarning() << "Failed to open" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if (magic != GLYPHS_MAGIC || version != GLYPHS_VERSION)
+    {
+        qWarning() << file.fileName() << "is not a glyph table";
+        return false;
+    }
+
+    glyphs.clear();
+    while (count-- > 0 && stream.status() == QDataStream::Ok)
+    {
+        Glyph glyph;
+        stream >> glyph.ch >> glyph.pixels;
+        if (glyph.pixels.size() == GLYPH_WIDTH * GLYPH_HEIGHT)
+        {
+            glyphs.append(glyph);
+        }
+    }
+
+    qDebug() << "Loaded" << glyphs.size() << "glyphs of" << font;
+    return stream.status() == QDataStream::Ok;
+}
+
+bool GlyphMatcher::save() const
+{
+    QFile file(fileName());
+    if (!QDir::root().mkpath(QFileInfo(file).absolutePath()) || !file.open(QFile::WriteOnly))
+    {
+        qWarning() << "Failed to write" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream << (quint32)GLYPHS_MAGIC << (quint32)GLYPHS_VERSION << (quint32)glyphs.size();
+    Q_FOREACH (const auto& glyph, glyphs)
+    {
+        stream << glyph.ch << glyph.pixels;
+    }
+
+    return stream.status() == QDataStream::Ok;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLYPHMATCHER_H
+#define GLYPHMATCHER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QRect>
+#include <QSharedPointer>
+#include <QString>
+
+#define DEFAULT_GLYPHS_PATH      "/var/lib/virtual-dicom-printer/glyphs"
+#define DEFAULT_GLYPH_CONFIDENCE 0.85
+#define GLYPH_WIDTH              16
+#define GLYPH_HEIGHT             16
+
+struct OcrCrop;
+
+// A character of a bitmap font, scaled to GLYPH_WIDTH x GLYPH_HEIGHT.
+// Ink is 255, background is 0.
+//
+struct Glyph
+{
+    QChar ch;
+    QByteArray pixels;
+};
+
+// Recognizer for the fixed bitmap fonts modalities burn into the films.
+// The region is split into lines and characters by ink projections,
+// then each character is compared with the glyphs learned from sample films.
+// Way faster than tesseract, but knows nothing about the fonts it was not trained on.
+//
+class GlyphMatcher
+{
+public:
+    /** @return glyphs of the font from the glyphs-path folder, loaded on first use,
+     *  or null if the font was never trained. A table that failed to load
+     *  is read again a minute later.
+     */
+    static QSharedPointer<GlyphMatcher> forFont(const QString& font);
+
+    /** @param font the font name, the table is kept in <glyphs-path>/<font>.glyphs
+     */
+    explicit GlyphMatcher(const QString& font);
+
+    /** recognizes the text in the region.
+     *  @param crop rendered part of the film
+     *  @param rect resolved region inside the crop
+     *  @param text the text, lines are separated with \n
+     *  @return false if any character is not confident enough (see glyph-confidence)
+     */
+    bool recognize(const OcrCrop& crop, const QRect& rect, QString& text) const;
+
+    /** adds the characters of the region to the font.
+     *  @param crop rendered part of the film
+     *  @param rect resolved region inside the crop
+     *  @param text the text of the region, lines are separated with \n
+     *  @return number of characters learned, -1 if the text does not fit the region
+     */
+    int learn(const OcrCrop& crop, const QRect& rect, const QString& text);
+
+    /** @return number of glyphs known.
+     */
+    int size() const { return glyphs.size(); }
+
+    /** @return all known glyphs, several variants of a character may be present.
+     */
+    const QList<Glyph>& glyphList() const { return glyphs; }
+
+    bool load();
+    bool save() const;
+
+private:
+    QString fileName() const;
+
+    QString font;
+    QList<Glyph> glyphs;
+    double minConfidence;
+};
+
+#endif // GLYPHMATCHER_H
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "imageprep.h"
+#include "ocrimage.h"
+
+#include <QDebug>
+#include <QSettings>
+#include <QVector>
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Row kernels. Each one has a vector loop for the bulk of the row
+// and a scalar loop for the tail (or the whole row if no SIMD available).
+//
+
+static quint64 sumRow(const uchar* src, int n)
+{
+    quint64 sum = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    auto zero = _mm256_setzero_si256();
+    auto acc  = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32)
+    {
+        auto v = _mm256_loadu_si256((const __m256i*)(src + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    quint64 lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    auto zero = _mm_setzero_si128();
+    auto acc  = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)(src + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    quint64 lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++i)
+    {
+        sum += src[i];
+    }
+    return sum;
+}
+
+static void invertRow(uchar* row, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    auto ones = _mm256_set1_epi8((char)0xFF);
+    for (; i + 32 <= n; i += 32)
+    {
+        auto v = _mm256_loadu_si256((const __m256i*)(row + i));
+        _mm256_storeu_si256((__m256i*)(row + i), _mm256_xor_si256(v, ones));
+    }
+#elif defined(__SSE2__)
+    auto ones = _mm_set1_epi8((char)0xFF);
+    for (; i + 16 <= n; i += 16)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)(row + i));
+        _mm_storeu_si128((__m128i*)(row + i), _mm_xor_si128(v, ones));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        row[i] = ~row[i];
+    }
+}
+
+// Nearest neighbour, dst must have n * factor bytes
+//
+static void upscaleRow(const uchar* src, uchar* dst, int n, int factor)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    if (factor == 2 || factor == 4)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            auto v  = _mm_loadu_si128((const __m128i*)(src + i));
+            auto lo = _mm_unpacklo_epi8(v, v);
+            auto hi = _mm_unpackhi_epi8(v, v);
+            if (factor == 2)
+            {
+                _mm_storeu_si128((__m128i*)(dst + i * 2), lo);
+                _mm_storeu_si128((__m128i*)(dst + i * 2 + 16), hi);
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i*)(dst + i * 4),      _mm_unpacklo_epi8(lo, lo));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi8(lo, lo));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_unpacklo_epi8(hi, hi));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_unpackhi_epi8(hi, hi));
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        memset(dst + i * factor, src[i], factor);
+    }
+}
+
+// dst = src >= threshold? white: black
+//
+static void thresholdRow(const uchar* src, const uchar* threshold, uchar* dst, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32)
+    {
+        auto v = _mm256_loadu_si256((const __m256i*)(src + i));
+        auto t = _mm256_loadu_si256((const __m256i*)(threshold + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+        auto v = _mm_loadu_si128((const __m128i*)(src + i));
+        auto t = _mm_loadu_si128((const __m128i*)(threshold + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        dst[i] = src[i] >= threshold[i]? 0xFF: 0;
+    }
+}
+
+static void binarize(PrepImage& img, int window, int bias)
+{
+    auto w = img.width;
+    auto h = img.height;
+    auto half = qMax(1, window / 2);
+    auto data = (uchar*)img.pixels.data();
+
+    // Integral image, one extra row and column of zeroes
+    //
+    QVector<quint32> integral((w + 1) * (h + 1), 0);
+    for (int y = 0; y < h; ++y)
+    {
+        quint32 rowSum = 0;
+        auto src  = data + y * w;
+        auto prev = integral.constData() + y * (w + 1);
+        auto curr = integral.data() + (y + 1) * (w + 1);
+        for (int x = 0; x < w; ++x)
+        {
+            rowSum += src[x];
+            curr[x + 1] = prev[x + 1] + rowSum;
+        }
+    }
+
+    QByteArray thresholds(w, 0);
+    QByteArray out(w * h, 0);
+    for (int y = 0; y < h; ++y)
+    {
+        auto y0 = qMax(0, y - half);
+        auto y1 = qMin(h, y + half + 1);
+        auto top    = integral.constData() + y0 * (w + 1);
+        auto bottom = integral.constData() + y1 * (w + 1);
+        auto t = (uchar*)thresholds.data();
+
+        for (int x = 0; x < w; ++x)
+        {
+            auto x0 = qMax(0, x - half);
+            auto x1 = qMin(w, x + half + 1);
+            auto sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            auto mean = (int)(sum / (quint32)((x1 - x0) * (y1 - y0)));
+            t[x] = (uchar)qBound(0, mean - bias, 255);
+        }
+
+        thresholdRow(data + y * w, t, (uchar*)out.data() + y * w, w);
+    }
+
+    img.pixels = out;
+}
+
+ImagePrepOptions::ImagePrepOptions()
+    : polarity(PolarityKeep)
+    , upscale(DEFAULT_OCR_UPSCALE)
+    , binarize(false)
+    , binarizeWindow(DEFAULT_OCR_BINARIZE_WINDOW)
+    , binarizeBias(DEFAULT_OCR_BINARIZE_BIAS)
+{
+}
+
+ImagePrepOptions ImagePrepOptions::fromSettings(QSettings& settings)
+{
+    ImagePrepOptions options;
+
+    auto polarity = settings.value("ocr-polarity", DEFAULT_OCR_POLARITY).toString();
+    if (polarity == "auto")
+    {
+        options.polarity = PolarityAuto;
+    }
+    else if (polarity == "invert")
+    {
+        options.polarity = PolarityInvert;
+    }
+    else if (polarity != "keep")
+    {
+        qDebug() << "Unknown ocr-polarity" << polarity << "assuming keep";
+    }
+
+    options.upscale        = qBound(1, settings.value("ocr-upscale", DEFAULT_OCR_UPSCALE).toInt(), 4);
+    options.binarize       = settings.value("ocr-binarize", false).toBool();
+    options.binarizeWindow = qMax(2, settings.value("ocr-binarize-window", DEFAULT_OCR_BINARIZE_WINDOW).toInt());
+    options.binarizeBias   = settings.value("ocr-binarize-bias", DEFAULT_OCR_BINARIZE_BIAS).toInt();
+    return options;
+}
+
+bool ImagePrepOptions::isEnabled() const
+{
+    return polarity != PolarityKeep || upscale > 1 || binarize;
+}
+
+QString ImagePrepOptions::toString() const
+{
+    if (!isEnabled())
+    {
+        return QString();
+    }
+
+    return QString("p%1u%2b%3.%4.%5").arg(polarity).arg(upscale)
+        .arg(binarize).arg(binarizeWindow).arg(binarizeBias);
+}
+
+PrepImage prepareImage(const OcrCrop& crop, const QRect& rect, const ImagePrepOptions& options)
+{
+    auto x = rect.left() - crop.rect.left();
+    auto y = rect.top() - crop.rect.top();
+    auto w = rect.width();
+    auto h = rect.height();
+
+    PrepImage img;
+    img.width  = w * options.upscale;
+    img.height = h * options.upscale;
+    img.pixels.resize(img.width * img.height);
+
+    // Copy (and upscale) the region
+    //
+    auto dst = (uchar*)img.pixels.data();
+    for (int row = 0; row < h; ++row)
+    {
+        auto src = crop.data() + (y + row) * crop.bytesPerLine() + x;
+        auto line = dst + row * options.upscale * img.width;
+        if (options.upscale == 1)
+        {
+            memcpy(line, src, w);
+        }
+        else
+        {
+            upscaleRow(src, line, w, options.upscale);
+            for (int i = 1; i < options.upscale; ++i)
+            {
+                memcpy(line + i * img.width, line, img.width);
+            }
+        }
+    }
+
+    // Tesseract is trained on dark text over light background.
+    // Regions on a film are mostly background, so the mean tells the polarity.
+    //
+    auto invert = options.polarity == ImagePrepOptions::PolarityInvert;
+    if (options.polarity == ImagePrepOptions::PolarityAuto && !img.pixels.isEmpty())
+    {
+        quint64 sum = 0;
+        for (int row = 0; row < img.height; ++row)
+        {
+            sum += sumRow(dst + row * img.width, img.width);
+        }
+        invert = sum < 128 * (quint64)img.pixels.size();
+    }
+
+    if (invert)
+    {
+        invertRow(dst, img.pixels.size());
+    }
+
+    if (options.binarize && !img.pixels.isEmpty())
+    {
+        binarize(img, options.binarizeWindow, options.binarizeBias);
+    }
+
+    return img;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEPREP_H
+#define IMAGEPREP_H
+
+#include <QByteArray>
+#include <QRect>
+#include <QString>
+
+class QSettings;
+struct OcrCrop;
+
+#define DEFAULT_OCR_POLARITY       "keep"
+#define DEFAULT_OCR_UPSCALE        1
+#define DEFAULT_OCR_BINARIZE_WINDOW 16
+#define DEFAULT_OCR_BINARIZE_BIAS  8
+
+// How a region is prepared for OCR.
+// The defaults pass the rendered pixels to tesseract as is.
+//
+struct ImagePrepOptions
+{
+    enum Polarity
+    {
+        PolarityKeep,   // As rendered
+        PolarityAuto,   // Dark text on light background, whatever the film has
+        PolarityInvert, // Always invert
+    };
+
+    Polarity polarity;
+    int  upscale;        // Integer scale factor, 1 to 4
+    bool binarize;       // Adaptive (local mean) threshold
+    int  binarizeWindow; // Side of the window to average, in upscaled pixels
+    int  binarizeBias;   // Pixels darker than the local mean by this become black
+
+    ImagePrepOptions();
+
+    /** reads ocr-polarity, ocr-upscale, ocr-binarize, ocr-binarize-window
+     *  and ocr-binarize-bias from the current settings group.
+     */
+    static ImagePrepOptions fromSettings(QSettings& settings);
+
+    /** @return true if the pixels are changed in any way.
+     */
+    bool isEnabled() const;
+
+    /** @return a short string for cache keys, empty if nothing is changed.
+     */
+    QString toString() const;
+};
+
+// An 8 bits per pixel image, rows are not padded.
+//
+struct PrepImage
+{
+    int width;
+    int height;
+    QByteArray pixels;
+
+    const unsigned char* data() const { return (const unsigned char*)pixels.constData(); }
+};
+
+/** copies the region out of the crop and prepares it for OCR.
+ *  Rows are processed with AVX2 or SSE2 if the compiler targets them.
+ *  @param crop rendered part of the film
+ *  @param rect resolved region inside the crop
+ *  @param options what to do
+ *  @return the prepared region, upscaled if requested
+ */
+PrepImage prepareImage(const OcrCrop& crop, const QRect& rect, const ImagePrepOptions& options);
+
+#endif // IMAGEPREP_H
@@ -15,11 +15,21 @@
  */
 
 #include "product.h"
+#include "benchmark.h"
+#include "demographics.h"
+#include "glyphmatcher.h"
+#include "ocrimage.h"
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
+#include <QFuture>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
 #include <QUtf8Settings>
+#include <QVector>
+#include <QtConcurrentRun>
 
 #ifdef UNICODE
 #define DCMTK_UNICODE_BUG_WORKAROUND
@@ -28,10 +38,12 @@
 
 #include "printscp.h"
 #include "storescp.h"
+#include "upstreampool.h"
 
 #include <dcmtk/oflog/logger.h>
 #include <dcmtk/dcmdata/dcdeftag.h>
 #include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmimgle/dcmimage.h>
 #include <dcmtk/dcmpstat/dvpsdef.h>
 
 // DCMTK prior to 3.6.1 has no its own namespace.
@@ -44,6 +56,8 @@ using namespace dcmtk;
 #endif
 
 #define DEFAULT_SPOOL_INTERVAL 600
+#define DEFAULT_WORKER_MODE    "fork"
+#define REACTOR_POLL_INTERVAL  1 // In seconds, the minimum for ASC_selectReadableAssociation
 
 static int resendWorkerPid = 0;
 
@@ -87,16 +101,17 @@ static void cleanChildren()
             {
                 resendWorkerPid = 0;
             }
+            DemographicsIndex::instance().childTerminated(child);
         }
 
     }
 #endif
 }
 
-static bool resendFailedPrints(QSettings& settings)
+// Checks whether it is time to retry failed prints. If so, schedules the next retry.
+//
+static bool isResendDue(QSettings& settings)
 {
-    // Retry failed prints
-    //
     auto spoolPath = settings.value("spool-path").toString();
     if (spoolPath.isEmpty())
     {
@@ -117,85 +132,123 @@ static bool resendFailedPrints(QSettings& settings)
     // Save it immediatelly to avoid corruption.
     //
     settings.sync();
+    return true;
+}
 
-#ifdef HAVE_FORK
-    if (resendWorkerPid > 0)
+// Really processes failed prints: web queries first, then stores
+//
+static void resendSpooledPrints(QSettings& settings)
+{
+    auto spoolPath = settings.value("spool-path").toString();
+    OFCondition cond;
+
+    // One association per storage server for all spooled files
+    //
+    QMap<QString, StoreSCP*> storageServers;
+    foreach (auto server, settings.value("storage-servers").toStringList())
     {
-        qDebug() << "Worker process" << resendWorkerPid << "is still alive, resend delayed";
-        return false;
+        storageServers[server] = new StoreSCP(server);
     }
 
-    resendWorkerPid = fork();
+    // Retry failed web queries. Prints of the same printer are sent
+    // to the web service in batches, if the printer is configured so.
+    //
+    QMap<QString, PrintSCP*> printers;
+    QMap<QString, QList<QPair<QString, DcmFileFormat*> > > pending;
 
-    if (resendWorkerPid > 0)
+    auto flush = [&](const QString& printer)
     {
-        qDebug() << "Worker process to resend failed prints spawned. Pid" << resendWorkerPid;
-        return false;
-    }
-#endif
+        auto& prints = pending[printer];
+        QList<DcmDataset*> datasets;
+        for (int i = 0; i < prints.size(); ++i)
+        {
+            datasets.append(prints[i].second->getDataset());
+        }
 
-    // Really start to process failed prints
-    //
-    OFCondition cond;
+        auto results = printers[printer]->webQueryBatch(datasets);
+        for (int i = 0; i < prints.size(); ++i)
+        {
+            auto filePath = prints[i].first;
+            auto dataset = datasets[i];
+
+            if (results.value(i))
+            {
+                foreach (auto server, storageServers.keys())
+                {
+                    const char* SOPInstanceUID = nullptr;
+                    dataset->findAndGetString(DCM_SOPInstanceUID, SOPInstanceUID);
+
+                    auto cond = storageServers[server]->sendToServer(dataset, SOPInstanceUID);
+                    if (cond.bad())
+                    {
+                        // The Web query secceded, but store failed.
+                        // Move the file down to the queue.
+                        // At this point, we will copy the dataset as many times,
+                        // as need for each failed store server.
+                        //
+                        saveToDisk(QString(spoolPath).append(QDir::separator()).append(server), dataset);
+                    }
+                }
+
+                if (!QFile::remove(filePath))
+                {
+                    qDebug() << "Failed to remove file " << filePath
+                             << ": " << QString::fromLocal8Bit(strerror(errno));
+                }
+            }
+
+            delete prints[i].second;
+        }
+        prints.clear();
+    };
 
-    // Retry failed web queries
-    //
     qDebug() << __func__ << "retrying prints";
     Q_FOREACH (auto file, QDir(spoolPath).entryInfoList(QDir::Files))
     {
         auto filePath = file.absoluteFilePath();
         qDebug() << "Retrying " << filePath;
 
-        DcmFileFormat dcmFF;
-        cond = dcmFF.loadFile((const char*)filePath.toLocal8Bit());
+        auto dcmFF = new DcmFileFormat;
+        cond = dcmFF->loadFile((const char*)filePath.toLocal8Bit());
         if (cond.bad())
         {
             qDebug() << "Failed to load " << filePath << ": " << QString::fromLocal8Bit(cond.text());
+            delete dcmFF;
             continue;
         }
 
         const char* printer = nullptr;
-        dcmFF.getDataset()->findAndGetString(DCM_RETIRED_PrintQueueID, printer);
+        dcmFF->getDataset()->findAndGetString(DCM_RETIRED_PrintQueueID, printer);
         if (printer == nullptr)
         {
             qDebug() << "Failed to retry " << filePath << ": no printer instance specified";
+            delete dcmFF;
             continue;
         }
 
-        PrintSCP retryPrintSCP(nullptr, nullptr, QString::fromUtf8(printer));
-
-        if (retryPrintSCP.webQuery(dcmFF.getDataset()))
+        auto printerName = QString::fromUtf8(printer);
+        if (!printers.contains(printerName))
         {
-            foreach (auto server, settings.value("storage-servers").toStringList())
-            {
-                StoreSCP sscp(server);
-                const char* SOPInstanceUID = nullptr;
-                dcmFF.getDataset()->findAndGetString(DCM_SOPInstanceUID, SOPInstanceUID);
-
-                cond = sscp.sendToServer(dcmFF.getDataset(), SOPInstanceUID);
-                if (cond.bad())
-                {
-                    // The Web query secceded, but store failed.
-                    // Move the file down to the queue.
-                    // At this point, we will copy the dataset as many times,
-                    // as need for each failed store server.
-                    //
-                    saveToDisk(QString(spoolPath).append(QDir::separator()).append(server), dcmFF.getDataset());
-                }
-            }
+            printers[printerName] = new PrintSCP(nullptr, nullptr, printerName);
+        }
 
-            if (!QFile::remove(filePath))
-            {
-                qDebug() << "Failed to remove file " << filePath
-                         << ": " << QString::fromLocal8Bit(strerror(errno));
-            }
+        pending[printerName].append(qMakePair(filePath, dcmFF));
+        if (pending[printerName].size() >= printers[printerName]->webQueryBatchSize())
+        {
+            flush(printerName);
         }
     }
 
+    Q_FOREACH (auto printer, pending.keys())
+    {
+        flush(printer);
+    }
+    qDeleteAll(printers);
+
     qDebug() << __func__ << "retrying dcmstore";
-    foreach (auto server, settings.value("storage-servers").toStringList())
+    foreach (auto server, storageServers.keys())
     {
-        StoreSCP sscp(server);
+        auto sscp = storageServers[server];
         auto path = QDir(QString(spoolPath).append(QDir::separator()).append(server));
         Q_FOREACH (auto file, path.entryInfoList(QDir::Files))
         {
@@ -214,7 +267,7 @@ static bool resendFailedPrints(QSettings& settings)
             const char* SOPInstanceUID = nullptr;
             dcmFF.getDataset()->findAndGetString(DCM_SOPInstanceUID, SOPInstanceUID);
 
-            cond = sscp.sendToServer(dcmFF.getDataset(), SOPInstanceUID);
+            cond = sscp->sendToServer(dcmFF.getDataset(), SOPInstanceUID);
             if (cond.good())
             {
                 if (!QFile::remove(filePath))
@@ -225,7 +278,36 @@ static bool resendFailedPrints(QSettings& settings)
             }
         }
     }
+    qDeleteAll(storageServers);
     qDebug() << __func__ << "done";
+}
+
+static bool resendFailedPrints(QSettings& settings)
+{
+    // Retry failed prints
+    //
+    if (!isResendDue(settings))
+    {
+        return false;
+    }
+
+#ifdef HAVE_FORK
+    if (resendWorkerPid > 0)
+    {
+        qDebug() << "Worker process" << resendWorkerPid << "is still alive, resend delayed";
+        return false;
+    }
+
+    resendWorkerPid = fork();
+
+    if (resendWorkerPid > 0)
+    {
+        qDebug() << "Worker process to resend failed prints spawned. Pid" << resendWorkerPid;
+        return false;
+    }
+#endif
+
+    resendSpooledPrints(settings);
     return true;
 }
 
@@ -239,6 +321,198 @@ void handleClient(T_ASC_Association *assoc)
     }
 }
 
+// Serves all associations in the current process.
+// The listen socket and client associations are polled with select(),
+// every association that has data gets exactly one DIMSE command processed,
+// so an idle association costs a PrintSCP instance instead of a whole process.
+// Images (OCR, web query, store) are handed off to a bounded thread pool.
+//
+static int serveInSingleProcess(T_ASC_Network *net, QSettings& settings, int listenTimeout)
+{
+    // Never destroyed, the loop below never ends.
+    //
+    auto workers = new QThreadPool;
+    workers->setMaxThreadCount(settings.value("worker-threads", QThread::idealThreadCount()).toInt());
+    qDebug() << "Single process mode," << workers->maxThreadCount() << "worker threads";
+
+    // Failed prints are resent by a thread of its own, not by a forked process:
+    // a child forked from here would inherit the locks held by the worker threads
+    // at the moment of fork() and the sockets of all client associations.
+    //
+    auto resender = new QThreadPool;
+    resender->setMaxThreadCount(1);
+    QFuture<void> resend;
+
+    QList<PrintSCP*> sessions;
+    QList<PrintSCP*> closedSessions;
+
+    Q_FOREVER
+    {
+        cleanChildren();
+        DemographicsIndex::instance().refreshIfDue();
+        if (resend.isFinished() && isResendDue(settings))
+        {
+            resend = QtConcurrent::run(resender, []()
+            {
+                QUtf8Settings settings;
+                resendSpooledPrints(settings);
+            });
+        }
+
+        // Closed sessions are destroyed after all their images are processed
+        //
+        for (auto it = closedSessions.begin(); it != closedSessions.end(); )
+        {
+            if ((*it)->isBusy())
+            {
+                ++it;
+            }
+            else
+            {
+                delete *it;
+                it = closedSessions.erase(it);
+            }
+        }
+
+        if (ASC_associationWaiting(net, sessions.isEmpty()? listenTimeout: 0))
+        {
+            qDebug() << "Client connected";
+
+            T_ASC_Association *assoc = nullptr;
+            auto cond = ASC_receiveAssociation(net, &assoc, DEFAULT_MAXPDU);
+            if (cond.bad())
+            {
+                qWarning() << "Failed to receive association";
+                ASC_dropSCPAssociation(assoc);
+                ASC_destroyAssociation(&assoc);
+                continue;
+            }
+
+            auto printSCP = new PrintSCP(assoc);
+            printSCP->setWorkerPool(workers);
+            if (printSCP->negotiateAssociation() && printSCP->acknowledgeAssociation().good())
+            {
+                sessions.append(printSCP);
+                qDebug() << sessions.size() << "active associations";
+            }
+            else
+            {
+                delete printSCP;
+            }
+            continue;
+        }
+
+        if (sessions.isEmpty())
+        {
+            qDebug() << "waiting for connection";
+            continue;
+        }
+
+        // Reap sessions abandoned by the client
+        //
+        for (int i = sessions.size() - 1; i >= 0; --i)
+        {
+            if (sessions[i]->isIdle())
+            {
+                sessions[i]->closeAssociation(DIMSE_NODATAAVAILABLE);
+                closedSessions.append(sessions.takeAt(i));
+            }
+        }
+
+        if (sessions.isEmpty())
+        {
+            continue;
+        }
+
+        QVector<T_ASC_Association*> readable;
+        Q_FOREACH (auto printSCP, sessions)
+        {
+            readable.append(printSCP->association());
+        }
+
+        if (!ASC_selectReadableAssociation(readable.data(), readable.size(), REACTOR_POLL_INTERVAL))
+        {
+            continue;
+        }
+
+        // Not readable associations are set to NULL by ASC_selectReadableAssociation
+        //
+        for (int i = readable.size() - 1; i >= 0; --i)
+        {
+            if (!readable[i])
+            {
+                continue;
+            }
+
+            auto printSCP = sessions[i];
+            auto cond = printSCP->handleCommand();
+            if (cond.bad())
+            {
+                printSCP->closeAssociation(cond);
+                sessions.removeAt(i);
+                closedSessions.append(printSCP);
+                qDebug() << sessions.size() << "active associations";
+            }
+        }
+    }
+}
+
+// Builds the glyph table of a font from a sample film:
+// virtual-dicom-printer --train-glyphs <font> <file.dcm> <left,top,width,height> <text>
+// Lines of the text are separated with \n, the rect is the same as for the tag rules.
+//
+static int trainGlyphs(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto coords = args.value(2).split(',');
+    if (args.size() != 4 || coords.size() != 4)
+    {
+        out << "Usage: " << PRODUCT_SHORT_NAME
+            << " --train-glyphs <font> <file.dcm> <left,top,width,height> <text>" << endl;
+        return 1;
+    }
+
+    DcmFileFormat dcmFF;
+    auto cond = dcmFF.loadFile((const char*)args[1].toLocal8Bit());
+    if (cond.bad())
+    {
+        out << "Failed to load " << args[1] << ": " << QString::fromLocal8Bit(cond.text()) << endl;
+        return 1;
+    }
+
+    DicomImage di(dcmFF.getDataset(), dcmFF.getDataset()->getOriginalXfer());
+    if (di.getStatus() != EIS_Normal)
+    {
+        out << "Failed to render " << args[1] << ": " << DicomImage::getString(di.getStatus()) << endl;
+        return 1;
+    }
+
+    OcrImage img(&di);
+    auto rect = img.resolve(QRect(coords[0].toInt(), coords[1].toInt(), coords[2].toInt(), coords[3].toInt()));
+    img.setRegions(QList<QRect>() << rect);
+    auto crop = img.crop(rect);
+    if (!crop)
+    {
+        out << "Nothing to learn at " << args[2] << endl;
+        return 1;
+    }
+
+    // Add to the existing table, if any
+    //
+    GlyphMatcher matcher(args[0]);
+    matcher.load();
+
+    auto learned = matcher.learn(*crop, rect, QString(args[3]).replace("\\n", "\n"));
+    if (learned < 0 || !matcher.save())
+    {
+        out << "Failed to train " << args[0] << endl;
+        return 1;
+    }
+
+    out << "Learned " << learned << " glyphs, " << matcher.size() << " in total" << endl;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
@@ -253,6 +527,27 @@ int main(int argc, char *argv[])
         log4cplus::Logger::getRoot().setLogLevel(level);
     }
 
+    auto args = app.arguments();
+    if (args.size() > 1 && args[1] == "--train-glyphs")
+    {
+        return trainGlyphs(args.mid(2));
+    }
+
+    if (args.size() > 1 && args[1] == "--benchmark-ocr")
+    {
+        return benchmarkOcr(args.mid(2));
+    }
+
+    if (args.size() > 1 && args[1] == "--benchmark-print")
+    {
+        return benchmarkPrint(args.mid(2));
+    }
+
+    if (args.size() > 1 && args[1] == "--benchmark-codec")
+    {
+        return benchmarkCodec(args.mid(2));
+    }
+
     auto debugUpstream = settings.value("debug-upstream").toBool();
     if (debugUpstream)
     {
@@ -302,11 +597,28 @@ int main(int argc, char *argv[])
     qCritical() << "Virtual DICOM printer version" << PRODUCT_VERSION_STR
              << "started. Master process pid" << getpid();
 
+    PrintSCP::loadPrinterInfo();
+
+    if (settings.value("worker-mode", DEFAULT_WORKER_MODE).toString() == "reactor")
+    {
+        // Load the scheduled studies before the first print arrives
+        //
+        DemographicsIndex::instance().refreshIfDue();
+        UpstreamPool::setSingleProcess(true);
+        return serveInSingleProcess(net, settings, listen_timeout);
+    }
+
+    // Same for the fork mode. The listener must not start any threads,
+    // the workers are forked from it.
+    //
+    DemographicsIndex::instance().refreshInListener();
+
     Q_FOREVER
     {
         do
         {
            cleanChildren();
+           DemographicsIndex::instance().refreshInListener();
            if (resendFailedPrints(settings))
            {
                // Resend worker routine has been completed
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ocrcache.h"
+#include "ocrimage.h"
+#include "statistics.h"
+
+#include <QUtf8Settings>
+
+// 64 bit FNV-1a. The regions are a few dozen kilobytes,
+// so hashing is negligible compared to the recognition itself.
+//
+static quint64 hashPixels(const OcrCrop& crop, const QRect& rect)
+{
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    auto x = rect.left() - crop.rect.left();
+    auto y = rect.top() - crop.rect.top();
+
+    for (int row = 0; row < rect.height(); ++row)
+    {
+        auto data = crop.data() + (y + row) * crop.bytesPerLine() + x;
+        for (int col = 0; col < rect.width(); ++col)
+        {
+            hash ^= data[col];
+            hash *= Q_UINT64_C(1099511628211);
+        }
+    }
+
+    return hash;
+}
+
+OcrCache& OcrCache::instance()
+{
+    static OcrCache cache(QUtf8Settings().value("ocr-cache-size", DEFAULT_OCR_CACHE_SIZE).toInt());
+    return cache;
+}
+
+OcrCache::OcrCache(int size)
+{
+    cache.setMaxCost(size);
+}
+
+QString OcrCache::key(const OcrCrop& crop, const QRect& rect, const QString& params)
+{
+    return QString("%1:%2x%3:%4").arg(params).arg(rect.width()).arg(rect.height())
+        .arg(hashPixels(crop, rect), 16, 16, QChar('0'));
+}
+
+bool OcrCache::find(const QString& key, QString& text)
+{
+    QMutexLocker locker(&lock);
+    auto cached = cache.object(key);
+    if (!cached)
+    {
+        countEvent("ocr-cache-misses");
+        return false;
+    }
+
+    countEvent("ocr-cache-hits");
+    text = *cached;
+    return true;
+}
+
+void OcrCache::insert(const QString& key, const QString& text)
+{
+    QMutexLocker locker(&lock);
+    cache.insert(key, new QString(text));
+}
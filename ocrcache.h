@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCRCACHE_H
+#define OCRCACHE_H
+
+#include <QCache>
+#include <QMutex>
+#include <QString>
+
+#define DEFAULT_OCR_CACHE_SIZE 256
+
+struct OcrCrop;
+class QRect;
+
+// Recognized text of film regions, shared by all sessions of the worker.
+// Multi-box films carry the same burned-in header in every box,
+// so identical pixels are recognized once.
+// Hits and misses are counted as ocr-cache-hits and ocr-cache-misses.
+//
+class OcrCache
+{
+public:
+    /** @return the cache of this process, ocr-cache-size entries at most.
+     */
+    static OcrCache& instance();
+
+    /** builds the cache key from the pixels of the region and recognition parameters.
+     *  @param crop rendered part of the image
+     *  @param rect region inside the crop
+     *  @param params language and everything else that changes the result
+     */
+    static QString key(const OcrCrop& crop, const QRect& rect, const QString& params);
+
+    /** looks up the text recognized earlier.
+     *  @param key from key()
+     *  @param text the text found
+     *  @return true if found
+     */
+    bool find(const QString& key, QString& text);
+
+    /** remembers the recognized text.
+     *  @param key from key()
+     *  @param text the text
+     */
+    void insert(const QString& key, const QString& text);
+
+private:
+    explicit OcrCache(int size);
+
+    QMutex lock;
+    QCache<QString, QString> cache;
+};
+
+#endif // OCRCACHE_H
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ocrengine.h"
+#include "glyphmatcher.h"
+#include "ocrcache.h"
+#include "ocrimage.h"
+#include "statistics.h"
+
+#include <QDebug>
+#include <QFuture>
+#include <QUtf8Settings>
+#include <QVector>
+#include <QtConcurrentRun>
+
+#ifdef WITH_TESSERACT
+#include <tesseract/baseapi.h>
+#include <tesseract/ocrclass.h>
+#endif
+
+#include <locale.h> // Required for tesseract
+
+static QMutex localeLock;
+
+static int modeFromSettings(QSettings& settings, const char* key, const char* const names[], int count)
+{
+    auto str = settings.value(key).toString();
+    if (str.isEmpty())
+    {
+        return -1;
+    }
+
+    bool ok;
+    auto mode = str.toInt(&ok);
+    if (ok)
+    {
+        return mode;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (str == names[i])
+        {
+            return i;
+        }
+    }
+
+    qDebug() << "Unknown" << key << str << "using the default";
+    return -1;
+}
+
+OcrParams OcrParams::fromSettings(QSettings& settings)
+{
+    // Same order as tesseract::OcrEngineMode and tesseract::PageSegMode
+    //
+    static const char* const oemNames[] =
+    {
+        "tesseract-only", "lstm-only", "tesseract-lstm-combined", "default",
+    };
+    static const char* const psmNames[] =
+    {
+        "osd-only", "auto-osd", "auto-only", "auto", "single-column", "single-block-vert-text",
+        "single-block", "single-line", "single-word", "circle-word", "single-char",
+        "sparse-text", "sparse-text-osd", "raw-line",
+    };
+
+    OcrParams params;
+    params.lang      = settings.value("ocr-lang").toString();
+    params.oem       = modeFromSettings(settings, "ocr-oem", oemNames, sizeof(oemNames) / sizeof(oemNames[0]));
+    params.psm       = modeFromSettings(settings, "ocr-psm", psmNames, sizeof(psmNames) / sizeof(psmNames[0]));
+    params.whitelist = settings.value("ocr-whitelist").toString();
+    params.font      = settings.value("ocr-font").toString();
+    return params;
+}
+
+QString OcrParams::toString() const
+{
+    return QString("%1/%2/%3/%4/%5").arg(lang).arg(oem).arg(psm).arg(whitelist).arg(font);
+}
+
+OcrEngine::OcrEngine(const QString& lang, int oem)
+    : tess(nullptr)
+    , language(lang)
+    , engineMode(oem)
+    , defaultPsm(-1)
+{
+#ifdef WITH_TESSERACT
+    tess = new tesseract::TessBaseAPI;
+
+    // Set locale to "C" to avoid tesseract crash. Then revert to the system default
+    //
+    QMutexLocker locker(&localeLock);
+    QByteArray oldLocale(setlocale(LC_NUMERIC, "C"));
+    if (tess->Init(nullptr, lang.toUtf8(), oem < 0? tesseract::OEM_TESSERACT_ONLY: tesseract::OcrEngineMode(oem)) != 0)
+    {
+        qWarning() << "Failed to initialize OCR for" << lang << "mode" << oem;
+    }
+    setlocale(LC_NUMERIC, oldLocale);
+    defaultPsm = tess->GetPageSegMode();
+#endif
+}
+
+OcrEngine::~OcrEngine()
+{
+#ifdef WITH_TESSERACT
+    delete tess;
+#endif
+}
+
+QString OcrEngine::recognize(const OcrImage& img, const OcrRegion& region, const ImagePrepOptions& prep,
+                             int timeout, bool* expired)
+{
+    *expired = false;
+#ifdef WITH_TESSERACT
+    auto& rect = region.rect;
+    auto crop = img.crop(rect);
+    if (!crop)
+    {
+        return QString();
+    }
+
+    // Same pixels in the same region give the same text
+    //
+    auto& cache = OcrCache::instance();
+    auto key = OcrCache::key(*crop, rect, region.params.toString() + "/" + prep.toString());
+    QString str;
+
+    if (!cache.find(key, str))
+    {
+        // The engine is shared by rules with different settings,
+        // so the variables are always set, not only when they differ from the defaults.
+        //
+        auto& params = region.params;
+        tess->SetPageSegMode(tesseract::PageSegMode(params.psm < 0? defaultPsm: params.psm));
+        tess->SetVariable("tessedit_char_whitelist", params.whitelist.toUtf8());
+
+        // The buffer must live until the recognition is done
+        //
+        PrepImage prepared;
+        if (prep.isEnabled())
+        {
+            prepared = prepareImage(*crop, rect, prep);
+            tess->SetImage(prepared.data(), prepared.width, prepared.height, 1, prepared.width);
+        }
+        else
+        {
+            tess->SetImage(crop->data(), crop->rect.width(), crop->rect.height(), 1, crop->bytesPerLine());
+            tess->SetRectangle(rect.left() - crop->rect.left(), rect.top() - crop->rect.top(), rect.width(), rect.height());
+        }
+
+        // Tesseract checks the deadline between the words and gives up
+        //
+        ETEXT_DESC monitor;
+        if (timeout > 0)
+        {
+            monitor.set_deadline_msecs(timeout);
+        }
+
+        auto failed = tess->Recognize(timeout > 0? &monitor: nullptr) != 0;
+        if (timeout > 0 && monitor.deadline_exceeded())
+        {
+            qWarning() << "OCR of" << rect << "cancelled after" << timeout << "ms";
+            countEvent("ocr-timeouts");
+            tess->Clear();
+            *expired = true;
+            return QString();
+        }
+
+        char* text = failed? nullptr: tess->GetUTF8Text();
+        if (!text)
+        {
+            // Not the text of the region, so the next image tries again
+            //
+            qWarning() << "OCR of" << rect << "failed";
+            return QString();
+        }
+
+        str = QString::fromUtf8(text);
+        delete[] text;
+        cache.insert(key, str);
+    }
+
+    return str;
+#else
+    Q_UNUSED(img);
+    Q_UNUSED(region);
+    Q_UNUSED(prep);
+    Q_UNUSED(timeout);
+    return "(built with no OCR support)";
+#endif
+}
+
+OcrEnginePool& OcrEnginePool::instance()
+{
+    static OcrEnginePool pool(QUtf8Settings().value("ocr-threads", DEFAULT_OCR_THREADS).toInt());
+    return pool;
+}
+
+OcrEnginePool::OcrEnginePool(int size)
+    : engineCount(0)
+    , maxEngines(qMax(1, size))
+{
+    threads.setMaxThreadCount(maxEngines);
+
+    QUtf8Settings settings;
+    prep = ImagePrepOptions::fromSettings(settings);
+    regionTimeout = settings.value("ocr-region-timeout-ms", DEFAULT_OCR_REGION_TIMEOUT_MS).toInt();
+    imageTimeout  = settings.value("ocr-image-timeout-ms", DEFAULT_OCR_IMAGE_TIMEOUT_MS).toInt();
+}
+
+OcrEngine* OcrEnginePool::acquire(const QString& lang, int oem)
+{
+    QMutexLocker locker(&lock);
+    Q_FOREVER
+    {
+        for (int i = 0; i < idle.size(); ++i)
+        {
+            if (idle[i]->lang() == lang && idle[i]->oem() == oem)
+            {
+                return idle.takeAt(i);
+            }
+        }
+
+        if (engineCount < maxEngines || !idle.isEmpty())
+        {
+            // Replace an idle engine for another language, if there is no room for a new one
+            //
+            if (engineCount < maxEngines)
+            {
+                ++engineCount;
+            }
+            else
+            {
+                delete idle.takeFirst();
+            }
+
+            locker.unlock();
+            return new OcrEngine(lang, oem);
+        }
+
+        engineReleased.wait(&lock);
+    }
+}
+
+void OcrEnginePool::release(OcrEngine* engine)
+{
+    QMutexLocker locker(&lock);
+    idle.append(engine);
+    engineReleased.wakeOne();
+}
+
+QString OcrEnginePool::recognizeOne(const OcrImage& img, const OcrRegion& region,
+                                   const QElapsedTimer& imageTimer, bool* expired)
+{
+    // Fixed fonts are matched against the glyph table first,
+    // tesseract is the fallback for the characters the table does not know.
+    //
+    if (!region.params.font.isEmpty())
+    {
+        auto matcher = GlyphMatcher::forFont(region.params.font);
+        auto crop = img.crop(region.rect);
+        QString text;
+        if (matcher && crop && matcher->recognize(*crop, region.rect, text))
+        {
+            countEvent("glyph-matches");
+            *expired = false;
+            return text;
+        }
+        countEvent("glyph-fallbacks");
+    }
+
+    auto engine = acquire(region.params.lang, region.params.oem);
+
+    // The region gets its own budget, but no more than the image has left
+    //
+    auto timeout = regionTimeout;
+    if (imageTimeout > 0)
+    {
+        auto left = imageTimeout - (int)imageTimer.elapsed();
+        if (left <= 0)
+        {
+            release(engine);
+            qWarning() << "OCR of" << region.rect << "skipped, the image is out of time";
+            countEvent("ocr-timeouts");
+            *expired = true;
+            return QString();
+        }
+        timeout = timeout > 0? qMin(timeout, left): left;
+    }
+
+    auto text = engine->recognize(img, region, prep, timeout, expired);
+    release(engine);
+    return text;
+}
+
+QStringList OcrEnginePool::recognize(const OcrImage& img, const QList<OcrRegion>& regions, bool* expired)
+{
+    QStringList texts;
+    QElapsedTimer imageTimer;
+    imageTimer.start();
+
+    // One flag per region, since the regions may run in parallel
+    //
+    QVector<char> regionExpired(regions.size(), 0);
+
+    if (regions.size() < 2 || maxEngines < 2)
+    {
+        for (int i = 0; i < regions.size(); ++i)
+        {
+            bool flag;
+            texts.append(recognizeOne(img, regions[i], imageTimer, &flag));
+            regionExpired[i] = flag;
+        }
+    }
+    else
+    {
+        // Wall-clock time is the time of the slowest region
+        //
+        QList<QFuture<QString> > results;
+        for (int i = 0; i < regions.size(); ++i)
+        {
+            auto region = regions[i];
+            auto flag = regionExpired.data() + i;
+            results.append(QtConcurrent::run(&threads, [this, &img, &imageTimer, region, flag]()
+            {
+                bool regionFlag;
+                auto text = recognizeOne(img, region, imageTimer, &regionFlag);
+                *flag = regionFlag;
+                return text;
+            }));
+        }
+
+        Q_FOREACH (auto result, results)
+        {
+            texts.append(result.result());
+        }
+    }
+
+    if (expired)
+    {
+        *expired = regionExpired.contains(1);
+    }
+
+    return texts;
+}
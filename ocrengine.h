@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCRENGINE_H
+#define OCRENGINE_H
+
+#include "imageprep.h"
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QRect>
+#include <QStringList>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#define DEFAULT_OCR_LANG    "eng"
+#define DEFAULT_OCR_THREADS 2
+#define DEFAULT_OCR_REGION_TIMEOUT_MS 0
+#define DEFAULT_OCR_IMAGE_TIMEOUT_MS  0
+
+class OcrImage;
+class QSettings;
+namespace tesseract { class TessBaseAPI; }
+
+// How a region is recognized. Empty or negative fields mean the engine defaults.
+//
+struct OcrParams
+{
+    QString lang;      // Language(s), like eng+rus
+    int oem;           // tesseract::OcrEngineMode, OEM_TESSERACT_ONLY by default
+    int psm;           // tesseract::PageSegMode, PSM_SINGLE_BLOCK by default
+    QString whitelist; // Allowed characters, all by default
+    QString font;      // Glyph table to try before tesseract, none by default
+
+    OcrParams() : oem(-1), psm(-1) {}
+
+    /** reads ocr-lang, ocr-oem, ocr-psm, ocr-whitelist and ocr-font from the current settings group.
+     *  The modes are either tesseract numbers or names, like `single-line'.
+     */
+    static OcrParams fromSettings(QSettings& settings);
+
+    /** @return a short string for logs and cache keys.
+     */
+    QString toString() const;
+
+    bool operator==(const OcrParams& other) const
+    {
+        return lang == other.lang && oem == other.oem && psm == other.psm
+            && whitelist == other.whitelist && font == other.font;
+    }
+};
+
+// A region to recognize along with the parameters to recognize it with
+//
+struct OcrRegion
+{
+    QRect rect;
+    OcrParams params;
+
+    bool operator==(const OcrRegion& other) const { return rect == other.rect && params == other.params; }
+};
+
+// A single tesseract instance, initialized for a language and an engine mode.
+// Not thread safe, see OcrEnginePool.
+//
+class OcrEngine
+{
+public:
+    OcrEngine(const QString& lang, int oem);
+    ~OcrEngine();
+
+    const QString& lang() const { return language; }
+    int oem() const { return engineMode; }
+
+    /** recognizes the text in the region of the image.
+     *  The text recognized earlier for the same pixels is taken from the OcrCache.
+     *  @param img rendered regions of the image
+     *  @param region resolved region to recognize, the language and engine mode must match this engine
+     *  @param prep how to prepare the region before the recognition
+     *  @param timeout milliseconds to spend on the recognition, 0 for no limit
+     *  @param expired set to true if the recognition was cancelled due to the timeout
+     *  @return the text as is, null if expired
+     */
+    QString recognize(const OcrImage& img, const OcrRegion& region, const ImagePrepOptions& prep,
+                      int timeout, bool* expired);
+
+private:
+    tesseract::TessBaseAPI *tess;
+    QString language;
+    int engineMode;
+    int defaultPsm;
+};
+
+// OCR engines of the worker process. Independent regions of an image are
+// recognized in parallel, at most ocr-threads at a time. Engines are created
+// on demand and live as long as the process, since initialization is expensive.
+//
+class OcrEnginePool
+{
+public:
+    /** @return the pool of this process.
+     */
+    static OcrEnginePool& instance();
+
+    /** recognizes all the regions, in parallel if possible.
+     *  @param img rendered regions of the image
+     *  @param regions resolved regions to recognize, each one must have the language set
+     *  @param expired set to true if any region ran out of ocr-region-timeout-ms or ocr-image-timeout-ms
+     *  @return recognized text for each region, in the same order, null for the expired ones
+     */
+    QStringList recognize(const OcrImage& img, const QList<OcrRegion>& regions, bool* expired = nullptr);
+
+    /** replaces the preprocessing read from the settings, for the benchmark.
+     *  Must not be called while recognize() is running.
+     *  @param options how to prepare regions from now on
+     */
+    void setImagePrep(const ImagePrepOptions& options) { prep = options; }
+
+private:
+    explicit OcrEnginePool(int size);
+
+    /** takes an idle engine for the language and the mode, waits if all engines are busy.
+     */
+    OcrEngine* acquire(const QString& lang, int oem);
+
+    /** returns the engine to the pool.
+     */
+    void release(OcrEngine* engine);
+
+    QString recognizeOne(const OcrImage& img, const OcrRegion& region, const QElapsedTimer& imageTimer, bool* expired);
+
+    ImagePrepOptions prep;
+    int regionTimeout;
+    int imageTimeout;
+    QMutex lock;
+    QWaitCondition engineReleased;
+    QList<OcrEngine*> idle;
+    int engineCount;
+    int maxEngines;
+    QThreadPool threads;
+};
+
+#endif // OCRENGINE_H
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ocrimage.h"
+
+#include <QDebug>
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmimgle/dcmimage.h> /* for DicomImage */
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+OcrImage::OcrImage(DicomImage *di)
+    : di(di)
+    , imageWidth(di? (int)di->getWidth(): 0)
+    , imageHeight(di? (int)di->getHeight(): 0)
+{
+}
+
+QRect OcrImage::resolve(const QRect& rect) const
+{
+    auto ret = rect;
+    if (ret.left() < 0) ret.moveLeft(imageWidth + ret.left());
+    if (ret.top() < 0) ret.moveTop(imageHeight + ret.top());
+    return ret.intersected(QRect(0, 0, imageWidth, imageHeight));
+}
+
+void OcrImage::setRegions(const QList<QRect>& rects)
+{
+    // Merge overlapping regions, so each pixel is rendered once
+    //
+    QList<QRect> merged;
+    Q_FOREACH (auto rect, rects)
+    {
+        if (rect.isEmpty())
+        {
+            continue;
+        }
+
+        for (int i = 0; i < merged.size(); )
+        {
+            if (merged[i].intersects(rect))
+            {
+                rect |= merged.takeAt(i);
+                i = 0; // The bigger rect may intersect the ones we have checked already
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        merged.append(rect);
+    }
+
+    crops.clear();
+    Q_FOREACH (auto rect, merged)
+    {
+        crops.append(render(rect));
+    }
+}
+
+const OcrCrop* OcrImage::crop(const QRect& rect) const
+{
+    for (int i = 0; i < crops.size(); ++i)
+    {
+        if (crops[i].rect.contains(rect))
+        {
+            return &crops[i];
+        }
+    }
+
+    return nullptr;
+}
+
+OcrCrop OcrImage::render(const QRect& rect) const
+{
+    OcrCrop crop;
+    crop.rect = rect;
+
+    DicomImage *clipped = di->createClippedImage(rect.left(), rect.top(), rect.width(), rect.height());
+    if (clipped && !clipped->isMonochrome())
+    {
+        // Tesseract works with grayscale images anyway
+        //
+        auto mono = clipped->createMonochromeImage();
+        delete clipped;
+        clipped = mono;
+    }
+
+    auto data = clipped? clipped->getOutputData(8): nullptr;
+    if (data)
+    {
+        crop.pixels = QByteArray((const char*)data, rect.width() * rect.height());
+    }
+    else
+    {
+        qDebug() << "Failed to render" << rect
+                 << (clipped? DicomImage::getString(clipped->getStatus()): "out of memory");
+        crop.rect = QRect();
+    }
+
+    delete clipped;
+    return crop;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCRIMAGE_H
+#define OCRIMAGE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QRect>
+
+class DicomImage;
+
+// A part of the film rendered with 8 bits per pixel, rows are not padded.
+//
+struct OcrCrop
+{
+    QRect rect;
+    QByteArray pixels;
+
+    const unsigned char* data() const { return (const unsigned char*)pixels.constData(); }
+    int bytesPerLine() const { return rect.width(); }
+};
+
+// The film as seen by OCR. Instead of the whole multi-megapixel image,
+// only the regions of the tag rules are rendered. Overlapping regions
+// share a single crop.
+//
+class OcrImage
+{
+public:
+    explicit OcrImage(DicomImage *di);
+
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+
+    /** converts a region from the settings to the image coordinates.
+     *  Negative left and top are offsets from the right and bottom edges.
+     *  @param rect region from the settings
+     *  @return region inside the image, may be empty
+     */
+    QRect resolve(const QRect& rect) const;
+
+    /** renders all the regions. Regions must be already resolved.
+     *  @param rects regions to render
+     */
+    void setRegions(const QList<QRect>& rects);
+
+    /** looks up the crop which contains the region.
+     *  @param rect resolved region
+     *  @return the crop or NULL if the region was not passed to setRegions()
+     */
+    const OcrCrop* crop(const QRect& rect) const;
+
+private:
+    OcrCrop render(const QRect& rect) const;
+
+    DicomImage *di;
+    int imageWidth;
+    int imageHeight;
+    QList<OcrCrop> crops;
+};
+
+#endif // OCRIMAGE_H
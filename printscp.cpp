@@ -15,14 +15,24 @@
  */
 
 #include "product.h"
+#include "attrcodec.h"
+#include "demographics.h"
 #include "printscp.h"
+#include "statistics.h"
 #include "storescp.h"
+#include "ocrengine.h"
+#include "ocrimage.h"
+#include "queryendpoints.h"
 #include "transcyrillic.h"
+#include "upstreampool.h"
+#include "webcache.h"
+#include "webclient.h"
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
-#include <QNetworkAccessManager>
+#include <QHash>
+#include <QMutex>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
@@ -31,11 +41,21 @@
 #include <QJsonObject>
 #endif
 #include <QRect>
+#include <QSet>
+#include <QSharedPointer>
 #include <QUtf8Settings>
 #include <QStringList>
+#include <QThreadPool>
 #include <QXmlStreamReader>
+#include <QtConcurrentRun>
 
-#include <locale.h> // Required for tesseract
+#ifdef Q_OS_WIN
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
 
 #ifdef UNICODE
 #define DCMTK_UNICODE_BUG_WORKAROUND
@@ -46,6 +66,8 @@
 #include <dcmtk/dcmdata/dcfilefo.h>
 #include <dcmtk/dcmdata/dcsequen.h>
 #include <dcmtk/dcmdata/dcvrui.h>
+#include <dcmtk/dcmnet/dcmtrans.h>    /* for DcmTransportConnection */
+#include <dcmtk/dcmnet/dulstruc.h>    /* for PRIVATE_ASSOCIATIONKEY */
 #include <dcmtk/dcmpstat/dvpsdef.h>     /* for constants */
 #include <dcmtk/dcmimgle/dcmimage.h>    /* for DicomImage */
 
@@ -97,140 +119,6 @@ bool saveToDisk(const QString& spoolPath, DcmDataset* rqDataset)
     return cond.good();
 }
 
-static OFCondition putAndInsertVariant(DcmDataset* dataset, const DcmTag& tag, const QVariant& value)
-{
-    switch (tag.getEVR())
-    {
-    case EVR_FL:
-    case EVR_OF:
-        return dataset->putAndInsertFloat32(tag, value.toFloat());
-    case EVR_FD:
-        return dataset->putAndInsertFloat64(tag, value.toDouble());
-    case EVR_SL:
-        return dataset->putAndInsertSint32(tag, value.toInt());
-    case EVR_UL:
-        return dataset->putAndInsertUint32(tag, value.toUInt());
-    case EVR_SS:
-        return dataset->putAndInsertSint16(tag, (Sint16)value.toInt());
-    case EVR_US:
-        return dataset->putAndInsertUint16(tag, (Uint16)value.toUInt());
-    case EVR_DA:
-        return dataset->putAndInsertString(tag, value.toDate().toString("yyyyMMdd").toUtf8());
-    case EVR_DT:
-        return dataset->putAndInsertString(tag, value.toDateTime().toString("yyyyMMddHHmmss").toUtf8());
-    case EVR_TM:
-        return dataset->putAndInsertString(tag, value.toTime().toString("HHmmss").toUtf8());
-    default:
-        if (tag.getVR().isaString())
-        {
-            return dataset->putAndInsertString(tag, value.toString().toUtf8());
-        }
-        break;
-    }
-
-    qDebug() << "VR" << tag.getVRName() << "not implemented";
-    return EC_IllegalParameter;
-}
-
-static OFCondition findAndGetVariant(DcmDataset* dataset, const DcmTag& tag, QVariant& value)
-{
-    OFCondition cond;
-    switch (tag.getEVR())
-    {
-    case EVR_FL:
-    case EVR_OF:
-        {
-            float f = 0.0f;
-            cond = dataset->findAndGetFloat32(tag, f);
-            if (cond.good()) { value.setValue(f); }
-            break;
-        }
-    case EVR_FD:
-        {
-            double d = 0.0;
-            cond = dataset->findAndGetFloat64(tag, d);
-            if (cond.good()) { value.setValue(d); }
-            break;
-        }
-    case EVR_SL:
-        {
-            Sint32 i = 0;
-            cond = dataset->findAndGetSint32(tag, i);
-            if (cond.good()) { value.setValue(i); }
-            break;
-        }
-    case EVR_UL:
-        {
-            Uint32 u = 0;
-            cond = dataset->findAndGetUint32(tag, u);
-            if (cond.good()) { value.setValue(u); }
-            break;
-        }
-    case EVR_SS:
-        {
-            Sint16 i = 0;
-            cond = dataset->findAndGetSint16(tag, i);
-            if (cond.good()) { value.setValue(i); }
-            break;
-        }
-    case EVR_US:
-        {
-            Uint16 u = 0;
-            cond = dataset->findAndGetUint16(tag, u);
-            if (cond.good()) { value.setValue(u); }
-            break;
-        }
-    case EVR_DA:
-        {
-            const char* str = nullptr;
-            cond = dataset->findAndGetString(tag, str);
-            if (cond.good())
-            {
-                value.setValue(QDate::fromString(str, "yyyyMMdd"));
-            }
-            break;
-        }
-    case EVR_DT:
-        {
-            const char* str = nullptr;
-            cond = dataset->findAndGetString(tag, str);
-            if (cond.good())
-            {
-                value.setValue(QDateTime::fromString(str, "yyyyMMddHHmmss"));
-            }
-            break;
-        }
-    case EVR_TM:
-        {
-            const char* str = nullptr;
-            cond = dataset->findAndGetString(tag, str);
-            if (cond.good())
-            {
-                value.setValue(QTime::fromString(str, "HHmmss"));
-            }
-            break;
-        }
-    default:
-        if (tag.getVR().isaString())
-        {
-            const char* str = nullptr;
-            cond = dataset->findAndGetString(tag, str);
-            if (cond.good())
-            {
-                value.setValue(QString::fromUtf8(str));
-            }
-        }
-        else
-        {
-            qDebug() << "VR" << tag.getVRName() << "not implemented";
-            cond = EC_IllegalParameter;
-            break;
-        }
-    }
-
-    return cond;
-}
-
 static bool isDatasetPresent(T_DIMSE_Message &msg)
 {
     switch (msg.CommandField)
@@ -269,28 +157,177 @@ static bool isDatasetPresent(T_DIMSE_Message &msg)
     return false;
 }
 
-static void copyItems(DcmItem* src, DcmItem *dst)
+// Turns on TCP keepalive, so a peer that has gone without A-RELEASE or A-ABORT
+// (power loss, network failure) is detected by the system.
+//
+static void enableKeepAlive(T_ASC_Association *assoc, QSettings& settings)
+{
+    if (!assoc || !assoc->DULassociation || !settings.value("tcp-keepalive").toBool())
+    {
+        return;
+    }
+
+    auto key = (PRIVATE_ASSOCIATIONKEY*)assoc->DULassociation;
+    if (!key->connection)
+    {
+        return;
+    }
+
+    auto sock = key->connection->getSocket();
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (const char*)&on, sizeof(on)) != 0)
+    {
+        qDebug() << "Failed to enable TCP keepalive" << QString::fromLocal8Bit(strerror(errno));
+        return;
+    }
+
+#ifdef TCP_KEEPIDLE
+    int idle     = settings.value("tcp-keepalive-idle").toInt();
+    int interval = settings.value("tcp-keepalive-interval").toInt();
+    int count    = settings.value("tcp-keepalive-count").toInt();
+
+    // Zero means the system default
+    //
+    if (idle > 0)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    }
+    if (interval > 0)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    }
+    if (count > 0)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+#endif
+}
+
+// Printer attributes for N-GET, built once from the `info' array of the printer section.
+// For upstream printers, the attributes are updated with N-GET responses of the real printer
+// and saved to the settings file to share them with all worker processes.
+//
+struct PrinterInfo
+{
+    QSharedPointer<DcmDataset> attributes;
+
+    // When the attributes were received from the real printer, msecs since epoch.
+    // Zero if they have come from the settings file only.
+    //
+    qint64 timestamp;
+};
+
+static QMap<QString, PrinterInfo> printerInfoCache;
+
+static PrinterInfo& printerInfo(const QString& printer)
 {
-    // The source dataset is optional
+    auto it = printerInfoCache.find(printer);
+    if (it != printerInfoCache.end())
+    {
+        return *it;
+    }
+
+    PrinterInfo info = { QSharedPointer<DcmDataset>(new DcmDataset), 0 };
+
+    QUtf8Settings settings;
+    settings.beginGroup(printer);
+    auto size = settings.beginReadArray("info");
+    for (int idx = 0; idx < size; ++idx)
+    {
+        settings.setArrayIndex(idx);
+        auto key = settings.value("key").toString();
+        auto attr = TextAttr::byName(key);
+        if (attr.isValid())
+        {
+            attr.put(info.attributes.data(), settings.value("value").toString());
+        }
+        else
+        {
+            qDebug() << "Bad DICOM tag" << key << "in" << printer << "info" << idx;
+        }
+    }
+    settings.endArray();
+    settings.endGroup();
+
+    // Attributes of the real printer, received by other worker processes
     //
-    if (!src)
+    settings.beginGroup("printer-info-cache");
+    settings.beginGroup(printer);
+    Q_FOREACH (auto key, settings.childKeys())
+    {
+        bool ok = false;
+        auto tagKey = key.toUInt(&ok, 16);
+        if (ok)
+        {
+            DcmTag tag(tagKey >> 16, tagKey & 0xFFFF);
+            info.attributes->putAndInsertString(tag, settings.value(key).toString().toUtf8());
+        }
+    }
+    info.timestamp = settings.value("timestamp", info.timestamp).toLongLong();
+    settings.endGroup();
+    settings.endGroup();
+
+    return printerInfoCache[printer] = info;
+}
+
+// Stores the attributes of the real printer to the settings file, so all worker
+// processes get them, and to the cache of this process, if updateCache is set.
+// Background threads must not touch the cache, it belongs to the client thread.
+//
+static void updatePrinterInfo(const QString& printer, DcmDataset* rspDataset, bool updateCache = true)
+{
+    if (!rspDataset)
     {
         return;
     }
 
+    auto timestamp = QDateTime::currentMSecsSinceEpoch();
+    auto info = updateCache? &printerInfo(printer): nullptr;
+    if (info)
+    {
+        info->timestamp = timestamp;
+    }
+
+    QUtf8Settings settings;
+    settings.beginGroup("printer-info-cache");
+    settings.beginGroup(printer);
+    settings.setValue("timestamp", timestamp);
+
     DcmObject* obj = nullptr;
-    while (obj = src->nextInContainer(obj), obj != nullptr)
+    while (obj = rspDataset->nextInContainer(obj), obj != nullptr)
     {
-        if (obj->getVR() == EVR_SQ)
+        auto elm = dynamic_cast<DcmElement*>(obj);
+        OFString str;
+        if (!elm || obj->getVR() == EVR_SQ || elm->getOFStringArray(str).bad())
         {
-            // Ignore ReferencedFilmSessionSequence
-            //
             continue;
         }
 
-        // Insert with overwrite
-        //
-        dst->insert(dynamic_cast<DcmElement*>(obj->clone()), true);
+        if (info)
+        {
+            info->attributes->insert(dynamic_cast<DcmElement*>(elm->clone()), true);
+        }
+        auto tagKey = ((uint)obj->getGTag() << 16) | obj->getETag();
+        settings.setValue(QString("%1").arg(tagKey, 8, 16, QChar('0')), QString::fromUtf8(str.c_str()));
+    }
+
+    settings.endGroup();
+    settings.endGroup();
+}
+
+void PrintSCP::loadPrinterInfo()
+{
+    QUtf8Settings settings;
+    Q_FOREACH (auto group, settings.childGroups())
+    {
+        settings.beginGroup(group);
+        auto isPrinter = settings.childGroups().contains("info");
+        settings.endGroup();
+
+        if (isPrinter)
+        {
+            printerInfo(group);
+        }
     }
 }
 
@@ -300,34 +337,50 @@ PrintSCP::PrintSCP(T_ASC_Association *assoc, QObject *parent, const QString &pri
     , timeout(DEFAULT_TIMEOUT)
     , forceUniqueSeries(false)
     , forceUniqueStudy(false)
-    , sessionDataset(nullptr)
     , printer(printer)
     , upstreamNet(nullptr)
     , assoc(assoc)
     , upstream(nullptr)
+    , upstreamPool(nullptr)
+    , upstreamIdx(-1)
     , debugUpstream(false)
+    , printerInfoTtl(DEFAULT_PRINTER_INFO_TTL)
+    , printerInfoExpired(false)
+    , clientIdleTimeout(0)
+    , upstreamBlockMode(DIMSE_BLOCKING)
+    , upstreamTimeout(0)
+    , lastActivity(0)
+    , workers(nullptr)
 {
     QUtf8Settings settings;
-    auto ocrLang = settings.value("ocr-lang", DEFAULT_OCR_LANG).toString();
-
-#ifdef WITH_TESSERACT
-    // Set locale to "C" to avoid tesseract crash. Then revert to the system default
-    //
-    auto oldLocale = setlocale(LC_NUMERIC, "C");
-    tess.Init(nullptr, ocrLang.toUtf8(), tesseract::OEM_TESSERACT_ONLY);
-    setlocale(LC_NUMERIC, oldLocale);
-#endif
+    ocrLang = settings.value("ocr-lang", DEFAULT_OCR_LANG).toString();
+    ocrTimeoutPath = settings.value("ocr-timeout-path").toString();
 
     blockMode     = (T_DIMSE_BlockingMode)settings.value("block-mode", blockMode).toInt();
     timeout       = settings.value("timeout", timeout).toInt();
     debugUpstream = settings.value("debug-upstream", debugUpstream).toBool();
+    printerInfoTtl = settings.value("printer-info-ttl", printerInfoTtl).toInt();
+    clientIdleTimeout = settings.value("client-idle-timeout", clientIdleTimeout).toInt();
     reBadSymbols.setPattern(settings.value("bad-symbols").toString());
+
+    // The upstream printer must respond within upstream-idle-timeout seconds,
+    // otherwise the usual block-mode and timeout are used.
+    //
+    auto upstreamIdleTimeout = settings.value("upstream-idle-timeout").toInt();
+    upstreamBlockMode = upstreamIdleTimeout > 0? DIMSE_NONBLOCKING: blockMode;
+    upstreamTimeout   = upstreamIdleTimeout > 0? upstreamIdleTimeout: timeout;
 }
 
 PrintSCP::~PrintSCP()
 {
+    Q_FOREACH (auto image, pendingImages)
+    {
+        image.waitForFinished();
+    }
+    qDeleteAll(storageServers);
     dropAssociations();
     ASC_dropNetwork(&upstreamNet);
+    flushStatistics();
     qDebug() << __func__  << "pid" << getpid();
 }
 
@@ -418,6 +471,8 @@ bool PrintSCP::negotiateAssociation()
         cond = ASC_acceptContextsWithPreferredTransferSyntaxes(assoc->params,
             abstractSyntaxes, sizeof(abstractSyntaxes)/sizeof(abstractSyntaxes[0]),
             transferSyntaxes, sizeof(transferSyntaxes)/sizeof(transferSyntaxes[0]));
+
+        enableKeepAlive(assoc, settings);
     }
 
     if (dropAssoc)
@@ -430,67 +485,38 @@ bool PrintSCP::negotiateAssociation()
         // Initialize connection to upstream printer, if one is configured
         //
         settings.beginGroup(printer);
-        auto printerAETitle  = settings.value("upstream-aetitle").toString();
-        auto printerAddress  = settings.value("upstream-address").toString();
         auto calleeAETitle   = settings.value("aetitle", assoc->params->DULparams.callingAPTitle).toString().toUpper();
         forceUniqueSeries    = settings.value("force-unique-series", forceUniqueSeries).toBool();
         forceUniqueStudy     = settings.value("force-unique-study", forceUniqueStudy).toBool();
         debugUpstream        = settings.value("debug-upstream", debugUpstream).toBool();
+        printerInfoTtl       = settings.value("printer-info-ttl", printerInfoTtl).toInt();
         reBadSymbols.setPattern(settings.value("bad-symbols", reBadSymbols.pattern()).toString());
         settings.endGroup();
 
-        if (printerAETitle.isEmpty())
+        upstreamPool = new UpstreamPool(printer);
+        if (upstreamPool->size() == 0)
         {
             qDebug() << "No upstream connection for" << printer;
         }
         else
         {
-            DIC_NODENAME localHost;
-            T_ASC_Parameters* params = nullptr;
-
-            auto port  = settings.value("print-port", 0).toInt();
-            auto cond = ASC_initializeNetwork(NET_REQUESTOR, port, timeout, &upstreamNet);
-
-            qDebug() << "Creating upstream connection to" << printer;
-
-            cond = ASC_createAssociationParameters(&params, settings.value("pdu-size", ASC_DEFAULTMAXPDU).toInt());
-            if (cond.good())
+            // Try all upstream printers until one of them accepts the association
+            //
+            Q_FOREACH (auto idx, upstreamPool->candidates())
             {
-                ASC_setAPTitles(params, calleeAETitle.toUtf8(), printerAETitle.toUtf8(), nullptr);
-
-                // Figure out the presentation addresses and copy the
-                // corresponding values into the DcmAssoc parameters.
-                //
-                gethostname(localHost, sizeof(localHost) - 1);
-                ASC_setPresentationAddresses(params, localHost, printerAddress.toUtf8());
-
-                for (size_t i = 0; cond.good() && i < sizeof(abstractSyntaxes)/sizeof(abstractSyntaxes[0]); ++i)
+                if (connectUpstream(calleeAETitle, upstreamPool->aetitle(idx), upstreamPool->address(idx)).good())
                 {
-                    cond = ASC_addPresentationContext(params, i*2+1, abstractSyntaxes[i],
-                        transferSyntaxes, sizeof(transferSyntaxes)/sizeof(transferSyntaxes[0]));
+                    upstreamIdx = idx;
+                    upstreamPool->jobStarted(idx);
+                    break;
                 }
-            }
 
-            if (cond.good())
-            {
-                cond = ASC_requestAssociation(upstreamNet, params, &upstream);
+                upstreamPool->markFailed(idx);
             }
 
-            if (cond.bad())
-            {
-                qDebug() << "Failed to create association to" << printerAETitle << QString::fromLocal8Bit(cond.text());
-                ASC_destroyAssociation(&upstream);
-            }
-            else
+            if (!upstream)
             {
-                // Dump general information concerning the establishment of the network connection if required
-                //
-                qDebug() << "Connection to upstream printer" << printer
-                         << "accepted (max send PDV: " << upstream->sendPDVLength << ")"
-                         << upstream->params->DULparams.callingPresentationAddress << ":"
-                         << upstream->params->DULparams.callingAPTitle << "=>"
-                         << upstream->params->DULparams.calledPresentationAddress << ":"
-                         << upstream->params->DULparams.calledAPTitle;
+                qDebug() << "All upstream printers for" << printer << "are unavailable";
             }
         }
 
@@ -498,18 +524,115 @@ bool PrintSCP::negotiateAssociation()
         // Later we will add all attributes comes from client/server to the
         // final message. And store the message to the storage server.
         //
-        sessionDataset = new DcmDataset;
-        sessionDataset->putAndInsertString(DCM_RETIRED_DestinationAE, calleeAETitle.toUtf8());
+        sessionAttributes.clear();
+        sessionAttributes.put(DCM_RETIRED_DestinationAE, calleeAETitle.toUtf8());
 
         // Fill in with some defaults
         //
-        sessionDataset->putAndInsertString(DCM_PatientID,   "0", false);
-        sessionDataset->putAndInsertString(DCM_PatientName, "^", false);
+        sessionAttributes.put(DCM_PatientID,   "0", false);
+        sessionAttributes.put(DCM_PatientName, "^", false);
     }
 
     return !dropAssoc;
 }
 
+static const char* const upstreamTransferSyntaxes[] =
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    UID_LittleEndianExplicitTransferSyntax, UID_BigEndianExplicitTransferSyntax,
+#elif __BYTE_ORDER == __BIG_ENDIAN
+    UID_BigEndianExplicitTransferSyntax, UID_LittleEndianExplicitTransferSyntax,
+#else
+#error "Unsupported byte order"
+#endif
+    UID_LittleEndianImplicitTransferSyntax
+};
+
+// Requests an association with a real printer for the given abstract syntaxes
+//
+static OFCondition requestPrinterAssociation(T_ASC_Network* net, const QString& callingAETitle,
+    const QString& printerAETitle, const QString& printerAddress,
+    const char* const* abstractSyntaxes, size_t count, T_ASC_Association** assoc)
+{
+    QUtf8Settings settings;
+    DIC_NODENAME localHost;
+    T_ASC_Parameters* params = nullptr;
+
+    auto cond = ASC_createAssociationParameters(&params, settings.value("pdu-size", ASC_DEFAULTMAXPDU).toInt());
+    if (cond.good())
+    {
+        ASC_setAPTitles(params, callingAETitle.toUtf8(), printerAETitle.toUtf8(), nullptr);
+
+        // Figure out the presentation addresses and copy the
+        // corresponding values into the DcmAssoc parameters.
+        //
+        gethostname(localHost, sizeof(localHost) - 1);
+        ASC_setPresentationAddresses(params, localHost, printerAddress.toUtf8());
+
+        for (size_t i = 0; cond.good() && i < count; ++i)
+        {
+            cond = ASC_addPresentationContext(params, i*2+1, abstractSyntaxes[i],
+                (const char**)upstreamTransferSyntaxes, sizeof(upstreamTransferSyntaxes)/sizeof(upstreamTransferSyntaxes[0]));
+        }
+    }
+
+    if (cond.good())
+    {
+        cond = ASC_requestAssociation(net, params, assoc);
+    }
+
+    return cond;
+}
+
+OFCondition PrintSCP::connectUpstream(const QString& calleeAETitle, const QString& printerAETitle, const QString& printerAddress)
+{
+    QUtf8Settings settings;
+
+    const char *abstractSyntaxes[] =
+    {
+        UID_BasicGrayscalePrintManagementMetaSOPClass,
+        UID_PresentationLUTSOPClass,
+        UID_VerificationSOPClass,
+    };
+
+    OFCondition cond = EC_Normal;
+    if (!upstreamNet)
+    {
+        auto port  = settings.value("print-port", 0).toInt();
+        cond = ASC_initializeNetwork(NET_REQUESTOR, port, timeout, &upstreamNet);
+    }
+
+    qDebug() << "Creating upstream connection to" << printerAETitle << printerAddress;
+
+    if (cond.good())
+    {
+        cond = requestPrinterAssociation(upstreamNet, calleeAETitle, printerAETitle, printerAddress,
+            abstractSyntaxes, sizeof(abstractSyntaxes)/sizeof(abstractSyntaxes[0]), &upstream);
+    }
+
+    if (cond.bad())
+    {
+        qDebug() << "Failed to create association to" << printerAETitle << QString::fromLocal8Bit(cond.text());
+        ASC_destroyAssociation(&upstream);
+        upstream = nullptr;
+    }
+    else
+    {
+        enableKeepAlive(upstream, settings);
+
+        // Dump general information concerning the establishment of the network connection if required
+        //
+        qDebug() << "Connection to upstream printer" << printer
+                 << "accepted (max send PDV: " << upstream->sendPDVLength << ")"
+                 << upstream->params->DULparams.callingPresentationAddress << ":"
+                 << upstream->params->DULparams.callingAPTitle << "=>"
+                 << upstream->params->DULparams.calledPresentationAddress << ":"
+                 << upstream->params->DULparams.calledAPTitle;
+    }
+
+    return cond;
+}
+
 OFCondition PrintSCP::refuseAssociation(T_ASC_RejectParametersResult result, T_ASC_RejectParametersReason reason)
 {
     qDebug() << __FUNCTION__ << result << reason;
@@ -555,189 +678,439 @@ void PrintSCP::dropAssociations()
         ASC_dropSCPAssociation(upstream);
         ASC_destroyAssociation(&upstream);
         ASC_dropNetwork(&upstreamNet);
+
+        if (upstreamPool && upstreamIdx >= 0)
+        {
+            upstreamPool->jobFinished(upstreamIdx);
+            upstreamIdx = -1;
+        }
     }
 
-    delete sessionDataset;
-    sessionDataset = nullptr;
+    delete upstreamPool;
+    upstreamPool = nullptr;
+
+    sessionAttributes.clear();
     qDebug() << "Drop association completed. pid" << getpid();
 }
 
 void PrintSCP::handleClient()
 {
-    void *associatePDU = nullptr;
-    unsigned long associatePDUlength = 0;
-
-    OFCondition cond = ASC_acknowledgeAssociation(assoc, &associatePDU, &associatePDUlength);
-    delete[] (char *)associatePDU;
+    OFCondition cond = acknowledgeAssociation();
 
     // Do  the real work
     //
     while (cond.good())
     {
-        T_DIMSE_Message rq;
-        T_DIMSE_Message rsp;
-        T_ASC_PresentationContextID presId;
-        T_ASC_PresentationContextID upstreamPresId = 0;
-        DcmDataset *rawCommandSet = nullptr;
-        DcmDataset *statusDetail = nullptr;
-        DcmDataset *rqDataset = nullptr;
-        DcmDataset *rspDataset = nullptr;
+        cond = handleCommand();
+    }
 
-        cond = DIMSE_receiveCommand(assoc, DIMSE_BLOCKING, 0, &presId, &rq, &statusDetail, &rawCommandSet);
+    closeAssociation(cond);
+}
 
-        if (cond.bad())
-        {
-            qDebug() << "DIMSE_receiveCommand" << QString::fromLocal8Bit(cond.text());
-            break;
-        }
+OFCondition PrintSCP::acknowledgeAssociation()
+{
+    void *associatePDU = nullptr;
+    unsigned long associatePDUlength = 0;
 
-        dump("statusDetail", statusDetail);
-        dump("rawCommandSet", rawCommandSet);
-        delete rawCommandSet;
-        rawCommandSet = nullptr;
+    OFCondition cond = ASC_acknowledgeAssociation(assoc, &associatePDU, &associatePDUlength);
+    delete[] (char *)associatePDU;
+    lastActivity = QDateTime::currentMSecsSinceEpoch();
+    return cond;
+}
+
+bool PrintSCP::isIdle() const
+{
+    return clientIdleTimeout > 0
+        && QDateTime::currentMSecsSinceEpoch() - lastActivity > clientIdleTimeout * 1000LL;
+}
 
-        if (isDatasetPresent(rq))
+bool PrintSCP::isBusy()
+{
+    for (auto it = pendingImages.begin(); it != pendingImages.end(); )
+    {
+        if (it->isFinished())
         {
-            cond = DIMSE_receiveDataSetInMemory(assoc, blockMode, timeout, &presId, &rqDataset, nullptr, nullptr);
-            if (cond.bad())
-            {
-                qDebug() << "DIMSE_receiveDataSetInMemory" << QString::fromLocal8Bit(cond.text());
-                break;
-            }
+            it = pendingImages.erase(it);
         }
+        else
+        {
+            ++it;
+        }
+    }
 
-        dumpIn(rq, rqDataset);
-
-        if (upstream)
+    return !pendingImages.isEmpty();
+}
+
+OFCondition PrintSCP::handleCommand()
+{
+    T_DIMSE_Message rq;
+    T_DIMSE_Message rsp;
+    T_ASC_PresentationContextID presId;
+    T_ASC_PresentationContextID upstreamPresId = 0;
+    DcmDataset *rawCommandSet = nullptr;
+    DcmDataset *statusDetail = nullptr;
+    DcmDataset *rqDataset = nullptr;
+    DcmDataset *rspDataset = nullptr;
+
+    OFCondition cond = DIMSE_receiveCommand(assoc, clientIdleTimeout > 0? DIMSE_NONBLOCKING: DIMSE_BLOCKING,
+                                            clientIdleTimeout, &presId, &rq, &statusDetail, &rawCommandSet);
+
+    if (cond.bad())
+    {
+        qDebug() << "DIMSE_receiveCommand" << QString::fromLocal8Bit(cond.text());
+        return cond;
+    }
+
+    dump("statusDetail", statusDetail);
+    dump("rawCommandSet", rawCommandSet);
+    delete rawCommandSet;
+    rawCommandSet = nullptr;
+
+    if (isDatasetPresent(rq))
+    {
+        cond = DIMSE_receiveDataSetInMemory(assoc, blockMode, timeout, &presId, &rqDataset, nullptr, nullptr);
+        if (cond.bad())
         {
-            cond = DIMSE_sendMessageUsingMemoryData(upstream, presId, &rq, statusDetail, rqDataset, nullptr, nullptr, &rawCommandSet);
-            dump("rawCommandSet", rawCommandSet);
-            delete rawCommandSet;
-            rawCommandSet = nullptr;
+            qDebug() << "DIMSE_receiveDataSetInMemory" << QString::fromLocal8Bit(cond.text());
             delete statusDetail;
-            statusDetail = nullptr;
+            return cond;
+        }
+    }
 
-            if (cond.bad())
+    dumpIn(rq, rqDataset);
+
+    if (upstream && !isPrinterInfoCached(rq))
+    {
+        cond = DIMSE_sendMessageUsingMemoryData(upstream, presId, &rq, statusDetail, rqDataset, nullptr, nullptr, &rawCommandSet);
+        dump("rawCommandSet", rawCommandSet);
+        delete rawCommandSet;
+        rawCommandSet = nullptr;
+        delete statusDetail;
+        statusDetail = nullptr;
+
+        if (cond.bad())
+        {
+            qDebug() << "DIMSE_sendMessageUsingMemoryData(upstream) failed" << QString::fromLocal8Bit(cond.text())
+                     << "presId" << presId;
+            delete rqDataset;
+            return cond;
+        }
+
+        cond = DIMSE_receiveCommand(upstream, upstreamBlockMode, upstreamTimeout, &upstreamPresId, &rsp, &statusDetail, &rawCommandSet);
+        dump("rawCommandSet", rawCommandSet);
+        delete rawCommandSet;
+        rawCommandSet = nullptr;
+        dump("statusDetail", statusDetail);
+
+        if (cond == DIMSE_NODATAAVAILABLE)
+        {
+            qWarning() << "Upstream printer" << upstream->params->DULparams.calledPresentationAddress
+                       << "did not respond within" << upstreamTimeout << "seconds, closing session";
+            countEvent("reaped-upstream-associations");
+            if (upstreamPool && upstreamIdx >= 0)
             {
-                qDebug() << "DIMSE_sendMessageUsingMemoryData(upstream) failed" << QString::fromLocal8Bit(cond.text())
-                         << "presId" << presId;
-                break;
+                upstreamPool->markFailed(upstreamIdx);
             }
+            cond = DIMSE_RECEIVEFAILED;
+        }
+
+        if (cond.bad())
+        {
+            qDebug() << "DIMSE_recv(upstream) failed" << QString::fromLocal8Bit(cond.text());
+            delete statusDetail;
+            delete rqDataset;
+            return cond;
+        }
 
-            cond = DIMSE_receiveCommand(upstream, blockMode, timeout, &upstreamPresId, &rsp, &statusDetail, &rawCommandSet);
-            dump("rawCommandSet", rawCommandSet);
-            delete rawCommandSet;
-            rawCommandSet = nullptr;
-            dump("statusDetail", statusDetail);
+        if (rq.CommandField != (rsp.CommandField & ~0x8000))
+        {
+            qDebug() << "Mismatched response: rq" << rq.CommandField << "rsp" << rsp.CommandField;
+        }
 
+        if (isDatasetPresent(rsp))
+        {
+            cond = DIMSE_receiveDataSetInMemory(upstream, upstreamBlockMode, upstreamTimeout, &upstreamPresId, &rspDataset, nullptr, nullptr);
             if (cond.bad())
             {
-                qDebug() << "DIMSE_recv(upstream) failed" << QString::fromLocal8Bit(cond.text());
-                break;
+                qDebug() << "DIMSE_receiveDataSetInMemory(upstream)" << QString::fromLocal8Bit(cond.text());
+                delete statusDetail;
+                delete rqDataset;
+                return cond;
             }
+        }
 
-            if (rq.CommandField != (rsp.CommandField & ~0x8000))
-            {
-                qDebug() << "Mismatched response: rq" << rq.CommandField << "rsp" << rsp.CommandField;
-            }
+        if (DIMSE_N_GET_RQ == rq.CommandField && DIMSE_N_GET_RSP == rsp.CommandField
+            && 0 == strcmp(rq.msg.NGetRQ.RequestedSOPClassUID, UID_PrinterSOPClass)
+            && rsp.msg.NGetRSP.DimseStatus == STATUS_Success)
+        {
+            updatePrinterInfo(printer, rspDataset);
+        }
+    }
+    else
+    {
+        /* process command */
+        switch (rq.CommandField)
+        {
+        case DIMSE_C_ECHO_RQ:
+            cond = handleCEcho(rq, rqDataset, rsp, rspDataset);
+            break;
+        case DIMSE_N_GET_RQ:
+            cond = handleNGet(rq, rqDataset, rsp, rspDataset);
+            break;
+        case DIMSE_N_SET_RQ:
+            cond = handleNSet(rq, rqDataset, rsp, rspDataset);
+            break;
+        case DIMSE_N_ACTION_RQ:
+            cond = handleNAction(rq, rqDataset, rsp, rspDataset);
+            break;
+        case DIMSE_N_CREATE_RQ:
+            cond = handleNCreate(rq, rqDataset, rsp, rspDataset);
+            break;
+        case DIMSE_N_DELETE_RQ:
+            cond = handleNDelete(rq, rqDataset, rsp, rspDataset);
+            break;
+        default:
+            cond = DIMSE_BADCOMMANDTYPE; /* unsupported command */
+            qDebug() << "Cannot handle command: 0x" << QString::number((unsigned)rq.CommandField, 16);
+            break;
+        }
+    }
+
+    if (DIMSE_N_SET_RQ == rq.CommandField
+       && QString(rq.msg.NSetRQ.RequestedSOPClassUID).startsWith(UID_BasicGrayscaleImageBoxSOPClass))
+    {
+        SOPInstanceUID = QString::fromUtf8(rq.msg.NSetRQ.RequestedSOPInstanceUID);
+        char uid[100] = {0};
+
+        if (forceUniqueStudy)
+        {
+            studyInstanceUID = QString::fromUtf8(dcmGenerateUniqueIdentifier(uid,  SITE_STUDY_UID_ROOT));
+        }
+
+        if (forceUniqueSeries)
+        {
+            seriesInstanceUID = QString::fromUtf8(dcmGenerateUniqueIdentifier(uid,  SITE_SERIES_UID_ROOT));
+        }
+
+        if (workers && rqDataset)
+        {
+            // The response is sent right away, the rest is up to the pool.
+            // From now on, the dataset is owned by the worker.
+            //
+            prepareImage(rqDataset);
+            auto dataset = rqDataset;
+            rqDataset = nullptr;
 
-            if (isDatasetPresent(rsp))
+            isBusy(); // Forget about already completed images
+            pendingImages.append(QtConcurrent::run(workers, [this, dataset]()
             {
-                cond = DIMSE_receiveDataSetInMemory(upstream, blockMode, timeout, &upstreamPresId, &rspDataset, nullptr, nullptr);
-                if (cond.bad())
-                {
-                    qDebug() << "DIMSE_receiveDataSetInMemory(upstream)" << QString::fromLocal8Bit(cond.text());
-                    break;
-                }
-            }
+                QMutexLocker lock(&imageLock);
+                processImage(dataset);
+                delete dataset;
+            }));
         }
         else
         {
-            /* process command */
-            switch (rq.CommandField)
+            storeImage(rqDataset);
+        }
+    }
+    else
+    {
+        if (DIMSE_N_CREATE_RQ == rq.CommandField)
+        {
+            if (0 == strcmp(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmSessionSOPClass))
             {
-            case DIMSE_C_ECHO_RQ:
-                cond = handleCEcho(rq, rqDataset, rsp, rspDataset);
-                break;
-            case DIMSE_N_GET_RQ:
-                cond = handleNGet(rq, rqDataset, rsp, rspDataset);
-                break;
-            case DIMSE_N_SET_RQ:
-                cond = handleNSet(rq, rqDataset, rsp, rspDataset);
-                break;
-            case DIMSE_N_ACTION_RQ:
-                cond = handleNAction(rq, rqDataset, rsp, rspDataset);
-                break;
-            case DIMSE_N_CREATE_RQ:
-                cond = handleNCreate(rq, rqDataset, rsp, rspDataset);
-                break;
-            case DIMSE_N_DELETE_RQ:
-                cond = handleNDelete(rq, rqDataset, rsp, rspDataset);
-                break;
-            default:
-                cond = DIMSE_BADCOMMANDTYPE; /* unsupported command */
-                qDebug() << "Cannot handle command: 0x" << QString::number((unsigned)rq.CommandField, 16);
-                break;
+                studyInstanceUID = QString::fromUtf8(rsp.msg.NCreateRSP.AffectedSOPInstanceUID);
+            }
+            else if (0 == strcmp(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmBoxSOPClass))
+            {
+                seriesInstanceUID  = QString::fromUtf8(rsp.msg.NCreateRSP.AffectedSOPInstanceUID);
             }
         }
 
-        if (DIMSE_N_SET_RQ == rq.CommandField
-           && QString(rq.msg.NSetRQ.RequestedSOPClassUID).startsWith(UID_BasicGrayscaleImageBoxSOPClass))
+        sessionAttributes.update(rqDataset);
+        sessionAttributes.update(rspDataset);
+    }
+
+    delete rqDataset;
+    rqDataset = nullptr;
+
+    dumpOut(rsp, rspDataset);
+    cond = DIMSE_sendMessageUsingMemoryData(assoc, presId, &rsp, statusDetail, rspDataset, nullptr, nullptr, &rawCommandSet);
+    dump("rawCommandSet", rawCommandSet);
+    delete rawCommandSet;
+    rawCommandSet = nullptr;
+    delete statusDetail;
+    statusDetail = nullptr;
+    delete rspDataset;
+    rspDataset = nullptr;
+
+    lastActivity = QDateTime::currentMSecsSinceEpoch();
+
+    if (cond.bad())
+    {
+        qDebug() << "DIMSE_sendMessageUsingMemoryData" << QString::fromLocal8Bit(cond.text());
+    }
+    else if (printerInfoExpired)
+    {
+        // The client got the cached attributes already, now it is time to update them.
+        // The refresh goes in background and its result does not affect the session.
+        //
+        printerInfoExpired = false;
+        if (upstream)
         {
-            SOPInstanceUID = QString::fromUtf8(rq.msg.NSetRQ.RequestedSOPInstanceUID);
-            char uid[100] = {0};
+            startPrinterInfoRefresh();
+        }
+    }
 
-            if (forceUniqueStudy)
-            {
-                studyInstanceUID = QString::fromUtf8(dcmGenerateUniqueIdentifier(uid,  SITE_STUDY_UID_ROOT));
-            }
+    return cond;
+}
 
-            if (forceUniqueSeries)
-            {
-                seriesInstanceUID = QString::fromUtf8(dcmGenerateUniqueIdentifier(uid,  SITE_SERIES_UID_ROOT));
-            }
+bool PrintSCP::isPrinterInfoCached(T_DIMSE_Message &rq)
+{
+    if (printerInfoTtl <= 0 || DIMSE_N_GET_RQ != rq.CommandField
+        || 0 != strcmp(rq.msg.NGetRQ.RequestedSOPClassUID, UID_PrinterSOPClass))
+    {
+        return false;
+    }
 
-            storeImage(rqDataset);
+    auto& info = printerInfo(printer);
+    if (info.timestamp == 0)
+    {
+        // Never asked the real printer yet
+        //
+        return false;
+    }
+
+    for (int i = 0; i < rq.msg.NGetRQ.ListCount / 2; ++i)
+    {
+        DcmTagKey tag(rq.msg.NGetRQ.AttributeIdentifierList[i*2], rq.msg.NGetRQ.AttributeIdentifierList[i*2 + 1]);
+        if (tag.getElement() != 0x0000 && !info.attributes->tagExists(tag))
+        {
+            // Let the real printer decide what to do with this attribute
+            //
+            return false;
         }
-        else
+    }
+
+    printerInfoExpired = QDateTime::currentMSecsSinceEpoch() - info.timestamp > printerInfoTtl * 1000LL;
+    if (printerInfoExpired)
+    {
+        // Probably, another worker process has refreshed them already
+        //
+        printerInfoCache.remove(printer);
+        auto& reloaded = printerInfo(printer);
+        printerInfoExpired = QDateTime::currentMSecsSinceEpoch() - reloaded.timestamp > printerInfoTtl * 1000LL;
+    }
+
+    return true;
+}
+
+// Printers with the attributes being refreshed by this process
+//
+static QMutex refreshingPrintersLock;
+static QSet<QString> refreshingPrinters;
+
+// Asks the real printer for its attributes over an association of its own
+// and stores them to the settings file. The client threads pick them up
+// from there, see isPrinterInfoCached().
+//
+static void refreshPrinterInfo(const QString& printer, const QString& callingAETitle,
+    const QString& printerAETitle, const QString& printerAddress, int timeout)
+{
+    QUtf8Settings settings;
+    const char* abstractSyntaxes[] = { UID_BasicGrayscalePrintManagementMetaSOPClass };
+    T_ASC_Network* net = nullptr;
+    T_ASC_Association* assoc = nullptr;
+    DcmDataset *statusDetail = nullptr;
+    DcmDataset *rspDataset = nullptr;
+    T_DIMSE_Message rq;
+    T_DIMSE_Message rsp;
+    bzero((char*)&rq, sizeof(rq));
+    bzero((char*)&rsp, sizeof(rsp));
+
+    auto cond = ASC_initializeNetwork(NET_REQUESTOR, settings.value("print-port", 0).toInt(), timeout, &net);
+    if (cond.good())
+    {
+        cond = requestPrinterAssociation(net, callingAETitle, printerAETitle, printerAddress,
+            abstractSyntaxes, sizeof(abstractSyntaxes)/sizeof(abstractSyntaxes[0]), &assoc);
+    }
+
+    auto associated = cond.good();
+    if (associated)
+    {
+        rq.CommandField = DIMSE_N_GET_RQ;
+        rq.msg.NGetRQ.MessageID = assoc->nextMsgID++;
+        strcpy(rq.msg.NGetRQ.RequestedSOPClassUID, UID_PrinterSOPClass);
+        strcpy(rq.msg.NGetRQ.RequestedSOPInstanceUID, UID_PrinterSOPInstance);
+        rq.msg.NGetRQ.ListCount = 0;
+        rq.msg.NGetRQ.AttributeIdentifierList = nullptr;
+
+        auto presId = ASC_findAcceptedPresentationContextID(assoc, UID_BasicGrayscalePrintManagementMetaSOPClass);
+        cond = DIMSE_sendMessageUsingMemoryData(assoc, presId, &rq, nullptr, nullptr, nullptr, nullptr);
+        if (cond.good())
         {
-            if (DIMSE_N_CREATE_RQ == rq.CommandField)
-            {
-                if (0 == strcmp(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmSessionSOPClass))
-                {
-                    studyInstanceUID = QString::fromUtf8(rsp.msg.NCreateRSP.AffectedSOPInstanceUID);
-                }
-                else if (0 == strcmp(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmBoxSOPClass))
-                {
-                    seriesInstanceUID  = QString::fromUtf8(rsp.msg.NCreateRSP.AffectedSOPInstanceUID);
-                }
-            }
+            cond = DIMSE_receiveCommand(assoc, DIMSE_NONBLOCKING, timeout, &presId, &rsp, &statusDetail);
+        }
 
-            copyItems(rqDataset, sessionDataset);
-            copyItems(rspDataset, sessionDataset);
+        if (cond.good() && isDatasetPresent(rsp))
+        {
+            cond = DIMSE_receiveDataSetInMemory(assoc, DIMSE_NONBLOCKING, timeout, &presId, &rspDataset, nullptr, nullptr);
         }
+    }
 
-        delete rqDataset;
-        rqDataset = nullptr;
+    if (cond.good() && DIMSE_N_GET_RSP == rsp.CommandField && rsp.msg.NGetRSP.DimseStatus == STATUS_Success)
+    {
+        updatePrinterInfo(printer, rspDataset, false);
+        ASC_releaseAssociation(assoc);
+    }
+    else
+    {
+        qDebug() << "Failed to refresh printer information" << QString::fromLocal8Bit(cond.text());
+        if (associated)
+        {
+            ASC_abortAssociation(assoc);
+        }
+    }
 
-        dumpOut(rsp, rspDataset);
-        cond = DIMSE_sendMessageUsingMemoryData(assoc, presId, &rsp, statusDetail, rspDataset, nullptr, nullptr, &rawCommandSet);
-        dump("rawCommandSet", rawCommandSet);
-        delete rawCommandSet;
-        rawCommandSet = nullptr;
-        delete statusDetail;
-        statusDetail = nullptr;
-        delete rspDataset;
-        rspDataset = nullptr;
+    delete statusDetail;
+    delete rspDataset;
+    ASC_destroyAssociation(&assoc);
+    ASC_dropNetwork(&net);
 
-        if (cond.bad())
+    QMutexLocker locker(&refreshingPrintersLock);
+    refreshingPrinters.remove(printer);
+}
+
+void PrintSCP::startPrinterInfoRefresh()
+{
+    {
+        QMutexLocker locker(&refreshingPrintersLock);
+        if (refreshingPrinters.contains(printer))
         {
-            qDebug() << "DIMSE_sendMessageUsingMemoryData" << QString::fromLocal8Bit(cond.text());
-            break;
+            return;
         }
+        refreshingPrinters.insert(printer);
+    }
 
-    } /* while */
+    // Same peer as the upstream association of the session
+    //
+    auto& params = upstream->params->DULparams;
+    auto callingAETitle = QString::fromUtf8(params.callingAPTitle);
+    auto printerAETitle = QString::fromUtf8(params.calledAPTitle);
+    auto printerAddress = QString::fromUtf8(params.calledPresentationAddress);
+    auto printerName    = printer;
+    auto timeout        = upstreamTimeout > 0? upstreamTimeout: DEFAULT_TIMEOUT;
+
+    QtConcurrent::run(workers? workers: QThreadPool::globalInstance(),
+        [printerName, callingAETitle, printerAETitle, printerAddress, timeout]()
+    {
+        refreshPrinterInfo(printerName, callingAETitle, printerAETitle, printerAddress, timeout);
+    });
+}
 
+void PrintSCP::closeAssociation(OFCondition cond)
+{
     qDebug() << "Print session is done";
 
     // Close client association
@@ -751,6 +1124,14 @@ void PrintSCP::handleClient()
     {
         qDebug() << "Association Aborted" << (assoc->params? assoc->params->DULparams.callingPresentationAddress: "");
     }
+    else if (cond == DIMSE_NODATAAVAILABLE)
+    {
+        qWarning() << "Association idle for" << (QDateTime::currentMSecsSinceEpoch() - lastActivity) / 1000
+                   << "seconds, reaped" << (assoc->params? assoc->params->DULparams.callingPresentationAddress: "")
+                   << (assoc->params? assoc->params->DULparams.callingAPTitle: "");
+        countEvent("reaped-client-associations");
+        cond = ASC_abortAssociation(assoc);
+    }
     else
     {
       qDebug() << "DIMSE Failure (aborting association)" << (assoc->params? assoc->params->DULparams.callingPresentationAddress: "");
@@ -936,38 +1317,24 @@ void PrintSCP::printerNGet(T_DIMSE_Message& rq, T_DIMSE_Message& rsp, DcmDataset
     if (printerInstance == rq.msg.NGetRQ.RequestedSOPInstanceUID)
     {
         rsp.msg.NSetRSP.DataSetType = DIMSE_DATASET_PRESENT;
-        rspDataset = new DcmDataset;
+        auto& info = printerInfo(printer);
 
-        // By default, send only PrinterStatus & PrinterStatusInfo
+        // By default, send only PrinterStatus & PrinterStatusInfo,
+        // or everything we know about the real printer.
         //
-        if (rq.msg.NGetRQ.ListCount == 0)
+        if (rq.msg.NGetRQ.ListCount == 0 && info.timestamp != 0)
         {
+            rspDataset = new DcmDataset(*info.attributes);
+        }
+        else if (rq.msg.NGetRQ.ListCount == 0)
+        {
+            rspDataset = new DcmDataset;
             rspDataset->putAndInsertString(DCM_PrinterStatus, DEFAULT_printerStatus);
             rspDataset->putAndInsertString(DCM_PrinterStatusInfo, DEFAULT_printerStatusInfo);
         }
         else
         {
-            QUtf8Settings settings;
-            settings.beginGroup(printer);
-            QMap<DcmTag, QVariant> info;
-            auto size = settings.beginReadArray("info");
-            for (int idx = 0; idx < size; ++idx)
-            {
-                settings.setArrayIndex(idx);
-                auto key = settings.value("key").toString();
-                DcmTag tag;
-                if (DcmTag::findTagFromName(key.toUtf8(), tag).good())
-                {
-                    info[tag] = settings.value("value");
-                }
-                else
-                {
-                    qDebug() << "Bad DICOM tag" << key << "in" << printer << "info" << idx;
-                }
-            }
-            settings.endArray();
-            settings.endGroup();
-
+            rspDataset = new DcmDataset;
             for (int i = 0; i < rq.msg.NGetRQ.ListCount / 2; ++i)
             {
                 auto group   = rq.msg.NGetRQ.AttributeIdentifierList[i*2];
@@ -979,35 +1346,35 @@ void PrintSCP::printerNGet(T_DIMSE_Message& rq, T_DIMSE_Message& rsp, DcmDataset
                     continue;
                 }
 
-                if (group == DCM_PrinterStatus.getGroup())
+                DcmTagKey tag(group, element);
+                DcmElement* elm = nullptr;
+                if (info.attributes->findAndGetElement(tag, elm).good())
                 {
-                    if (element == DCM_PrinterStatus.getElement())
-                    {
-                        rspDataset->putAndInsertString(DCM_PrinterStatus, DEFAULT_printerStatus);
-                        continue;
-                    }
-                    if (element == DCM_PrinterStatusInfo.getElement())
-                    {
-                        rspDataset->putAndInsertString(DCM_PrinterStatusInfo, DEFAULT_printerStatusInfo);
-                        continue;
-                    }
+                    rspDataset->insert(dynamic_cast<DcmElement*>(elm->clone()), true);
+                    continue;
                 }
 
-                // Some unknown element was requested.
-                //
-                DcmTag tag(group, element);
-                if (!info.contains(tag))
+                if (tag == DCM_PrinterStatus)
                 {
-                    qDebug() << "cannot retrieve printer information: unknown attribute ("
-                        << QString::number(group, 16) << "," << QString::number(element, 16)
-                        << ") in attribute list.";
-                    rsp.msg.NGetRSP.DimseStatus = STATUS_N_NoSuchAttribute;
-                    delete rspDataset;
-                    rspDataset = nullptr;
-                    break;
+                    rspDataset->putAndInsertString(DCM_PrinterStatus, DEFAULT_printerStatus);
+                    continue;
+                }
+
+                if (tag == DCM_PrinterStatusInfo)
+                {
+                    rspDataset->putAndInsertString(DCM_PrinterStatusInfo, DEFAULT_printerStatusInfo);
+                    continue;
                 }
 
-                putAndInsertVariant(rspDataset, tag, info[tag]);
+                // Some unknown element was requested.
+                //
+                qDebug() << "cannot retrieve printer information: unknown attribute ("
+                    << QString::number(group, 16) << "," << QString::number(element, 16)
+                    << ") in attribute list.";
+                rsp.msg.NGetRSP.DimseStatus = STATUS_N_NoSuchAttribute;
+                delete rspDataset;
+                rspDataset = nullptr;
+                break;
             }
         }
     }
@@ -1091,6 +1458,12 @@ void PrintSCP::storeImage(DcmDataset *rqDataset)
         return;
     }
 
+    prepareImage(rqDataset);
+    processImage(rqDataset);
+}
+
+void PrintSCP::prepareImage(DcmDataset *rqDataset)
+{
     DcmItem *item = nullptr;
     auto cond = rqDataset->findAndGetSequenceItem(DCM_BasicGrayscaleImageSequence, item);
     if (cond.good())
@@ -1106,7 +1479,7 @@ void PrintSCP::storeImage(DcmDataset *rqDataset)
         delete item;
     }
 
-    copyItems(sessionDataset, rqDataset);
+    sessionAttributes.mergeInto(rqDataset);
 
     rqDataset->putAndInsertString(DCM_SpecificCharacterSet, "ISO_IR 192"); // UTF-8
 
@@ -1114,19 +1487,46 @@ void PrintSCP::storeImage(DcmDataset *rqDataset)
     rqDataset->putAndInsertString(DCM_SeriesInstanceUID, seriesInstanceUID.toUtf8());
     rqDataset->putAndInsertString(DCM_SOPInstanceUID,    SOPInstanceUID.toUtf8());
 
+    static const Attr<EVR_DA> instanceCreationDate(DCM_InstanceCreationDate);
+    static const Attr<EVR_TM> instanceCreationTime(DCM_InstanceCreationTime);
+    static const Attr<EVR_DA> studyDate(DCM_StudyDate);
+    static const Attr<EVR_TM> studyTime(DCM_StudyTime);
+
     auto now = QDateTime::currentDateTime();
-    putAndInsertVariant(rqDataset, DCM_InstanceCreationDate, now);
-    putAndInsertVariant(rqDataset, DCM_InstanceCreationTime, now);
-    putAndInsertVariant(rqDataset, DCM_StudyDate, now);
-    putAndInsertVariant(rqDataset, DCM_StudyTime, now);
+    auto today = now.date();
+    auto time = now.time();
+    instanceCreationDate.put(rqDataset, today);
+    instanceCreationTime.put(rqDataset, time);
+    studyDate.put(rqDataset, today);
+    studyTime.put(rqDataset, time);
 
     rqDataset->putAndInsertString(DCM_Manufacturer, ORGANIZATION_FULL_NAME);
     rqDataset->putAndInsertString(DCM_ManufacturerModelName, PRODUCT_FULL_NAME);
+}
 
+void PrintSCP::processImage(DcmDataset *rqDataset)
+{
     QUtf8Settings settings;
     auto spoolPath = settings.value("spool-path").toString();
 
-    if (!webQuery(rqDataset))
+    auto query = startWebQuery(rqDataset);
+
+    // While the web service is busy with the query, get the storage associations ready
+    //
+    if (query)
+    {
+        foreach (auto server, settings.value("storage-servers").toStringList())
+        {
+            auto sscp = storageServers.value(server);
+            if (!sscp)
+            {
+                sscp = storageServers[server] = new StoreSCP(server);
+            }
+            sscp->openAssociation(rqDataset);
+        }
+    }
+
+    if (!finishWebQuery(rqDataset, query))
     {
         if (!spoolPath.isEmpty())
         {
@@ -1141,10 +1541,20 @@ void PrintSCP::storeImage(DcmDataset *rqDataset)
             saveToDisk(".", rqDataset);
         }
 
+        // The web service response may replace the UID, so it is read only now
+        //
+        const char* uId = nullptr;
+        rqDataset->findAndGetString(DCM_SOPInstanceUID, uId);
+
         foreach (auto server, settings.value("storage-servers").toStringList())
         {
-            StoreSCP sscp(server);
-            cond = sscp.sendToServer(rqDataset, SOPInstanceUID.toUtf8());
+            auto sscp = storageServers.value(server);
+            if (!sscp)
+            {
+                sscp = storageServers[server] = new StoreSCP(server);
+            }
+
+            auto cond = sscp->sendToServer(rqDataset, uId);
             if (cond.bad())
             {
                 qDebug() << "Failed to store to" << server << QString::fromLocal8Bit(cond.text());
@@ -1174,350 +1584,896 @@ static QByteArray writeXmlRequest(const QString& root, const QVariantMap& map)
     return data;
 }
 
-static QVariantMap readXmlResponse(const QByteArray& data)
+// Stores a value of the web service response to the dataset.
+// All values must be serialized to strings in the DICOM way,
+// i.e. '20141225' for date values, '175959' for time values,
+// but ISO 8601 is accepted as well.
+//
+static void putResponseValue(DcmDataset* dataset, const TextAttr& attr, const QString& str)
 {
-    QXmlStreamReader xml(data);
-    QVariantMap map;
+    if (!attr.isValid())
+    {
+        return;
+    }
+
+    // We shouldn't call translateToLatin for integers & dates.
+    //
+    auto cond = attr.put(dataset, attr.isString()? translateToLatin(str): str);
+    if (cond.bad())
+    {
+        qDebug() << "Failed to set" << attr.tag().getTagName() << "value" << QString::fromLocal8Bit(cond.text());
+    }
+}
+
+// Same, for the name as received from the web service.
+// Each name is looked up in the dictionary once per session.
+//
+static void putResponseValue(DcmDataset* dataset, QHash<QString, TextAttr>& attrs, const QString& name, const QString& str)
+{
+    auto it = attrs.find(name);
+    if (it == attrs.end())
+    {
+        it = attrs.insert(name, TextAttr::byName(name));
+    }
+    putResponseValue(dataset, it.value(), str);
+}
 
+// Reads <element tag="...">value</element> and <name>value</name> children
+// of the current element. Values go straight to the dataset, if any,
+// the <message> is kept for the error handling.
+//
+static void readXmlElements(QXmlStreamReader& xml, DcmDataset* dataset, QHash<QString, TextAttr>& attrs, QString& message)
+{
     while (xml.readNextStartElement())
     {
         if (xml.name() == "element")
         {
             auto key = xml.attributes().value("tag").toString();
-            map[key] = xml.readElementText();
+            auto text = xml.readElementText();
+            if (dataset)
+            {
+                putResponseValue(dataset, attrs, key, text);
+            }
         }
         else if (xml.name() != "data-set" && xml.name() != "business-logic-error")
         {
+            auto name = xml.name().toString();
             auto text = xml.readElementText(QXmlStreamReader::SkipChildElements);
             if (text.isEmpty())
             {
-                qDebug() << "Unexpected element" << xml.name();
+                qDebug() << "Unexpected element" << name;
             }
-            else
+            else if (name == "message")
+            {
+                message = text;
+            }
+            else if (dataset)
             {
-                map[xml.name().toString()] = text;
+                putResponseValue(dataset, attrs, name, text);
             }
         }
     }
+}
 
-    return map;
+static void readXmlResponse(const QByteArray& data, DcmDataset* dataset, QHash<QString, TextAttr>& attrs, QString& message)
+{
+    QXmlStreamReader xml(data);
+    readXmlElements(xml, dataset, attrs, message);
 }
 
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
-static QVariantMap readJsonResponse(const QByteArray& data)
+// The envelope holds a <data-set> for each item succeeded
+// and a <business-logic-error> for each item failed, in the request order.
+//
+static QList<PrintSCP::BatchAnswer> readXmlBatchResponse(const QByteArray& data, const QList<DcmDataset*>& datasets,
+                                                         QHash<QString, TextAttr>& attrs)
 {
-    QVariantMap map;
-    auto elements = QJsonDocument::fromJson(data).array();
-    qDebug() << "Server response is about" << elements.size() << "elements";
+    QList<PrintSCP::BatchAnswer> answers;
+    QXmlStreamReader xml(data);
 
-    Q_FOREACH (auto elm, elements)
+    if (xml.readNextStartElement())
     {
-        auto obj = elm.toObject();
-        map[obj.value("tag").toString()] = obj.value("value");
+        while (xml.readNextStartElement())
+        {
+            PrintSCP::BatchAnswer answer;
+            answer.error = xml.name() == "business-logic-error";
+            auto dataset = answer.error? nullptr: datasets.value(answers.size());
+
+            // The data-set itself is the item, so the elements are its children
+            //
+            readXmlElements(xml, dataset, attrs, answer.message);
+            answers.append(answer);
+        }
     }
 
-    return map;
+    return answers;
+}
+
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+static void readJsonElements(const QJsonArray& elements, DcmDataset* dataset, QHash<QString, TextAttr>& attrs)
+{
+    Q_FOREACH (auto elm, elements)
+    {
+        auto obj = elm.toObject();
+        auto value = obj.value("value");
+        putResponseValue(dataset, attrs, obj.value("tag").toString(),
+            value.isString()? value.toString(): value.toVariant().toString());
+    }
+}
+
+static void readJsonResponse(const QByteArray& data, DcmDataset* dataset, QHash<QString, TextAttr>& attrs, QString& message)
+{
+    auto doc = QJsonDocument::fromJson(data);
+    if (doc.isObject())
+    {
+        message = doc.object().value("message").toString();
+        return;
+    }
+
+    auto elements = doc.array();
+    qDebug() << "Server response is about" << elements.size() << "elements";
+    if (dataset)
+    {
+        readJsonElements(elements, dataset, attrs);
+    }
+}
+
+// The response is an array with an item for each request item, in the same order,
+// or an object with such array under the batch-root key.
+// An item succeeded is an array of elements, an item failed is an object with the error.
+//
+static QList<PrintSCP::BatchAnswer> readJsonBatchResponse(const QByteArray& data, const QString& root,
+                                                          const QList<DcmDataset*>& datasets,
+                                                          QHash<QString, TextAttr>& attrs)
+{
+    QList<PrintSCP::BatchAnswer> answers;
+    auto doc = QJsonDocument::fromJson(data);
+    auto items = doc.isArray()? doc.array(): doc.object().value(root).toArray();
+
+    Q_FOREACH (auto item, items)
+    {
+        PrintSCP::BatchAnswer answer;
+        answer.error = !item.isArray();
+        if (answer.error)
+        {
+            // The whole error object, same as for a single query
+            //
+            answer.message = QString::fromUtf8(QJsonDocument(item.toObject()).toJson(QJsonDocument::Compact));
+        }
+        else if (answers.size() < datasets.size())
+        {
+            readJsonElements(item.toArray(), datasets[answers.size()], attrs);
+        }
+        answers.append(answer);
+    }
+
+    return answers;
 }
 #endif
 
-bool PrintSCP::webQuery(DcmDataset *rqDataset)
+// Parses the response of any supported content type.
+//
+static bool readResponse(const QString& contentType, const QByteArray& data, DcmDataset* dataset,
+                         QHash<QString, TextAttr>& attrs, QString& message)
 {
-    QUtf8Settings settings;
-    QVariantMap queryParams;
-    QVariantMap ret;
+    if (contentType.contains("/xml"))
+    {
+        readXmlResponse(data, dataset, attrs, message);
+        return true;
+    }
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+    if (contentType.contains("/json"))
+    {
+        readJsonResponse(data, dataset, attrs, message);
+        return true;
+    }
+#endif
+    return false;
+}
 
-    settings.beginGroup("query");
-    auto url          = settings.value("url").toUrl();
-    auto userName     = settings.value("username").toString();
-    auto password     = settings.value("password").toString();
-    auto contendType  = settings.value("content-type", DEFAULT_CONTENT_TYPE).toString();
+static QList<QUrl> readUrls(const QStringList& list)
+{
+    QList<QUrl> urls;
+    Q_FOREACH (auto str, list)
+    {
+        if (!str.trimmed().isEmpty())
+        {
+            urls.append(QUrl(str.trimmed()));
+        }
+    }
+    return urls;
+}
 
+const PrintSCP::QueryConfig& PrintSCP::readQueryConfig()
+{
+    if (queryConfig)
+    {
+        return *queryConfig;
+    }
+
+    QUtf8Settings settings;
     QStringList extraParams;
-    if (contendType.contains("/xml", Qt::CaseInsensitive))
+    queryConfig.reset(new QueryConfig);
+    auto& cfg = *queryConfig;
+
+    settings.beginGroup("query");
+    auto urls        = settings.value("url").toStringList();
+    cfg.retryInterval   = settings.value("retry-interval", DEFAULT_QUERY_RETRY_INTERVAL).toInt();
+    cfg.hedgePercentile = settings.value("hedge-percentile", DEFAULT_QUERY_HEDGE_PERCENTILE).toInt();
+    cfg.userName     = settings.value("username").toString();
+    cfg.password     = settings.value("password").toString();
+    cfg.contentType  = settings.value("content-type", DEFAULT_CONTENT_TYPE).toString();
+    cfg.http2        = settings.value("http2", true).toBool();
+    cfg.timeout      = settings.value("timeout-ms", timeout * 1000).toInt();
+    cfg.batchSize    = settings.value("batch-size", 1).toInt();
+    cfg.batchUrl     = settings.value("batch-url").toUrl();
+    cfg.batchRoot    = settings.value("batch-root").toString();
+
+    if (cfg.contentType.contains("/xml", Qt::CaseInsensitive))
     {
         extraParams.append("study-instance-uid:StudyInstanceUID");
         extraParams.append("medical-service-date:InstanceCreationDate");
     }
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
-    else if (contendType.contains("/json", Qt::CaseInsensitive))
+    else if (cfg.contentType.contains("/json", Qt::CaseInsensitive))
     {
         extraParams.append("studyInstanceUID:StudyInstanceUID");
         extraParams.append("medicalServiceDate:InstanceCreationDate");
     }
 #endif
 
-    extraParams = settings.value("query-parameters", extraParams).toStringList();
-    auto ignoreErrors = settings.value("ignore-errors").toStringList();
+    extraParams      = settings.value("query-parameters", extraParams).toStringList();
+    cfg.ignoreErrors = settings.value("ignore-errors").toStringList();
     settings.endGroup();
 
     settings.beginGroup(printer);
     settings.beginGroup("query");
-    url          = settings.value("url",              url).toUrl();
-    userName     = settings.value("username",         userName).toString();
-    password     = settings.value("password",         password).toString();
-    contendType  = settings.value("content-type",     contendType).toString();
-    extraParams  = settings.value("query-parameters", extraParams).toStringList();
-    ignoreErrors = settings.value("ignore-errors",    ignoreErrors).toStringList();
+    urls             = settings.value("url",              urls).toStringList();
+    cfg.retryInterval   = settings.value("retry-interval",   cfg.retryInterval).toInt();
+    cfg.hedgePercentile = settings.value("hedge-percentile", cfg.hedgePercentile).toInt();
+    cfg.userName     = settings.value("username",         cfg.userName).toString();
+    cfg.password     = settings.value("password",         cfg.password).toString();
+    cfg.contentType  = settings.value("content-type",     cfg.contentType).toString();
+    cfg.http2        = settings.value("http2",            cfg.http2).toBool();
+    cfg.timeout      = settings.value("timeout-ms",       cfg.timeout).toInt();
+    cfg.batchSize    = settings.value("batch-size",       cfg.batchSize).toInt();
+    cfg.batchUrl     = settings.value("batch-url",        cfg.batchUrl).toUrl();
+    cfg.batchRoot    = settings.value("batch-root",       cfg.batchRoot).toString();
+    extraParams      = settings.value("query-parameters", extraParams).toStringList();
+    cfg.ignoreErrors = settings.value("ignore-errors",    cfg.ignoreErrors).toStringList();
     settings.endGroup();
     settings.endGroup();
 
-    if (url.isEmpty())
+    cfg.urls = readUrls(urls);
+
+    // The attribute of each parameter is resolved here, not for each image
+    //
+    Q_FOREACH (auto extraParam, extraParams)
     {
-        return true;
+        auto parts = extraParam.split(QRegExp("=|:"));
+        cfg.extraParams.append(qMakePair(parts[0], parts.size() > 1? TextAttr::byName(parts[1]): TextAttr()));
     }
 
+    return cfg;
+}
+
+QVariantMap PrintSCP::queryParameters(DcmDataset *rqDataset, const QueryConfig& cfg)
+{
+    QVariantMap queryParams;
     DicomImage di(rqDataset, rqDataset->getOriginalXfer());
-    void *img = nullptr;
 
-    if (di.createJavaAWTBitmap(img, 0, 32) && img)
+    if (di.getStatus() == EIS_Normal)
     {
-#ifdef WITH_TESSERACT
-        tess.SetImage((const unsigned char*)img, di.getWidth(), di.getHeight(), 4, 4 * di.getWidth());
-#endif
-        // Global tags
+        // Render just the regions we are going to recognize,
+        // not the whole multi-megapixel film.
         //
-        insertTags(rqDataset, queryParams, &di, settings);
+        auto plan = TagRulePlan::forPrinter(printer);
+        OcrImage img(&di);
+        QList<QRect> regions;
+        Q_FOREACH (auto region, plan->regions())
+        {
+            regions.append(img.resolve(region.rect));
+        }
+        img.setRegions(regions);
 
-        // This printer tags
-        //
-        settings.beginGroup(printer);
-        insertTags(rqDataset, queryParams, &di, settings);
-        settings.endGroup();
-        delete[] (Uint32*)img;
+        insertTags(rqDataset, queryParams, img, *plan);
     }
 
-    Q_FOREACH (auto extraParam, extraParams)
+    Q_FOREACH (auto extraParam, cfg.extraParams)
     {
-        auto parts = extraParam.split(QRegExp("=|:"));
+        const auto& attr = extraParam.second;
         QVariant value;
 
-        if (parts.size() > 1)
+        if (attr.isValid() && attr.get(rqDataset, value).bad())
         {
-            DcmTag tag;
-            if (DcmTag::findTagFromName(parts[1].toUtf8(), tag).bad())
-            {
-                qDebug() << "Unknown DCM tag" << parts[1];
-            }
-            else if (findAndGetVariant(rqDataset, tag, value).bad())
-            {
-                qDebug() << "Failed te retrieve DCM tag" << tag.getTagName() << "from the dataset";
-            }
+            qDebug() << "Failed te retrieve DCM tag" << attr.tag().getTagName() << "from the dataset";
         }
-        queryParams[parts[0]] = value;
+        queryParams[extraParam.first] = value;
     }
 
-    bool error = false;
-    QNetworkAccessManager mgr;
-
-    QByteArray data;
-    if (contendType.contains("/xml", Qt::CaseInsensitive))
-    {
-        data = writeXmlRequest("save-hardcopy-grayscale-image-request", queryParams);
-    }
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
-    else if (contendType.contains("/json", Qt::CaseInsensitive))
-    {
-        data = QJsonDocument(QJsonObject::fromVariantMap(queryParams))
-            .toJson(
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 1, 0))
-               QJsonDocument::Compact
-#endif
-            );
-    }
-#endif
-    else
-    {
-        qDebug() << contendType << "not supported";
-    }
+    return queryParams;
+}
 
+QNetworkRequest PrintSCP::queryRequest(const QueryConfig& cfg, const QUrl& url, const QByteArray& data)
+{
     QNetworkRequest rq(url);
     rq.setRawHeader("Accept", "*");
-    if (!userName.isEmpty())
+    if (!cfg.userName.isEmpty())
     {
-        rq.setRawHeader("Authorization", "Basic " + QByteArray(userName.append(':').append(password).toUtf8()).toBase64());
+        rq.setRawHeader("Authorization", "Basic " + QString(cfg.userName).append(':').append(cfg.password).toUtf8().toBase64());
     }
 
     // Enforce the UTF-8 charset if no charsets are specified.
     // Note that all requests in the JSON format must use UTF-8 charset.
     //
-    if (!contendType.contains("charset=", Qt::CaseInsensitive))
+    auto contentType = cfg.contentType;
+    if (!contentType.contains("charset=", Qt::CaseInsensitive))
     {
-        contendType.append("; charset=").append(DEFAULT_CHARSET);
+        contentType.append("; charset=").append(DEFAULT_CHARSET);
     }
 
-    rq.setHeader(QNetworkRequest::ContentTypeHeader, contendType);
+    rq.setHeader(QNetworkRequest::ContentTypeHeader, contentType);
     rq.setHeader(QNetworkRequest::ContentLengthHeader, data.size());
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 8, 0))
+    rq.setAttribute(QNetworkRequest::Http2AllowedAttribute, cfg.http2);
+#endif
     qDebug() << url << data;
-    auto reply = mgr.post(rq, data);
-    auto start = QDateTime::currentMSecsSinceEpoch();
+    return rq;
+}
 
-    while (reply->isRunning() && (timeout <= 0 || timeout > (QDateTime::currentMSecsSinceEpoch() - start) / 1000))
+bool PrintSCP::lookupLocally(DcmDataset *rqDataset, const QVariantMap& queryParams)
+{
+    DemographicsIndex::Record record;
+    if (!DemographicsIndex::instance().find(queryParams, record))
     {
-        qApp->processEvents(QEventLoop::AllEvents, 100);
+        return false;
     }
 
-    if (reply->isRunning())
+    qDebug() << "Study found in the demographics index";
+    Q_FOREACH (auto field, record)
     {
-        qDebug() << "Web query request timeout, aborting";
-        reply->abort();
-        qApp->processEvents(QEventLoop::AllEvents, 100);
-        ++error;
+        putResponseValue(rqDataset, field.first, field.second);
     }
 
-    auto responseContentType = reply->header(QNetworkRequest::ContentTypeHeader).toString();
-    auto response = reply->readAll();
+    // Same as for the web service response
+    //
+    rqDataset->putAndInsertString(DCM_PatientID,   "0", false);
+    rqDataset->putAndInsertString(DCM_PatientName, "^", false);
+    return true;
+}
+
+bool PrintSCP::webQuery(DcmDataset *rqDataset)
+{
+    return finishWebQuery(rqDataset, startWebQuery(rqDataset));
+}
 
-    if (settings.value("debug").toBool())
+PrintSCP::PendingQuery* PrintSCP::startWebQuery(DcmDataset *rqDataset)
+{
+    const auto& cfg = readQueryConfig();
+    if (cfg.urls.isEmpty() && DemographicsIndex::instance().isEmpty())
     {
-        qDebug() << reply->error() << reply->errorString()
-                 << responseContentType << QString::fromUtf8(response);
+        return nullptr;
     }
 
-    if (reply->error())
+    // The scheduled studies are known locally, the service is asked only on a miss
+    //
+    auto queryParams = queryParameters(rqDataset, cfg);
+    if (lookupLocally(rqDataset, queryParams) || cfg.urls.isEmpty())
     {
-        ++error;
+        return nullptr;
     }
 
-    if (responseContentType.contains("/xml"))
+    QByteArray data;
+    if (cfg.contentType.contains("/xml", Qt::CaseInsensitive))
     {
-        ret = readXmlResponse(response);
+        data = writeXmlRequest("save-hardcopy-grayscale-image-request", queryParams);
     }
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
-    else if (responseContentType.contains("/json"))
+    else if (cfg.contentType.contains("/json", Qt::CaseInsensitive))
     {
-        ret = readJsonResponse(response);
+        data = QJsonDocument(QJsonObject::fromVariantMap(queryParams))
+            .toJson(
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 1, 0))
+               QJsonDocument::Compact
+#endif
+            );
     }
 #endif
     else
     {
-        qDebug() << "response content type" << responseContentType << "not supported";
-        error = true;
+        qDebug() << cfg.contentType << "not supported";
     }
 
-    // Check for errors we can safelly ignore
+    auto query = new PendingQuery;
+    query->ignoreErrors = cfg.ignoreErrors;
+    query->timeout = cfg.timeout;
+    query->hedgeDelay = 0;
+
+    // Other boxes of the film ask the same. The endpoints are equivalent,
+    // so the answer of any of them will do.
     //
-    if (error)
+    QStringList urls;
+    Q_FOREACH (auto url, cfg.urls)
     {
-        auto msg = ret.contains("message")? ret["message"].toString(): QString::fromUtf8(response);
+        urls.append(url.toString());
+    }
+    query->cacheKey = WebCache::key(urls.join(' '), cfg.contentType, data);
+    WebCache::Response cached;
+    if (WebCache::instance().find(query->cacheKey, cached))
+    {
+        qDebug() << "Web query response found in the cache";
+        query->cachedContentType = cached.contentType;
+        query->cachedResponse = cached.body;
+        return query;
+    }
 
-        Q_FOREACH (auto ignore, ignoreErrors)
-        {
-            if (msg.contains(ignore))
-            {
-                error = false;
-                qDebug() << ignore << "found in the response. The error was suppressed";
-                break;
-            }
-        }
+    query->endpoints.reset(new QueryEndpoints(printer, cfg.urls, cfg.retryInterval, cfg.hedgePercentile));
+    query->candidates = query->endpoints->candidates();
+    query->hedgeDelay = query->endpoints->hedgeDelay();
+    query->request = queryRequest(cfg, cfg.urls.first(), data);
+    query->data = data;
+    query->timer.start();
+    sendWebQuery(query);
+    return query;
+}
+
+bool PrintSCP::sendWebQuery(PendingQuery* query)
+{
+    if (query->candidates.isEmpty())
+    {
+        return false;
     }
 
-    // Add some required fields, in case if they are empty.
-    // Normally, we expect them to be overriden with the data received from the app server.
-    // Also, reset the patient name & id in case of an error.
+    auto idx = query->candidates.takeFirst();
+    auto rq = query->request;
+    rq.setUrl(query->endpoints->url(idx));
+
+    // The client is shared with other images of the worker, so the connection is reused
     //
-    rqDataset->putAndInsertString(DCM_PatientID,   "0", error);
-    rqDataset->putAndInsertString(DCM_PatientName, "^", error);
+    auto reply = WebClient::instance().post(rq, query->data);
+    if (!reply)
+    {
+        // No free connection, and this thread must not wait for one
+        //
+        query->candidates.prepend(idx);
+        return false;
+    }
 
-    if (!error)
+    query->replies.append(reply);
+    query->asked.append(idx);
+    query->sentAt.append(query->timer.elapsed());
+    return true;
+}
+
+// The endpoint itself is in trouble, not the query: no HTTP response at all,
+// or a gateway in front of the service could not reach it.
+//
+static bool isEndpointFailure(QNetworkReply* reply)
+{
+    auto status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+    return !status.isValid() || status.toInt() == 502 || status.toInt() == 503 || status.toInt() == 504;
+}
+
+bool PrintSCP::finishWebQuery(DcmDataset *rqDataset, PendingQuery* query)
+{
+    if (!query)
     {
-        // Store web service response to the dataset.
-        // All values must be serialized to strings in the DICOM way,
-        // i.e. '20141225' for date values, '175959' for time values.
+        // Nothing to ask
         //
-        for (auto i = ret.constBegin(); i != ret.constEnd(); ++i)
+        return true;
+    }
+
+    QUtf8Settings settings;
+    bool error = false;
+    QNetworkReply* reply = nullptr; // The one that answered
+    auto responseContentType = query->cachedContentType;
+    auto response = query->cachedResponse;
+
+    if (!query->replies.isEmpty())
+    {
+        // Wait for the first good answer. The next endpoint is asked right away
+        // if the endpoint fails, or after the hedge delay if it is just slow.
+        // The deadline counts from the moment the first request was sent.
+        //
+        auto pending = query->replies;
+        auto hedged = false;
+        forever
         {
-            DcmTag tag;
-            if (DcmTag::findTagFromName(i.key().toUtf8(), tag).bad())
+            auto elapsed = (int)query->timer.elapsed();
+            if (query->timeout > 0 && elapsed >= query->timeout)
             {
-                qDebug() << "Unknown DCM tag" << i.key();
-                continue;
+                break;
             }
 
-            QVariant value;
-            auto str = i.value().toString();
+            auto wait = query->timeout > 0? query->timeout - elapsed: 0;
+            auto canHedge = !hedged && query->hedgeDelay > 0 && !query->candidates.isEmpty();
+            if (canHedge)
+            {
+                auto hedgeLeft = qMax(1, query->hedgeDelay - elapsed);
+                wait = wait > 0? qMin(wait, hedgeLeft): hedgeLeft;
+            }
 
-            // We shouldn't call translateToLatin for integers & dates.
-            //
-            if (tag.getEVR() == EVR_DA && str.length() == 8)
+            if (!WebClient::waitForAny(pending, wait))
             {
-                value.setValue(QDate::fromString(str, "yyyyMMdd"));
+                if (canHedge && query->timer.elapsed() >= query->hedgeDelay)
+                {
+                    // The hedge is a single try, it never waits for a free connection
+                    //
+                    hedged = true;
+                    if (sendWebQuery(query))
+                    {
+                        qDebug() << "Web query is slower than" << query->hedgeDelay << "ms, hedged request sent";
+                        countEvent("query-hedges");
+                        pending.append(query->replies.last());
+                    }
+                    else
+                    {
+                        qDebug() << "Web query is slower than" << query->hedgeDelay << "ms, no free connection to hedge";
+                        countEvent("query-hedges-skipped");
+                    }
+                }
+                continue;
             }
-            else if (tag.getEVR() == EVR_TM && str.length() == 6)
+
+            Q_FOREACH (auto finished, pending)
             {
-                value.setValue(QTime::fromString(str, "HHmmss"));
+                if (!finished->isFinished())
+                {
+                    continue;
+                }
+                pending.removeOne(finished);
+
+                auto pos = query->replies.indexOf(finished);
+                auto idx = query->asked[pos];
+                if (isEndpointFailure(finished))
+                {
+                    qDebug() << "Web service" << query->endpoints->url(idx) << finished->errorString();
+                    query->endpoints->markFailed(idx);
+                    if (sendWebQuery(query))
+                    {
+                        countEvent("query-failovers");
+                        pending.append(query->replies.last());
+                    }
+                    else if (!reply)
+                    {
+                        reply = finished; // Nothing better, keep it for the error message
+                    }
+                    continue;
+                }
+
+                query->endpoints->markAnswered(idx, (int)(query->timer.elapsed() - query->sentAt[pos]));
+                reply = finished;
+                pending.clear();
+                break;
             }
-            else if (tag.getEVR() == EVR_DT && str.length() == 14)
+
+            if (pending.isEmpty())
             {
-                value.setValue(QDateTime::fromString(str, "yyyyMMddHHmmss"));
+                break;
             }
-            else if (tag.getVR().isaString())
+        }
+
+        if (!reply || isEndpointFailure(reply))
+        {
+            // The endpoints still being asked are too slow
+            //
+            Q_FOREACH (auto slow, pending)
             {
-                value.setValue(translateToLatin(str));
+                qDebug() << "Web query request timeout, aborting";
+                query->endpoints->markFailed(query->asked[query->replies.indexOf(slow)]);
             }
-            else
+            error = true;
+        }
+
+        if (reply)
+        {
+            responseContentType = reply->header(QNetworkRequest::ContentTypeHeader).toString();
+            response = reply->readAll();
+
+            if (settings.value("debug").toBool())
             {
-                value = i.value();
+                qDebug() << reply->error() << reply->errorString()
+                         << responseContentType << QString::fromUtf8(response);
             }
 
-            auto cond = putAndInsertVariant(rqDataset, tag, value);
-            if (cond.bad())
+            if (reply->error())
             {
-                qDebug() << "Failed to set" << tag.getTagName() << "value" << QString::fromLocal8Bit(cond.text());
+                error = true;
             }
         }
     }
 
-    reply->deleteLater();
+    if (!responseContentType.contains("/xml") && !responseContentType.contains("/json"))
+    {
+        qDebug() << "response content type" << responseContentType << "not supported";
+        error = true;
+    }
+
+    // Remember only real successes, not the suppressed errors
+    //
+    if (!error && reply)
+    {
+        WebCache::Response cached;
+        cached.contentType = responseContentType;
+        cached.body = response;
+        WebCache::instance().insert(query->cacheKey, cached);
+    }
+
+    error = !applyWebResponse(rqDataset, responseContentType, response, error, query->ignoreErrors);
+
+    // The manager outlives the query, and worker threads may have no event loop
+    // to process deleteLater(), so the finished replies are deleted right away.
+    // The losers are aborted first.
+    //
+    Q_FOREACH (auto sent, query->replies)
+    {
+        if (!sent->isFinished())
+        {
+            sent->abort();
+        }
+        delete sent;
+    }
+    delete query;
     return !error;
 }
 
-void PrintSCP::insertTags(DcmDataset *rqDataset, QVariantMap &queryParams, DicomImage *di, QSettings& settings)
+int PrintSCP::webQueryBatchSize()
 {
-    auto tagCount = settings.beginReadArray("tag");
-    QRect prevRect;
-    QString ocrText;
+    return qMax(1, readQueryConfig().batchSize);
+}
 
-    for (int i = 0; i < tagCount; ++i)
+QList<bool> PrintSCP::webQueryBatch(const QList<DcmDataset*>& rqDatasets)
+{
+    QList<bool> results;
+    const auto& cfg = readQueryConfig();
+
+    if (cfg.urls.isEmpty() || cfg.batchSize < 2 || rqDatasets.size() < 2)
     {
-        settings.setArrayIndex(i);
-        auto key = settings.value("key").toString();
+        Q_FOREACH (auto rqDataset, rqDatasets)
+        {
+            results.append(webQuery(rqDataset));
+        }
+        return results;
+    }
+
+    // Studies found in the demographics index are not sent to the service
+    //
+    QList<QVariantMap> items;
+    QList<DcmDataset*> remoteDatasets;
+    Q_FOREACH (auto rqDataset, rqDatasets)
+    {
+        auto queryParams = queryParameters(rqDataset, cfg);
+        if (!lookupLocally(rqDataset, queryParams))
+        {
+            items.append(queryParams);
+            remoteDatasets.append(rqDataset);
+        }
+    }
+
+    if (remoteDatasets.isEmpty())
+    {
+        for (int i = 0; i < rqDatasets.size(); ++i)
+        {
+            results.append(true);
+        }
+        return results;
+    }
 
-        auto rect = settings.value("rect").toRect();
-        if (!rect.isEmpty())
+    QByteArray data;
+    auto xmlBatch = cfg.contentType.contains("/xml", Qt::CaseInsensitive);
+    if (xmlBatch)
+    {
+        QXmlStreamWriter xml(&data);
+        xml.writeStartDocument();
+        xml.writeStartElement(cfg.batchRoot.isEmpty()? DEFAULT_XML_BATCH_ROOT: cfg.batchRoot);
+        Q_FOREACH (auto item, items)
         {
-            if (rect.left() < 0) rect.moveLeft(di->getWidth() + rect.left());
-            if (rect.top() < 0) rect.moveTop(di->getHeight() + rect.top());
-            if (prevRect != rect)
+            xml.writeStartElement("save-hardcopy-grayscale-image-request");
+            for (auto i = item.constBegin(); i != item.constEnd(); ++i)
             {
-                prevRect = rect;
-#ifdef WITH_TESSERACT
-                tess.SetRectangle(rect.left(), rect.top(), rect.width(), rect.height());
-                ocrText = QString::fromUtf8(tess.GetUTF8Text())
-                    .remove(reBadSymbols).trimmed(); // remove non printable symbols and trailing whitespace.
+                xml.writeTextElement(i.key(), i.value().toString());
+            }
+            xml.writeEndElement();
+        }
+        xml.writeEndElement();
+        xml.writeEndDocument();
+    }
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+    else
+    {
+        QJsonArray array;
+        Q_FOREACH (auto item, items)
+        {
+            array.append(QJsonObject::fromVariantMap(item));
+        }
+
+        QJsonObject envelope;
+        envelope[cfg.batchRoot] = array;
+        data = (cfg.batchRoot.isEmpty()? QJsonDocument(array): QJsonDocument(envelope)).toJson(QJsonDocument::Compact);
+    }
+#endif
+
+    // Without the dedicated batch-url, any healthy endpoint will do.
+    // The spool is not in a hurry, so no hedged requests here.
+    //
+    QueryEndpoints endpoints(printer, cfg.urls, cfg.retryInterval, cfg.hedgePercentile);
+    auto idx = cfg.batchUrl.isEmpty()? endpoints.candidates().first(): -1;
+    auto url = idx < 0? cfg.batchUrl: endpoints.url(idx);
+
+    QElapsedTimer timer;
+    timer.start();
+    auto reply = WebClient::instance().post(queryRequest(cfg, url, data), data);
+    bool error = false;
+    if (!WebClient::waitFor(reply, cfg.timeout))
+    {
+        qDebug() << "Web query batch request timeout, aborting";
+        reply->abort();
+        error = true;
+    }
+
+    if (idx >= 0)
+    {
+        if (error || isEndpointFailure(reply))
+        {
+            endpoints.markFailed(idx);
+        }
+        else
+        {
+            endpoints.markAnswered(idx, (int)timer.elapsed());
+        }
+    }
+
+    auto response = reply->readAll();
+    if (reply->error())
+    {
+        qDebug() << "Web query batch failed" << reply->error() << reply->errorString() << QString::fromUtf8(response);
+        error = true;
+    }
+    delete reply;
+
+    QList<BatchAnswer> answers;
+    if (!error)
+    {
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
+        answers = xmlBatch? readXmlBatchResponse(response, remoteDatasets, responseAttrs)
+            : readJsonBatchResponse(response, cfg.batchRoot, remoteDatasets, responseAttrs);
 #else
-                ocrText = "(built with no OCR support)";
+        answers = readXmlBatchResponse(response, remoteDatasets, responseAttrs);
 #endif
-            }
+        if (answers.size() != remoteDatasets.size())
+        {
+            qDebug() << "Web query batch of" << remoteDatasets.size() << "got" << answers.size() << "answers";
+            error = true;
+        }
+    }
+
+    // Each item succeeds or fails on its own, the whole batch fails only
+    // if the service did not answer. Failed items stay in the spool.
+    //
+    for (int i = 0; i < rqDatasets.size(); ++i)
+    {
+        auto remote = remoteDatasets.indexOf(rqDatasets[i]);
+        if (remote < 0)
+        {
+            results.append(true);
+            continue;
+        }
+
+        if (error)
+        {
+            results.append(false);
+            continue;
+        }
+
+        // Values of the items succeeded are already in the datasets
+        //
+        auto& answer = answers[remote];
+        auto itemError = answer.error && !isIgnorableError(answer.message, cfg.ignoreErrors);
+        rqDatasets[i]->putAndInsertString(DCM_PatientID,   "0", itemError);
+        rqDatasets[i]->putAndInsertString(DCM_PatientName, "^", itemError);
+        results.append(!itemError);
+    }
+
+    return results;
+}
+
+bool PrintSCP::isIgnorableError(const QString& message, const QStringList& ignoreErrors)
+{
+    Q_FOREACH (auto ignore, ignoreErrors)
+    {
+        if (message.contains(ignore))
+        {
+            qDebug() << ignore << "found in the response. The error was suppressed";
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PrintSCP::applyWebResponse(DcmDataset *rqDataset, const QString& contentType, const QByteArray& response,
+                                bool error, const QStringList& ignoreErrors)
+{
+    // Check for errors we can safelly ignore
+    //
+    if (error)
+    {
+        // JSON errors are matched as a whole, so the patterns may refer to any field
+        // of the error (code, message, etc). XML ones use the <message>, if any.
+        //
+        QString message;
+        if (!contentType.contains("/json"))
+        {
+            readResponse(contentType, response, nullptr, responseAttrs, message);
+        }
+        error = !isIgnorableError(message.isEmpty()? QString::fromUtf8(response): message, ignoreErrors);
+    }
+
+    // Add some required fields, in case if they are empty.
+    // Normally, we expect them to be overriden with the data received from the app server.
+    // Also, reset the patient name & id in case of an error.
+    //
+    rqDataset->putAndInsertString(DCM_PatientID,   "0", error);
+    rqDataset->putAndInsertString(DCM_PatientName, "^", error);
+
+    if (!error)
+    {
+        // Store web service response to the dataset, no intermediate maps
+        //
+        QString message;
+        readResponse(contentType, response, rqDataset, responseAttrs, message);
+    }
+
+    return !error;
+}
+
+void PrintSCP::insertTags(DcmDataset *rqDataset, QVariantMap &queryParams, const OcrImage& img, const TagRulePlan& plan)
+{
+    // Recognize each distinct region once, all of them in parallel.
+    // Different regions in the settings may become the same one for this image.
+    //
+    QList<OcrRegion> regions;
+    QList<OcrRegion> distinctRegions;
+    Q_FOREACH (auto region, plan.regions())
+    {
+        region.rect = img.resolve(region.rect);
+        if (region.params.lang.isEmpty())
+        {
+            region.params.lang = ocrLang;
+        }
+
+        regions.append(region);
+        if (!distinctRegions.contains(region))
+        {
+            distinctRegions.append(region);
         }
+    }
 
+    bool expired = false;
+    auto distinctTexts = OcrEnginePool::instance().recognize(img, distinctRegions, &expired);
+    QStringList texts;
+    Q_FOREACH (auto region, regions)
+    {
+        // Remove non printable symbols and trailing whitespace.
+        //
+        texts.append(distinctTexts[distinctRegions.indexOf(region)].remove(reBadSymbols).trimmed());
+    }
+
+    Q_FOREACH (auto rule, plan.rules())
+    {
         QString str;
-        auto pattern = settings.value("pattern").toString();
-        if (!pattern.isEmpty())
+        if (!rule.pattern.isEmpty())
         {
-            if (rect.isEmpty())
-            {
-                qDebug() << "pattern" << pattern << "ignored since `rect' isn't specified for" << key;
-            }
-            else if (ocrText.isEmpty())
+            auto& ocrText = texts[rule.region];
+            if (ocrText.isEmpty())
             {
-                qDebug() << "No text on the image for idx" << i << "key" << key << "rect" << rect;
+                qDebug() << "No text on the image for key" << rule.key << "rect" << regions[rule.region].rect;
             }
             else
             {
-                QRegExp re(pattern);
+                QRegExp re(rule.pattern); // The rule is shared with other threads
                 if (re.indexIn(ocrText) < 0)
                 {
-                    qDebug() << ocrText << "does not match" << pattern;
+                    qDebug() << ocrText << "does not match" << re.pattern();
                 }
                 else
                 {
@@ -1530,27 +2486,25 @@ void PrintSCP::insertTags(DcmDataset *rqDataset, QVariantMap &queryParams, Dicom
         //
         if (str.isEmpty())
         {
-            str = settings.value("value").toString();
+            str = rule.value;
         }
 
-        auto param = settings.value("query-parameter").toString();
-        if (!param.isEmpty())
+        if (!rule.queryParameter.isEmpty())
         {
-            queryParams[param] = str;
+            queryParams[rule.queryParameter] = str;
         }
 
-        if (!key.isEmpty())
+        if (rule.hasTag)
         {
-            DcmTag tag;
-            if (DcmTag::findTagFromName(key.toUtf8(), tag).bad())
-            {
-                qDebug() << "Unknown DCM tag" << key;
-            }
-            else
-            {
-                rqDataset->putAndInsertString(tag, str.toUtf8());
-            }
+            rqDataset->putAndInsertString(rule.tag, str.toUtf8());
         }
     }
-    settings.endArray();
+
+    // Rules of the expired regions got the default values.
+    // Keep a copy of the image, so it may be recognized again offline.
+    //
+    if (expired && !ocrTimeoutPath.isEmpty())
+    {
+        saveToDisk(ocrTimeoutPath, rqDataset);
+    }
 }
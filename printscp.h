@@ -19,17 +19,24 @@
 
 #include <QObject>
 #include <QDate>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QHash>
+#include <QMutex>
+#include <QNetworkRequest>
+#include <QRect>
 #include <QRegExp>
 #include <QSettings>
-#ifdef WITH_TESSERACT
-#include <tesseract/baseapi.h>
-#endif
+#include <QSharedPointer>
+#include <QUrl>
+#include <QVariantMap>
 
 #define DEFAULT_LISTEN_PORT  10005
 #define DEFAULT_TIMEOUT      30
-#define DEFAULT_OCR_LANG     "eng"
 #define DEFAULT_CONTENT_TYPE "application/xml"
 #define DEFAULT_CHARSET      "UTF-8"
+#define DEFAULT_XML_BATCH_ROOT "batch-request"
+#define DEFAULT_PRINTER_INFO_TTL 30 // In seconds
 
 #ifdef UNICODE
 #define DCMTK_UNICODE_BUG_WORKAROUND
@@ -46,7 +53,17 @@
 #undef DCMTK_UNICODE_BUG_WORKAROUND
 #endif
 
+#include "attrcodec.h"
+#include "sessionattributes.h"
+
 class DicomImage;
+class OcrImage;
+class QNetworkReply;
+class QueryEndpoints;
+class QThreadPool;
+class StoreSCP;
+class TagRulePlan;
+class UpstreamPool;
 struct T_ASC_Association;
 
 class PrintSCP : public QObject
@@ -75,17 +92,173 @@ public:
      */
     void handleClient();
 
+    /** sends A-ASSOCIATE-AC for an association negotiated with negotiateAssociation().
+     *  @return ASC_NORMAL if successful, an error code otherwise.
+     */
+    OFCondition acknowledgeAssociation();
+
+    /** receives a single DIMSE command from the client, processes it by itself
+     *  or forwards it to the upstream printer, and sends back the response.
+     *  @return DIMSE_NORMAL if successful, an error code otherwise.
+     *    Any error, including A-RELEASE and A-ABORT from the peer, means
+     *    the association must be closed with closeAssociation().
+     */
+    OFCondition handleCommand();
+
+    /** releases or aborts the client association depending on the condition
+     *  returned by the last handleCommand() and closes upstream association.
+     *  DIMSE_NODATAAVAILABLE means the client was idle for too long.
+     *  @param cond the reason to close the association.
+     */
+    void closeAssociation(OFCondition cond);
+
+    /** checks whether the client has sent nothing for client-idle-timeout seconds.
+     *  Such association should be closed with closeAssociation(DIMSE_NODATAAVAILABLE).
+     */
+    bool isIdle() const;
+
+    /** the client association, for use with ASC_selectReadableAssociation().
+     */
+    T_ASC_Association *association() const { return assoc; }
+
+    /** hands image processing (OCR, web query and storage) off to the pool.
+     *  Without the pool, images are processed synchronously, before N-SET-RSP.
+     *  @param pool the worker pool, may be NULL
+     */
+    void setWorkerPool(QThreadPool *pool) { workers = pool; }
+
+    /** checks whether there are images of this session still being processed by the pool.
+     */
+    bool isBusy();
+
     /** destroys the association managed by this object.
      */
     void dropAssociations();
 
+    /** builds printer attributes for N-GET for all configured printers.
+     *  Called by the listener process, so all worker processes inherit them.
+     */
+    static void loadPrinterInfo();
+
     /** Add attributes from the web service.
      *  @param rqDataset request dataset, may not be NULL
      */
     bool webQuery(DcmDataset *rqDataset);
 
+    /** @return how many spooled images may be sent in a single web query, see webQueryBatch.
+     */
+    int webQueryBatchSize();
+
+    /** Add attributes from the web service to several datasets with a single request.
+     *  Falls back to webQuery for each dataset if the batch mode is off.
+     *  @param rqDatasets request datasets, may not be NULL
+     *  @return for each dataset, true if succeeded, or the error was suppressed by ignore-errors
+     */
+    QList<bool> webQueryBatch(const QList<DcmDataset*>& rqDatasets);
+
+    // An item of the batch web query response
+    //
+    struct BatchAnswer
+    {
+        bool error;
+        QString message; // Of the error, for ignore-errors
+    };
+
 private:
 
+    // The [query] section, global and the printer's one
+    //
+    struct QueryConfig
+    {
+        QList<QUrl> urls; // Equivalent endpoints
+        int retryInterval;
+        int hedgePercentile;
+        QString userName;
+        QString password;
+        QString contentType;
+        bool http2;
+        int timeout; // In milliseconds, 0 for no limit
+        QList<QPair<QString, TextAttr> > extraParams; // Parameter name and the attribute of the value
+        QStringList ignoreErrors;
+        int batchSize;
+        QUrl batchUrl;
+        QString batchRoot;
+    };
+
+    /** @return the query settings, read once per session.
+     */
+    const QueryConfig& readQueryConfig();
+
+    /** recognizes the tags and collects the query parameters.
+     *  @param rqDataset request dataset, may not be NULL
+     *  @param cfg the query settings
+     *  @return the query parameters
+     */
+    QVariantMap queryParameters(DcmDataset *rqDataset, const QueryConfig& cfg);
+
+    /** fills the dataset from the demographics index instead of the web service.
+     *  @param rqDataset request dataset
+     *  @param queryParams the query parameters
+     *  @return true if the study was found
+     */
+    bool lookupLocally(DcmDataset *rqDataset, const QVariantMap& queryParams);
+
+    QNetworkRequest queryRequest(const QueryConfig& cfg, const QUrl& url, const QByteArray& data);
+
+    /** stores the response of the web service to the dataset.
+     *  @param rqDataset request dataset
+     *  @param contentType of the response
+     *  @param response the response body
+     *  @param error whether the service reported an error
+     *  @param ignoreErrors errors to suppress
+     *  @return true if succeeded, or the error was suppressed
+     */
+    bool applyWebResponse(DcmDataset *rqDataset, const QString& contentType, const QByteArray& response,
+                          bool error, const QStringList& ignoreErrors);
+
+    /** @return true if the error message contains any of ignore-errors.
+     */
+    static bool isIgnorableError(const QString& message, const QStringList& ignoreErrors);
+
+    // A web query in flight, see startWebQuery
+    //
+    struct PendingQuery
+    {
+        QList<QNetworkReply*> replies; // Empty if the response was found in the cache
+        QList<int> asked;              // The endpoint of each reply
+        QList<qint64> sentAt;          // When each reply was sent, by the timer
+        QList<int> candidates;         // Endpoints not asked yet
+        QSharedPointer<QueryEndpoints> endpoints;
+        QNetworkRequest request;
+        QByteArray data;
+        int hedgeDelay;      // In milliseconds, 0 for no hedged request
+        QByteArray cacheKey;
+        QString cachedContentType;
+        QByteArray cachedResponse;
+        QStringList ignoreErrors;
+        int timeout;         // In milliseconds, 0 for no limit
+        QElapsedTimer timer; // Started when the request was sent
+    };
+
+    /** recognizes the tags and sends the web query, the response is not awaited.
+     *  @param rqDataset request dataset, may not be NULL
+     *  @return the query in flight, or NULL if there is no web service to ask
+     */
+    PendingQuery* startWebQuery(DcmDataset *rqDataset);
+
+    /** sends the query to the next endpoint not asked yet.
+     *  @param query in flight
+     *  @return false if all endpoints were already asked
+     */
+    bool sendWebQuery(PendingQuery *query);
+
+    /** waits for the response of the web query and adds attributes from it.
+     *  @param rqDataset request dataset, the same one the query was started with
+     *  @param query from startWebQuery, deleted by this call
+     *  @return true if succeeded, or the error was suppressed by ignore-errors
+     */
+    bool finishWebQuery(DcmDataset *rqDataset, PendingQuery *query);
+
     /// private undefined assignment operator
     PrintSCP& operator=(const PrintSCP&);
 
@@ -102,6 +275,14 @@ private:
      */
     OFCondition refuseAssociation(T_ASC_RejectParametersResult result, T_ASC_RejectParametersReason reson);
 
+    /** requests an association with the upstream printer.
+     *  @param calleeAETitle our AETITLE
+     *  @param printerAETitle called AETITLE of the printer
+     *  @param printerAddress network address of the printer
+     *  @return result indicating whether the association was accepted
+     */
+    OFCondition connectUpstream(const QString& calleeAETitle, const QString& printerAETitle, const QString& printerAddress);
+
     /** handles any incoming N-GET-RQ message and sends back N-GET-RSP.
      *  @param rq request message
      *  @param rqDataset request dataset, may be NULL
@@ -161,6 +342,20 @@ private:
      */
     void printerNGet(T_DIMSE_Message &rq, T_DIMSE_Message &rsp, DcmDataset *&rspDataset);
 
+    /** checks whether N-GET for the Printer SOP Class can be answered without
+     *  asking the upstream printer. If the attributes are outdated, they will be
+     *  refreshed right after the response is sent.
+     *  @param rq request message
+     *  @return true if the request should be handled locally
+     */
+    bool isPrinterInfoCached(T_DIMSE_Message &rq);
+
+    /** starts a background request to the real printer for its attributes.
+     *  The new attributes go to the settings file, the session is not affected
+     *  by the request duration nor by its failure.
+     */
+    void startPrinterInfoRefresh();
+
     /** implements the N-CREATE operation for the Basic Film Session SOP Class.
      *  @param rqDataset request dataset, may be NULL
      *  @param rsp response message, already initialized
@@ -205,13 +400,24 @@ private:
      */
     void storeImage(DcmDataset *rqDataset);
 
+    /** adds session attributes and unique identifiers to the image.
+     *  @param rqDataset request dataset, may not be NULL
+     */
+    void prepareImage(DcmDataset *rqDataset);
+
+    /** queries the web service and sends the image to the storage servers.
+     *  Only the dataset itself is used, so it is safe to call from the worker pool.
+     *  @param rqDataset request dataset, prepared with prepareImage()
+     */
+    void processImage(DcmDataset *rqDataset);
+
     /** Add attributes from the printer settings.
      *  @param rqDataset request dataset, may not be NULL
      *  @param queryParams for the web service
-     *  @param di image from dataset, may not be NULL
-     *  @param settings to read attributes from
+     *  @param img rendered regions of the image from dataset
+     *  @param plan tag rules of the printer
      */
-    void insertTags(DcmDataset *rqDataset, QVariantMap &queryParams, DicomImage *di, QSettings &settings);
+    void insertTags(DcmDataset *rqDataset, QVariantMap &queryParams, const OcrImage& img, const TagRulePlan& plan);
 
     void dump(const char* desc, DcmItem *dataset);
     void dumpIn(T_DIMSE_Message &msg, DcmItem *dataset);
@@ -238,9 +444,9 @@ private:
     bool forceUniqueSeries;
     bool forceUniqueStudy;
 
-    // the dataset to log all session attributes
+    // all session attributes, to be added to every image
     //
-    DcmDataset* sessionDataset;
+    SessionAttributes sessionAttributes;
 
     // Printer AETITLE. Must have a section in the settings file
     //
@@ -258,16 +464,64 @@ private:
     //
     T_ASC_Association *upstream;
 
-#ifdef WITH_TESSERACT
-    // OCR
+    // All real printers for this virtual printer and the one we are connected to
     //
-    tesseract::TessBaseAPI tess;
-#endif
+    UpstreamPool *upstreamPool;
+    int upstreamIdx;
+
+    // OCR language
+    //
+    QString ocrLang;
+
+    // Where to keep the images with OCR timed out, empty for nowhere
+    //
+    QString ocrTimeoutPath;
 
     // Log upstream printer traffic (off by default)
     //
     bool debugUpstream;
 
+    // How long the upstream printer attributes are up to date, in seconds.
+    // Zero to forward every N-GET to the upstream printer.
+    //
+    int printerInfoTtl;
+    bool printerInfoExpired;
+
+    // How long to wait for the next command from the client, in seconds.
+    // Zero to wait forever.
+    //
+    int clientIdleTimeout;
+
+    // blocking mode and timeout for upstream printer responses
+    //
+    T_DIMSE_BlockingMode upstreamBlockMode;
+    int upstreamTimeout;
+
+    // When the last command was handled, msecs since epoch
+    //
+    qint64 lastActivity;
+
+    // Optional pool to process images asynchronously
+    //
+    QThreadPool *workers;
+
+    // Images in progress. At most one at a time is processed,
+    // so the session state and storage associations are not shared.
+    //
+    QList<QFuture<void> > pendingImages;
+    QMutex imageLock;
+
+    // The query settings with the parameter names resolved, and the attributes
+    // of the web service responses by name. Both are filled on first use, and
+    // the images are processed one at a time, so no locking is needed.
+    //
+    QSharedPointer<QueryConfig> queryConfig;
+    QHash<QString, TextAttr> responseAttrs;
+
+    // Storage server associations, kept open for the whole print session
+    //
+    QMap<QString, StoreSCP*> storageServers;
+
     // Regular expression to remove non printable symbols
     // For example, [^a-zA-Z .] will remove everything
     // except latin chars, the dot and the space.
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "queryendpoints.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QFileInfo>
+#include <QHash>
+#include <QLockFile>
+#include <QMutex>
+#include <QStringList>
+#include <QUtf8Settings>
+
+#include <algorithm>
+
+// How long to wait for other processes to update the health, in milliseconds
+//
+#define QUERY_STATE_LOCK_TIMEOUT 1000
+
+// Rotation and latencies of a printer's endpoints, in this process only.
+// Health is shared by all processes through the state file.
+//
+struct EndpointsState
+{
+    EndpointsState() : last(-1), healthModified(-1) {}
+
+    int last;
+    QList<int> latencies;
+    QHash<int, QDateTime> downUntil;
+    qint64 healthModified; // Of the state file, when it was read
+};
+
+static QMutex statesLock;
+static QHash<QString, EndpointsState> states;
+
+static QString stateFileName()
+{
+    QUtf8Settings settings;
+    return settings.fileName() + ".query-state";
+}
+
+// Rereads the health, if other processes have changed it.
+// Must be called with statesLock held.
+//
+static void readHealth(const QString& printer, EndpointsState& state)
+{
+    QFileInfo fi(stateFileName());
+    auto modified = fi.exists()? fi.lastModified().toMSecsSinceEpoch(): 0;
+    if (modified == state.healthModified)
+    {
+        return;
+    }
+
+    QSettings health(fi.filePath(), QSettings::IniFormat);
+    health.sync();
+    health.beginGroup(printer);
+    state.downUntil.clear();
+    Q_FOREACH (auto key, health.childKeys())
+    {
+        state.downUntil[key.toInt()] = health.value(key).toDateTime();
+    }
+    health.endGroup();
+    state.healthModified = modified;
+}
+
+// Saves the health of the endpoint for other processes.
+// Other workers may update the same file, so it goes under a lock file.
+//
+static void writeHealth(const QString& printer, int idx, const QDateTime& downUntil)
+{
+    auto fileName = stateFileName();
+    QLockFile lockFile(fileName + ".lock");
+    if (!lockFile.tryLock(QUERY_STATE_LOCK_TIMEOUT))
+    {
+        qWarning() << "Failed to lock" << lockFile.fileName() << "web service health is not shared";
+        return;
+    }
+
+    // Get the health saved by others
+    //
+    QSettings health(fileName, QSettings::IniFormat);
+    health.sync();
+    health.beginGroup(printer);
+    if (downUntil.isValid())
+    {
+        health.setValue(QString::number(idx), downUntil);
+    }
+    else
+    {
+        health.remove(QString::number(idx));
+    }
+    health.endGroup();
+    health.sync();
+}
+
+QueryEndpoints::QueryEndpoints(const QString& printer, const QList<QUrl>& urls, int retryInterval, int hedgePercentile)
+    : printer(printer)
+    , urls(urls)
+    , retryInterval(retryInterval)
+    , hedgePercentile(qBound(0, hedgePercentile, 100))
+{
+}
+
+QList<int> QueryEndpoints::candidates()
+{
+    QList<int> healthy;
+    QList<int> failed;
+
+    if (urls.size() < 2)
+    {
+        // Nothing to choose from
+        //
+        if (!urls.isEmpty())
+        {
+            healthy.append(0);
+        }
+        return healthy;
+    }
+
+    QMutexLocker lock(&statesLock);
+    auto& state = states[printer];
+    readHealth(printer, state);
+
+    // Forked workers start from different endpoints, so the load is spread
+    // even if each of them sends a few queries only.
+    //
+    if (state.last < 0)
+    {
+        state.last = QCoreApplication::applicationPid() % urls.size();
+    }
+
+    auto now = QDateTime::currentDateTime();
+    auto first = state.last = (state.last + 1) % urls.size();
+
+    for (int i = 0; i < urls.size(); ++i)
+    {
+        auto idx = (first + i) % urls.size();
+        if (now < state.downUntil.value(idx))
+        {
+            failed.append(idx);
+        }
+        else
+        {
+            healthy.append(idx);
+        }
+    }
+
+    return healthy + failed;
+}
+
+void QueryEndpoints::markFailed(int idx)
+{
+    qDebug() << "Web service" << url(idx) << "is unavailable for" << retryInterval << "seconds";
+    if (urls.size() < 2)
+    {
+        return;
+    }
+
+    auto downUntil = QDateTime::currentDateTime().addSecs(retryInterval);
+    {
+        QMutexLocker lock(&statesLock);
+        states[printer].downUntil[idx] = downUntil;
+    }
+    writeHealth(printer, idx, downUntil);
+}
+
+void QueryEndpoints::markAnswered(int idx, int msecs)
+{
+    if (urls.size() < 2)
+    {
+        return;
+    }
+
+    bool recovered = false;
+    {
+        QMutexLocker lock(&statesLock);
+        auto& state = states[printer];
+        recovered = state.downUntil.remove(idx) > 0;
+
+        if (hedgePercentile > 0)
+        {
+            // The endpoints are equivalent, so the latencies are shared too
+            //
+            state.latencies.append(msecs);
+            while (state.latencies.size() > QUERY_LATENCY_SAMPLES)
+            {
+                state.latencies.removeFirst();
+            }
+        }
+    }
+
+    // Only the health changes go to the file
+    //
+    if (recovered)
+    {
+        writeHealth(printer, idx, QDateTime());
+    }
+}
+
+int QueryEndpoints::hedgeDelay()
+{
+    if (hedgePercentile <= 0 || urls.size() < 2)
+    {
+        return 0;
+    }
+
+    QList<int> latencies;
+    {
+        QMutexLocker lock(&statesLock);
+        latencies = states[printer].latencies;
+    }
+
+    if (latencies.size() < QUERY_HEDGE_MIN_SAMPLES)
+    {
+        // Too early to tell what is slow
+        //
+        return 0;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto pos = (latencies.size() * hedgePercentile + 99) / 100 - 1;
+    return qMax(1, latencies[qBound(0, pos, latencies.size() - 1)]);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUERYENDPOINTS_H
+#define QUERYENDPOINTS_H
+
+#include <QList>
+#include <QUrl>
+
+#define DEFAULT_QUERY_RETRY_INTERVAL   60
+#define DEFAULT_QUERY_HEDGE_PERCENTILE 0  // Never send a hedged request
+#define QUERY_LATENCY_SAMPLES          64
+#define QUERY_HEDGE_MIN_SAMPLES        16
+
+class QSettings;
+
+// The set of equivalent web service endpoints of the [query] section.
+//
+// url=http://ris1/query, http://ris2/query
+// retry-interval=60
+// hedge-percentile=95
+//
+// The endpoints are asked in the round-robin order, the failed ones
+// are moved to the end of the list for retry-interval seconds.
+// The order and recent latencies are kept in memory of each process.
+// Health is kept in the state file next to the settings file, so it is
+// shared by all worker processes.
+//
+class QueryEndpoints
+{
+public:
+    QueryEndpoints(const QString& printer, const QList<QUrl>& urls, int retryInterval, int hedgePercentile);
+
+    /** @return number of configured endpoints.
+     */
+    int size() const { return urls.size(); }
+
+    /** @return address of the endpoint.
+     */
+    QUrl url(int idx) const { return urls.value(idx); }
+
+    /** @return indexes of endpoints in the order they should be tried.
+     *  Endpoints failed recently are moved to the end of the list.
+     */
+    QList<int> candidates();
+
+    /** marks the endpoint as unavailable for retry-interval seconds.
+     */
+    void markFailed(int idx);
+
+    /** marks the endpoint as available and accounts the response time.
+     *  @param idx the endpoint
+     *  @param msecs how long the endpoint took to answer
+     */
+    void markAnswered(int idx, int msecs);
+
+    /** @return milliseconds to wait before the hedged request
+     *  is sent to the next endpoint, 0 if there should be none.
+     */
+    int hedgeDelay();
+
+private:
+    QString printer;
+    QList<QUrl> urls;
+    int retryInterval;
+    int hedgePercentile;
+};
+
+#endif // QUERYENDPOINTS_H
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sessionattributes.h"
+
+static quint32 tagIndex(const DcmTagKey& key)
+{
+    return ((quint32)key.getGroup() << 16) | key.getElement();
+}
+
+static bool sameValue(DcmElement* a, DcmElement* b)
+{
+    if (a->getVR() != b->getVR() || a->getLength() != b->getLength())
+    {
+        return false;
+    }
+
+    OFString strA, strB;
+    return a->getOFStringArray(strA).good() && b->getOFStringArray(strB).good() && strA == strB;
+}
+
+void SessionAttributes::Snapshot::reindex()
+{
+    elements.clear();
+    index.clear();
+
+    DcmObject* obj = nullptr;
+    while (obj = dataset.nextInContainer(obj), obj != nullptr)
+    {
+        auto elem = static_cast<DcmElement*>(obj);
+        index[tagIndex(elem->getTag())] = elements.size();
+        elements.append(elem);
+    }
+}
+
+DcmElement* SessionAttributes::Snapshot::find(const DcmTagKey& key) const
+{
+    auto it = index.find(tagIndex(key));
+    return it == index.end()? nullptr: elements[it.value()];
+}
+
+SessionAttributes::SessionAttributes()
+{
+}
+
+void SessionAttributes::clear()
+{
+    snapshot.clear();
+}
+
+void SessionAttributes::put(const DcmTagKey& key, const char* value, bool replaceOld)
+{
+    DcmDataset item;
+    item.putAndInsertString(key, value);
+    update(&item, replaceOld);
+}
+
+void SessionAttributes::update(DcmItem* src, bool replaceOld)
+{
+    // The source dataset is optional
+    //
+    if (!src)
+    {
+        return;
+    }
+
+    QList<DcmElement*> changed;
+    DcmObject* obj = nullptr;
+    while (obj = src->nextInContainer(obj), obj != nullptr)
+    {
+        if (obj->getVR() == EVR_SQ)
+        {
+            // Ignore ReferencedFilmSessionSequence
+            //
+            continue;
+        }
+
+        auto elem = static_cast<DcmElement*>(obj);
+        auto current = snapshot? snapshot->find(elem->getTag()): nullptr;
+        if (current && (!replaceOld || sameValue(current, elem)))
+        {
+            continue;
+        }
+
+        changed.append(static_cast<DcmElement*>(elem->clone()));
+    }
+
+    if (changed.isEmpty())
+    {
+        return;
+    }
+
+    // The images being prepared may still use the current snapshot,
+    // so the changes go to a new one.
+    //
+    auto next = snapshot? new Snapshot(snapshot->dataset): new Snapshot;
+    Q_FOREACH (auto elem, changed)
+    {
+        next->dataset.insert(elem, true);
+    }
+    next->reindex();
+    snapshot = QSharedPointer<const Snapshot>(next);
+}
+
+void SessionAttributes::mergeInto(DcmItem* dst) const
+{
+    auto current = snapshot;
+    if (!current || current->elements.isEmpty())
+    {
+        return;
+    }
+
+    // Both lists are sorted by tag. Take the elements out of the destination
+    // and put them back together with the session ones in the ascending order,
+    // so each insert just appends to the end of the list.
+    //
+    QVector<DcmElement*> own;
+    own.reserve(dst->card());
+    DcmElement* elem = nullptr;
+    while (elem = dst->remove(0UL), elem != nullptr)
+    {
+        own.append(elem);
+    }
+
+    int i = 0, j = 0;
+    while (i < own.size() || j < current->elements.size())
+    {
+        if (j == current->elements.size() || (i < own.size() && own[i]->getTag() < current->elements[j]->getTag()))
+        {
+            dst->insert(own[i++]);
+            continue;
+        }
+
+        if (i < own.size() && own[i]->getTag() == current->elements[j]->getTag())
+        {
+            // Overwrite
+            //
+            delete own[i++];
+        }
+
+        dst->insert(static_cast<DcmElement*>(current->elements[j++]->clone()));
+    }
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSIONATTRIBUTES_H
+#define SESSIONATTRIBUTES_H
+
+#include <QHash>
+#include <QSharedPointer>
+#include <QVector>
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dcdatset.h>
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+// Attributes of the print session (film session, film box, etc),
+// to be added to every image of the session.
+//
+// The attributes are kept in an immutable snapshot, sorted and indexed by tag.
+// A new snapshot is built only when a request changes some value, so repeated
+// N-SET/N-CREATE with the same attributes cost a lookup per element.
+// The images get the attributes in one sorted pass, without searching
+// the image dataset for each of them.
+//
+class SessionAttributes
+{
+public:
+    SessionAttributes();
+
+    /** forgets all attributes.
+     */
+    void clear();
+
+    /** stores a single attribute.
+     *  @param key the tag
+     *  @param value the value
+     *  @param replaceOld if false, an existing value is kept
+     */
+    void put(const DcmTagKey& key, const char* value, bool replaceOld = true);
+
+    /** stores all attributes of the item, except the sequences.
+     *  @param src the item, may be NULL
+     *  @param replaceOld if false, existing values are kept
+     */
+    void update(DcmItem* src, bool replaceOld = true);
+
+    /** copies all attributes to the item, overwriting the existing ones.
+     *  @param dst the item
+     */
+    void mergeInto(DcmItem* dst) const;
+
+private:
+    struct Snapshot
+    {
+        Snapshot() {}
+        explicit Snapshot(const DcmDataset& src) : dataset(src) {}
+
+        /** rebuilds the index after the dataset is changed.
+         */
+        void reindex();
+
+        /** @return the element with the tag, NULL if there is none.
+         */
+        DcmElement* find(const DcmTagKey& key) const;
+
+        DcmDataset dataset;
+        QVector<DcmElement*> elements;  // in the dataset order, i.e. sorted by tag
+        QHash<quint32, int> index;      // (group << 16 | element) => position in elements
+
+    private:
+        Q_DISABLE_COPY(Snapshot)
+    };
+
+    QSharedPointer<const Snapshot> snapshot;
+};
+
+#endif // SESSIONATTRIBUTES_H
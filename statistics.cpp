@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "statistics.h"
+
+#include <QDebug>
+#include <QHash>
+#include <QLockFile>
+#include <QMutex>
+#include <QUtf8Settings>
+
+// How long to wait for other processes to update the totals, in milliseconds
+//
+#define STATISTICS_LOCK_TIMEOUT 1000
+
+static QMutex countersLock;
+static QHash<QByteArray, qint64> counters;
+
+void countEvent(const char* name, int count)
+{
+    QMutexLocker lock(&countersLock);
+    counters[name] += count;
+}
+
+void flushStatistics()
+{
+    QHash<QByteArray, qint64> pending;
+    {
+        QMutexLocker lock(&countersLock);
+        pending.swap(counters);
+    }
+
+    if (pending.isEmpty())
+    {
+        return;
+    }
+
+    QUtf8Settings settings;
+
+    // Other worker processes add their counts to the same totals,
+    // so read-add-write goes under a lock file.
+    //
+    QLockFile lockFile(settings.fileName() + ".statistics.lock");
+    if (!lockFile.tryLock(STATISTICS_LOCK_TIMEOUT))
+    {
+        qWarning() << "Failed to lock" << lockFile.fileName() << "statistics are postponed";
+        QMutexLocker lock(&countersLock);
+        for (auto i = pending.constBegin(); i != pending.constEnd(); ++i)
+        {
+            counters[i.key()] += i.value();
+        }
+        return;
+    }
+
+    // Get the totals saved by others
+    //
+    settings.sync();
+    settings.beginGroup("statistics");
+    for (auto i = pending.constBegin(); i != pending.constEnd(); ++i)
+    {
+        auto total = settings.value(i.key()).toLongLong() + i.value();
+        settings.setValue(i.key(), total);
+        qDebug() << i.key() << "+" << i.value() << "total" << total;
+    }
+    settings.endGroup();
+    settings.sync();
+}
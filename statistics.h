@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+// Process wide event counters (reaped associations, cache hits and so on).
+// The counters are accumulated in memory and added to the [statistics]
+// section of the settings file by flushStatistics(), so the totals
+// of all worker processes are visible in one place.
+//
+void countEvent(const char* name, int count = 1);
+void flushStatistics();
+
+#endif // STATISTICS_H
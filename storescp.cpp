@@ -31,6 +31,10 @@
 #undef DCMTK_UNICODE_BUG_WORKAROUND
 #endif
 
+// The maximum number of presentation contexts in a single association
+//
+#define MAX_PRESENTATION_CONTEXTS 128
+
 StoreSCP::StoreSCP(const QString& server, QObject *parent)
     : QObject(parent)
     , server(server)
@@ -42,6 +46,25 @@ StoreSCP::StoreSCP(const QString& server, QObject *parent)
     QUtf8Settings settings;
     blockMode = (T_DIMSE_BlockingMode)settings.value("block-mode", blockMode).toInt();
     timeout   = settings.value("timeout", timeout).toInt();
+
+    QStringList defaultTransferSyntaxes;
+    defaultTransferSyntaxes
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        << UID_LittleEndianExplicitTransferSyntax << UID_BigEndianExplicitTransferSyntax
+#elif __BYTE_ORDER == __BIG_ENDIAN
+        << UID_BigEndianExplicitTransferSyntax << UID_LittleEndianExplicitTransferSyntax
+#else
+#error "Unsupported byte order"
+#endif
+        << UID_LittleEndianImplicitTransferSyntax;
+
+    settings.beginGroup(server);
+    timeout          = settings.value("timeout", timeout).toInt();
+    peerAet          = settings.value("aetitle").toString();
+    peerAddress      = settings.value("address").toString();
+    sopClasses       = settings.value("sop-classes", QStringList() << DEFAULT_STORE_SOP_CLASSES).toStringList();
+    transferSyntaxes = settings.value("transfer-syntaxes", defaultTransferSyntaxes).toStringList();
+    settings.endGroup();
 }
 
 StoreSCP::~StoreSCP()
@@ -54,21 +77,26 @@ void StoreSCP::dropAssociation()
 {
     if (assoc)
     {
-        ASC_dropSCPAssociation(assoc);
+        ASC_releaseAssociation(assoc);
         ASC_destroyAssociation(&assoc);
         assoc = nullptr;
     }
+    acceptedContexts.clear();
 }
 
-T_ASC_Parameters* StoreSCP::initAssocParams(const QString& peerAet, const QString& peerAddress, int timeout,
-                                            const char* abstractSyntax, const char* transferSyntax)
+T_ASC_Parameters* StoreSCP::initAssocParams(const char* abstractSyntax, const char* transferSyntax)
 {
     QUtf8Settings settings;
 
     DIC_NODENAME localHost;
     T_ASC_Parameters* params = nullptr;
 
-    auto cond = ASC_initializeNetwork(NET_REQUESTOR, settings.value("store-port").toInt(), timeout, &net);
+    OFCondition cond = EC_Normal;
+    if (!net)
+    {
+        cond = ASC_initializeNetwork(NET_REQUESTOR, settings.value("store-port").toInt(), timeout, &net);
+    }
+
     if (cond.good())
     {
         cond = ASC_createAssociationParameters(&params, settings.value("store-pdu-size", ASC_DEFAULTMAXPDU).toInt());
@@ -82,29 +110,35 @@ T_ASC_Parameters* StoreSCP::initAssocParams(const QString& peerAet, const QStrin
             gethostname(localHost, sizeof(localHost) - 1);
             ASC_setPresentationAddresses(params, localHost, peerAddress.toUtf8());
 
-            if (transferSyntax)
+            auto abstractSyntaxes = sopClasses;
+            if (abstractSyntax && !abstractSyntaxes.contains(abstractSyntax))
+            {
+                abstractSyntaxes.prepend(abstractSyntax);
+            }
+
+            auto xfers = transferSyntaxes;
+            if (transferSyntax && !xfers.contains(transferSyntax))
             {
-                const char* arr[] = { transferSyntax };
-                cond = ASC_addPresentationContext(params, 1, abstractSyntax, arr, 1);
+                xfers.prepend(transferSyntax);
             }
-            else
+
+            /* Set the presentation contexts which will be negotiated */
+            /* when the network connection will be established */
+            int presId = 1;
+            Q_FOREACH (auto sopClass, abstractSyntaxes)
             {
-                /* Set the presentation contexts which will be negotiated */
-                /* when the network connection will be established */
-                const char* transferSyntaxes[] =
+                Q_FOREACH (auto xfer, xfers)
                 {
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-                    UID_LittleEndianExplicitTransferSyntax, UID_BigEndianExplicitTransferSyntax,
-#elif __BYTE_ORDER == __BIG_ENDIAN
-                    UID_BigEndianExplicitTransferSyntax, UID_LittleEndianExplicitTransferSyntax,
-#else
-#error "Unsupported byte order"
-#endif
-                    UID_LittleEndianImplicitTransferSyntax
-                };
+                    if (cond.bad() || presId > MAX_PRESENTATION_CONTEXTS * 2)
+                    {
+                        break;
+                    }
 
-                cond = ASC_addPresentationContext(params, 1, abstractSyntax,
-                    transferSyntaxes, sizeof(transferSyntaxes)/sizeof(transferSyntaxes[0]));
+                    auto xferStr = xfer.toUtf8();
+                    const char* arr[] = { xferStr.constData() };
+                    cond = ASC_addPresentationContext(params, presId, sopClass.toUtf8(), arr, 1);
+                    presId += 2;
+                }
             }
 
             if (cond.good())
@@ -120,7 +154,80 @@ T_ASC_Parameters* StoreSCP::initAssocParams(const QString& peerAet, const QStrin
     return nullptr;
 }
 
-OFCondition StoreSCP::cStoreRQ(DcmDataset* dataset, const char* abstractSyntax, const char* sopInstance)
+OFCondition StoreSCP::connectToServer(const char* abstractSyntax, const char* transferSyntax)
+{
+    T_ASC_Parameters* params = initAssocParams(abstractSyntax, transferSyntax);
+    if (!params)
+    {
+        return makeOFCondition(0, 1, OF_error, "Failed to create association parameters");
+    }
+
+    auto cond = ASC_requestAssociation(net, params, &assoc);
+    if (cond.bad())
+    {
+        qDebug() << "Failed to create association to" << server;
+        ASC_destroyAssociation(&assoc);
+        assoc = nullptr;
+        return cond;
+    }
+
+    // Dump general information concerning the establishment of the network connection if required
+    //
+    qDebug() << "DcmAssoc to" << server << "accepted (max send PDV: " << assoc->sendPDVLength << ")";
+
+    // Remember which of the proposed presentation contexts were accepted
+    //
+    auto count = ASC_countPresentationContexts(assoc->params);
+    for (int i = 0; i < count; ++i)
+    {
+        T_ASC_PresentationContext pc;
+        if (ASC_getPresentationContext(assoc->params, i, &pc).good() && pc.resultReason == ASC_P_ACCEPTANCE)
+        {
+            acceptedContexts.insert(QString::fromUtf8(pc.abstractSyntax),
+                qMakePair(QString::fromUtf8(pc.acceptedTransferSyntax), pc.presentationContextID));
+        }
+    }
+
+    qDebug() << acceptedContexts.size() << "of" << count << "presentation contexts accepted by" << server;
+    return cond;
+}
+
+T_ASC_PresentationContextID StoreSCP::selectPresentationContext(DcmDataset* dataset, const char* abstractSyntax)
+{
+    auto contexts = acceptedContexts.values(QString::fromUtf8(abstractSyntax));
+    if (contexts.isEmpty())
+    {
+        return 0;
+    }
+
+    // The original transfer syntax is the best one
+    //
+    DcmXfer original(dataset->getOriginalXfer());
+    Q_FOREACH (auto pc, contexts)
+    {
+        if (pc.first == original.getXferID())
+        {
+            return pc.second;
+        }
+    }
+
+    // Otherwise, transcode to anything the server has accepted
+    //
+    Q_FOREACH (auto pc, contexts)
+    {
+        auto xfer = DcmXfer(pc.first.toUtf8().constData()).getXfer();
+        if (xfer != EXS_Unknown && dataset->chooseRepresentation(xfer, nullptr).good() && dataset->canWriteXfer(xfer))
+        {
+            qDebug() << "Transcoding" << original.getXferName() << "to" << pc.first << "for" << server;
+            return pc.second;
+        }
+    }
+
+    return 0;
+}
+
+OFCondition StoreSCP::cStoreRQ(DcmDataset* dataset, T_ASC_PresentationContextID presId,
+                               const char* abstractSyntax, const char* sopInstance)
 {
     T_DIMSE_C_StoreRQ req;
     T_DIMSE_C_StoreRSP rsp;
@@ -154,6 +261,19 @@ OFCondition StoreSCP::cStoreRQ(DcmDataset* dataset, const char* abstractSyntax,
     return cond;
 }
 
+OFCondition StoreSCP::openAssociation(DcmDataset* rqDataset)
+{
+    if (assoc)
+    {
+        return EC_Normal;
+    }
+
+    DcmXfer filexfer(rqDataset->getOriginalXfer());
+    OFString sopClass;
+    rqDataset->findAndGetOFString(DCM_SOPClassUID, sopClass);
+    return connectToServer(sopClass.c_str(), filexfer.getXferID());
+}
+
 OFCondition StoreSCP::sendToServer(DcmDataset* rqDataset, const char *sopInstance)
 {
     DcmXfer filexfer(rqDataset->getOriginalXfer());
@@ -161,41 +281,57 @@ OFCondition StoreSCP::sendToServer(DcmDataset* rqDataset, const char *sopInstanc
     OFString sopClass;
     rqDataset->findAndGetOFString(DCM_SOPClassUID, sopClass);
 
-    QUtf8Settings settings;
-    settings.beginGroup(server);
-    auto timeout = settings.value("timeout").toInt();
-    T_ASC_Parameters* params = initAssocParams(settings.value("aetitle").toString(),
-                                               settings.value("address").toString(),
-                                               timeout, sopClass.c_str(), xfer);
+    OFCondition cond = EC_Normal;
 
-    auto cond = ASC_requestAssociation(net, params, &assoc);
-    if (cond.bad())
+    // The association may be closed by the server while we were idle,
+    // so try once again with a fresh association in case of network errors.
+    //
+    for (int attempt = 0; attempt < 2; ++attempt)
     {
-        qDebug() << "Failed to create association to" << server;
-    }
-    else
-    {
-        // Dump general information concerning the establishment of the network connection if required
-        //
-        qDebug() << "DcmAssoc to" << server << "accepted (max send PDV: " << assoc->sendPDVLength << ")";
+        bool reused = assoc != nullptr;
+        if (!reused)
+        {
+            cond = connectToServer(sopClass.c_str(), xfer);
+            if (cond.bad())
+            {
+                break;
+            }
+        }
 
         // Figure out which of the accepted presentation contexts should be used
         //
-        presId = ASC_findAcceptedPresentationContextID(assoc, sopClass.c_str(), xfer);
-        if (presId != 0)
+        auto presId = selectPresentationContext(rqDataset, sopClass.c_str());
+        if (presId == 0)
         {
-            cond = cStoreRQ(rqDataset, sopClass.c_str(), sopInstance);
+            cond = makeOFCondition(0, 1, OF_error, "Presentation context id not found");
+            if (!reused)
+            {
+                break;
+            }
+
+            // The association was opened for other SOP classes.
+            // Open a new one, this time with the class of the dataset.
+            //
+            qDebug() << "Reconnecting to" << server << "for" << sopClass.c_str();
+            dropAssociation();
+            continue;
         }
-        else
+
+        cond = cStoreRQ(rqDataset, presId, sopClass.c_str(), sopInstance);
+        if (cond.good() || cond.module() == 0 || !reused)
         {
-            cond = makeOFCondition(0, 1, OF_error, "Presentation context id not found");
+            // Either success, or the server has rejected the dataset
+            // (DIMSE statuses are reported with the module 0, see cStoreRQ).
+            //
+            break;
         }
 
-        ASC_releaseAssociation(assoc);
+        qDebug() << "Reconnecting to" << server << QString::fromLocal8Bit(cond.text());
+        ASC_abortAssociation(assoc);
         ASC_destroyAssociation(&assoc);
         assoc = nullptr;
+        acceptedContexts.clear();
     }
-    settings.endGroup();
 
     if (cond.bad())
     {
@@ -204,4 +340,3 @@ OFCondition StoreSCP::sendToServer(DcmDataset* rqDataset, const char *sopInstanc
 
     return cond;
 }
-
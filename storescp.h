@@ -18,6 +18,8 @@
 #define STORESCP_H
 
 #include <QObject>
+#include <QMultiHash>
+#include <QStringList>
 
 #ifdef UNICODE
 #define DCMTK_UNICODE_BUG_WORKAROUND
@@ -34,6 +36,11 @@
 #undef DCMTK_UNICODE_BUG_WORKAROUND
 #endif
 
+// Hardcopy Grayscale Image Storage, the SOP class of all our images,
+// and Secondary Capture Image Storage as the most widely supported one.
+//
+#define DEFAULT_STORE_SOP_CLASSES "1.2.840.10008.5.1.1.29", "1.2.840.10008.5.1.4.1.1.7"
+
 class DicomImage;
 struct T_ASC_Association;
 
@@ -46,34 +53,58 @@ public:
     ~StoreSCP();
 
     /** transfers the dataset to the storage server.
+     *  The association is established on the first call and is reused by
+     *  the subsequent calls until this object is destroyed.
      *  @param dataset to send
      *  @param sopInstance unique identifier of the dataset
      *  @return result indicating whether transfer was successful
      */
     OFCondition sendToServer(DcmDataset* dataset, const char* sopInstance);
 
+    /** establishes the association for the dataset ahead of sendToServer,
+     *  so it may overlap with other work. Does nothing if already established.
+     *  @param dataset to be sent
+     *  @return result indicating whether the association was accepted
+     */
+    OFCondition openAssociation(DcmDataset* dataset);
+
 private:
     /** prepares connection parameters for the Store SCP.
-     *  @param peerAet called AETITLE of the server
-     *  @param peerAddress network address of the server
-     *  @param timeout timeout for network operations, in seconds
+     *  Every configured SOP class is proposed with every configured
+     *  transfer syntax, each pair in a separate presentation context.
+     *  @param abstractSyntax SOP class from the dataset, proposed even if not configured
+     *  @param transferSyntax transfer syntax from the dataset, proposed even if not configured
+     *  @return association parameters or NULL if failed.
+     */
+    T_ASC_Parameters* initAssocParams(const char *abstractSyntax, const char* transferSyntax);
+
+    /** establishes the association and remembers accepted presentation contexts.
      *  @param abstractSyntax SOP class from the dataset
      *  @param transferSyntax transfer syntax from the dataset
-     *  @return result indicating whether association negotiation was successful,
-     *    unsuccessful or whether termination of the server was requested.
+     *  @return result indicating whether the association was accepted
+     */
+    OFCondition connectToServer(const char *abstractSyntax, const char* transferSyntax);
+
+    /** selects the presentation context to send the dataset with.
+     *  If the peer did not accept the original transfer syntax, the dataset
+     *  is converted to one of the accepted transfer syntaxes.
+     *  @param dataset to send
+     *  @param abstractSyntax SOP class from the dataset
+     *  @return presentation context ID or 0 if none is suitable
      */
-    T_ASC_Parameters* initAssocParams(const QString& peerAet, const QString& peerAddress, int timeout,
-                                      const char *abstractSyntax, const char* transferSyntax);
+    T_ASC_PresentationContextID selectPresentationContext(DcmDataset* dataset, const char *abstractSyntax);
 
     /** transfers the dataset to the storage server.
      *  @param dataset to send
+     *  @param presId presentation context to send with
      *  @param abstractSyntax SOP class from the dataset
      *  @param sopInstance unique identifier of the dataset
      *  @return result indicating whether transfer was successful
      */
-    OFCondition cStoreRQ(DcmDataset* dataset, const char *abstractSyntax, const char* sopInstance);
+    OFCondition cStoreRQ(DcmDataset* dataset, T_ASC_PresentationContextID presId,
+                         const char *abstractSyntax, const char* sopInstance);
 
-    /** destroys the association managed by this object.
+    /** releases and destroys the association managed by this object.
      */
     void dropAssociation();
 
@@ -81,6 +112,21 @@ private:
     //
     QString server;
 
+    // Called AETITLE and network address of the server
+    //
+    QString peerAet;
+    QString peerAddress;
+
+    // SOP classes and transfer syntaxes to propose
+    //
+    QStringList sopClasses;
+    QStringList transferSyntaxes;
+
+    // Presentation contexts accepted by the server.
+    // SOP class => transfer syntax, presentation context ID
+    //
+    QMultiHash<QString, QPair<QString, T_ASC_PresentationContextID> > acceptedContexts;
+
     // blocking mode for receive
     //
     T_DIMSE_BlockingMode blockMode;
@@ -97,9 +143,6 @@ private:
     //
     T_ASC_Association *assoc;
 
-    // Transfer context (usually LittleEndianExplicit)
-    //
-    T_ASC_PresentationContextID presId;
 };
 
 #endif // STORESCP_H
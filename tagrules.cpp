@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tagrules.h"
+
+#include <QDebug>
+#include <QMap>
+#include <QMutex>
+#include <QUtf8Settings>
+
+static QMutex plansLock;
+static QMap<QString, QSharedPointer<TagRulePlan> > plans;
+
+QSharedPointer<TagRulePlan> TagRulePlan::forPrinter(const QString& printer)
+{
+    QMutexLocker lock(&plansLock);
+    auto plan = plans.value(printer);
+    if (!plan)
+    {
+        plan = QSharedPointer<TagRulePlan>(new TagRulePlan);
+
+        // Global tags, then this printer tags
+        //
+        QUtf8Settings settings;
+        plan->readRules(settings);
+        settings.beginGroup(printer);
+        plan->readRules(settings);
+        settings.endGroup();
+
+        qDebug() << "Tag rules for" << printer << plan->tagRules.size() << "rules" << plan->ocrRegions.size() << "regions";
+        plans[printer] = plan;
+    }
+
+    return plan;
+}
+
+void TagRulePlan::readRules(QSettings& settings)
+{
+    auto tagCount = settings.beginReadArray("tag");
+    for (int i = 0; i < tagCount; ++i)
+    {
+        settings.setArrayIndex(i);
+
+        TagRule rule;
+        rule.key            = settings.value("key").toString();
+        rule.hasTag         = false;
+        rule.region         = -1;
+        rule.value          = settings.value("value").toString();
+        rule.queryParameter = settings.value("query-parameter").toString();
+
+        if (!rule.key.isEmpty())
+        {
+            rule.hasTag = DcmTag::findTagFromName(rule.key.toUtf8(), rule.tag).good();
+            if (!rule.hasTag)
+            {
+                qDebug() << "Unknown DCM tag" << rule.key;
+            }
+        }
+
+        OcrRegion region;
+        region.rect = settings.value("rect").toRect();
+        if (!region.rect.isEmpty())
+        {
+            region.params = OcrParams::fromSettings(settings);
+            rule.region = ocrRegions.indexOf(region);
+            if (rule.region < 0)
+            {
+                rule.region = ocrRegions.size();
+                ocrRegions.append(region);
+            }
+        }
+
+        auto pattern = settings.value("pattern").toString();
+        if (!pattern.isEmpty())
+        {
+            if (rule.region < 0)
+            {
+                qDebug() << "pattern" << pattern << "ignored since `rect' isn't specified for" << rule.key;
+            }
+            else
+            {
+                rule.pattern.setPattern(pattern);
+                if (!rule.pattern.isValid())
+                {
+                    qDebug() << "Bad pattern" << pattern << "for" << rule.key << rule.pattern.errorString();
+                }
+            }
+        }
+
+        tagRules.append(rule);
+    }
+    settings.endArray();
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAGRULES_H
+#define TAGRULES_H
+
+#include "ocrengine.h"
+
+#include <QList>
+#include <QRect>
+#include <QRegExp>
+#include <QSharedPointer>
+#include <QString>
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dctag.h>
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+class QSettings;
+
+// A single `tag' rule from the settings file
+//
+struct TagRule
+{
+    // DICOM tag as written in the settings, for diagnostics
+    //
+    QString key;
+
+    // Resolved tag, valid only if hasTag is set
+    //
+    DcmTag tag;
+    bool hasTag;
+
+    // Region to recognize, index in TagRulePlan::regions(), or -1 if none
+    //
+    int region;
+
+    // Precompiled pattern, empty if none
+    //
+    QRegExp pattern;
+
+    // Default value, if the pattern is absent or mismatched
+    //
+    QString value;
+
+    // Name of the web service parameter, may be empty
+    //
+    QString queryParameter;
+};
+
+// All tag rules of a printer, the global [tag] array first, then the printer's one.
+// Tags are resolved and patterns are compiled once, and the regions shared
+// by several rules (even from different sections) are recognized once.
+//
+class TagRulePlan
+{
+public:
+    /** @return the plan for the printer, built on first use.
+     */
+    static QSharedPointer<TagRulePlan> forPrinter(const QString& printer);
+
+    /** @return all rules in the order they should be applied.
+     */
+    const QList<TagRule>& rules() const { return tagRules; }
+
+    /** @return distinct regions as written in the settings, negative offsets are not resolved.
+     *  The same rect with different OCR parameters is a different region.
+     */
+    const QList<OcrRegion>& regions() const { return ocrRegions; }
+
+private:
+    TagRulePlan() {}
+    void readRules(QSettings& settings);
+
+    QList<TagRule> tagRules;
+    QList<OcrRegion> ocrRegions;
+};
+
+#endif // TAGRULES_H
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Prints a film through the virtual printer, as a modality does, with the stubs
+# in place of the web service, the upstream printer and the storage server.
+# Passes if the image reaches the storage with the patient from the web service.
+#
+# Usage: print-path.sh <virtual-dicom-printer> <virtual-dicom-printer-stubs>
+#
+
+PRINTER=$1
+STUBS=$2
+QUERY_PORT=${QUERY_PORT:-18180}
+DICOM_PORT=${DICOM_PORT:-18104}
+PRINTER_PORT=${PRINTER_PORT:-18105}
+TIMEOUT=${TIMEOUT:-60}
+
+if [ ! -x "$PRINTER" ] || [ ! -x "$STUBS" ]; then
+    echo "Usage: $0 <virtual-dicom-printer> <virtual-dicom-printer-stubs>"
+    exit 2
+fi
+
+WORK=$(mktemp -d)
+PIDS=
+trap 'kill $PIDS 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# The settings of the printer under test, in a directory of its own
+#
+export XDG_CONFIG_HOME="$WORK"
+mkdir -p "$WORK/softus.org" "$WORK/spool"
+cat > "$WORK/softus.org/virtual-dicom-printer.conf" <<EOF
+[General]
+storage-servers=STUB_STORAGE
+port=$PRINTER_PORT
+timeout=10
+spool-path=$WORK/spool
+ocr-threads=1
+
+[query]
+url=http://127.0.0.1:$QUERY_PORT/query
+content-type=application/json
+timeout-ms=10000
+
+[STUB_STORAGE]
+address=127.0.0.1:$DICOM_PORT
+aetitle=STUB_STORAGE
+
+[STUB_PRINTER]
+aetitle=STUB_PRINTER
+upstream-address=127.0.0.1:$DICOM_PORT
+upstream-aetitle=STUB_UPSTREAM
+info\1\key="0008,0070"
+info\1\value=STUB
+info\size=1
+EOF
+
+fail()
+{
+    echo "FAIL: $1"
+    for log in "$WORK"/*.log; do
+        echo "--- $log"
+        tail -n 50 "$log"
+    done
+    exit 1
+}
+
+"$STUBS" --stub-query $QUERY_PORT > "$WORK/query.log" 2>&1 &
+PIDS="$PIDS $!"
+"$STUBS" --stub-dicom $DICOM_PORT 1 > "$WORK/dicom.json" 2> "$WORK/dicom.log" &
+DICOM_PID=$!
+PIDS="$PIDS $DICOM_PID"
+"$PRINTER" > "$WORK/printer.log" 2>&1 &
+PIDS="$PIDS $!"
+
+# Give the listeners a moment to bind
+#
+sleep 2
+
+"$PRINTER" --benchmark-print STUB_PRINTER@127.0.0.1:$PRINTER_PORT 1 1 1 > "$WORK/print.log" 2>&1 \
+    || fail "the film was not printed"
+
+# The DICOM stub leaves once the image is stored
+#
+elapsed=0
+while kill -0 $DICOM_PID 2>/dev/null; do
+    if [ $elapsed -ge $TIMEOUT ]; then
+        fail "the image was not stored in $TIMEOUT seconds"
+    fi
+    sleep 1
+    elapsed=$((elapsed + 1))
+done
+
+grep -q '"images-stored": 1' "$WORK/dicom.json" || fail "unexpected storage report: $(cat "$WORK/dicom.json")"
+grep -q '"images-queried": 1' "$WORK/dicom.json" || fail "the web service response was not applied"
+
+echo "PASS"
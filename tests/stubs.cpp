@@ -0,0 +1,668 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stubs.h"
+#include "product.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVector>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+#include <QtConcurrentRun>
+
+#include <algorithm>
+#include <unistd.h>
+
+#ifdef UNICODE
+#define DCMTK_UNICODE_BUG_WORKAROUND
+#undef UNICODE
+#endif
+
+#define HAVE_CONFIG_H
+#include <dcmtk/config/osconfig.h>   // make sure OS specific configuration is included first
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcsequen.h>
+#include <dcmtk/dcmdata/dcuid.h>
+#include <dcmtk/dcmnet/dimse.h>
+
+#ifdef DCMTK_UNICODE_BUG_WORKAROUND
+#define UNICODE
+#undef DCMTK_UNICODE_BUG_WORKAROUND
+#endif
+
+#define STUB_REPORT_INTERVAL 10000 // In milliseconds
+#define STUB_MAX_ASSOCIATIONS 64
+#define STUB_MAXPDU 65536
+
+struct QueryStub
+{
+    int latency;
+    int errorPercent;
+    QString errorMessage;
+    int requests;
+    int errors;
+};
+
+// Every item gets a patient of its own, as if the RIS knew them all
+//
+static void writeStubItem(QueryStub& stub, bool xml, bool& error, QXmlStreamWriter& writer, QJsonArray& items)
+{
+    error = (qrand() % 100) < stub.errorPercent;
+    auto id = QString("STUB%1").arg(++stub.requests, 6, 10, QChar('0'));
+
+    if (error)
+    {
+        ++stub.errors;
+        if (xml)
+        {
+            writer.writeStartElement("business-logic-error");
+            writer.writeTextElement("message", stub.errorMessage);
+            writer.writeEndElement();
+        }
+        else
+        {
+            QJsonObject obj;
+            obj["message"] = stub.errorMessage;
+            items.append(obj);
+        }
+        return;
+    }
+
+    if (xml)
+    {
+        writer.writeStartElement("data-set");
+        writer.writeStartElement("element");
+        writer.writeAttribute("tag", "PatientID");
+        writer.writeCharacters(id);
+        writer.writeEndElement();
+        writer.writeStartElement("element");
+        writer.writeAttribute("tag", "PatientName");
+        writer.writeCharacters("STUB^" + id);
+        writer.writeEndElement();
+        writer.writeEndElement();
+    }
+    else
+    {
+        QJsonArray elements;
+        QJsonObject patientId;
+        patientId["tag"] = "PatientID";
+        patientId["value"] = id;
+        elements.append(patientId);
+        QJsonObject patientName;
+        patientName["tag"] = "PatientName";
+        patientName["value"] = "STUB^" + id;
+        elements.append(patientName);
+        items.append(elements);
+    }
+}
+
+// Same formats as PrintSCP sends and reads, see webQuery and webQueryBatch
+//
+static QByteArray answerQuery(QueryStub& stub, const QString& contentType, const QByteArray& body)
+{
+    auto xml = contentType.contains("/xml", Qt::CaseInsensitive);
+
+    // Count the items of a batch, a single query is one item
+    //
+    int count = 0;
+    QString batchRoot;
+    if (xml)
+    {
+        QXmlStreamReader reader(body);
+        if (reader.readNextStartElement() && reader.name() != "save-hardcopy-grayscale-image-request")
+        {
+            batchRoot = reader.name().toString();
+            while (reader.readNextStartElement())
+            {
+                ++count;
+                reader.skipCurrentElement();
+            }
+        }
+    }
+    else
+    {
+        auto doc = QJsonDocument::fromJson(body);
+        if (doc.isArray())
+        {
+            count = doc.array().size();
+        }
+        else if (doc.object().size() == 1 && doc.object().begin().value().isArray())
+        {
+            batchRoot = doc.object().begin().key();
+            count = doc.object().begin().value().toArray().size();
+        }
+    }
+
+    auto batch = count > 0;
+    auto error = false;
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    QJsonArray items;
+
+    if (xml && batch)
+    {
+        writer.writeStartElement(batchRoot);
+    }
+
+    for (int i = 0; i < qMax(1, count); ++i)
+    {
+        bool itemError = false;
+        writeStubItem(stub, xml, itemError, writer, items);
+        error = error || itemError;
+    }
+
+    if (xml)
+    {
+        if (batch)
+        {
+            writer.writeEndElement();
+        }
+    }
+    else if (batch && !batchRoot.isEmpty())
+    {
+        QJsonObject envelope;
+        envelope[batchRoot] = items;
+        data = QJsonDocument(envelope).toJson(QJsonDocument::Compact);
+    }
+    else
+    {
+        data = batch? QJsonDocument(items).toJson(QJsonDocument::Compact)
+            : items.first().isArray()? QJsonDocument(items.first().toArray()).toJson(QJsonDocument::Compact)
+            : QJsonDocument(items.first().toObject()).toJson(QJsonDocument::Compact);
+    }
+
+    // Items of a batch fail on their own, a single query fails as a whole
+    //
+    QByteArray response(!batch && error? "HTTP/1.1 500 Internal Server Error\r\n": "HTTP/1.1 200 OK\r\n");
+    response.append("Content-Type: ").append(xml? "application/xml": "application/json").append("; charset=UTF-8\r\n");
+    response.append("Content-Length: ").append(QByteArray::number(data.size())).append("\r\n");
+    response.append("Connection: keep-alive\r\n\r\n");
+    return response.append(data);
+}
+
+int stubQuery(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto port = args.value(0).toInt();
+    if (port <= 0)
+    {
+        out << "Usage: " << STUBS_SHORT_NAME
+            << " --stub-query <port> [latency-ms] [error-percent] [error-message]" << endl;
+        return 1;
+    }
+
+    QueryStub stub;
+    stub.latency      = args.value(1).toInt();
+    stub.errorPercent = args.value(2).toInt();
+    stub.errorMessage = args.value(3, DEFAULT_STUB_ERROR);
+    stub.requests     = 0;
+    stub.errors       = 0;
+
+    QTcpServer server;
+    if (!server.listen(QHostAddress::Any, port))
+    {
+        out << "Failed to listen on port " << port << ": " << server.errorString() << endl;
+        return 1;
+    }
+
+    QObject::connect(&server, &QTcpServer::newConnection, [&server, &stub]()
+    {
+        while (auto socket = server.nextPendingConnection())
+        {
+            QSharedPointer<QByteArray> buffer(new QByteArray);
+            QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+            QObject::connect(socket, &QTcpSocket::readyRead, [socket, buffer, &stub]()
+            {
+                buffer->append(socket->readAll());
+
+                // Keep-alive connections carry many requests, one after another
+                //
+                Q_FOREVER
+                {
+                    auto headerEnd = buffer->indexOf("\r\n\r\n");
+                    if (headerEnd < 0)
+                    {
+                        return;
+                    }
+
+                    int length = 0;
+                    QString contentType;
+                    Q_FOREACH (auto line, buffer->left(headerEnd).split('\n'))
+                    {
+                        auto colon = line.indexOf(':');
+                        auto name = line.left(colon).trimmed().toLower();
+                        if (name == "content-length")
+                        {
+                            length = line.mid(colon + 1).trimmed().toInt();
+                        }
+                        else if (name == "content-type")
+                        {
+                            contentType = QString::fromUtf8(line.mid(colon + 1).trimmed());
+                        }
+                    }
+
+                    if (buffer->size() < headerEnd + 4 + length)
+                    {
+                        return;
+                    }
+
+                    auto response = answerQuery(stub, contentType, buffer->mid(headerEnd + 4, length));
+                    buffer->remove(0, headerEnd + 4 + length);
+
+                    // Timers of the same interval fire in order, so do the responses
+                    //
+                    QPointer<QTcpSocket> guard(socket);
+                    QTimer::singleShot(stub.latency, [guard, response]()
+                    {
+                        if (guard)
+                        {
+                            guard->write(response);
+                        }
+                    });
+                }
+            });
+        }
+    });
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+    QTimer report;
+    QObject::connect(&report, &QTimer::timeout, [&stub, &elapsed]()
+    {
+        qDebug() << "Query stub:" << stub.requests << "items," << stub.errors << "errors,"
+                 << stub.requests * 1000.0 / qMax(1LL, (qint64)elapsed.elapsed()) << "items/s";
+    });
+    report.start(STUB_REPORT_INTERVAL);
+
+    qDebug() << "Query stub listening on port" << port << "latency" << stub.latency << "ms,"
+             << stub.errorPercent << "% errors with" << stub.errorMessage;
+    return qApp->exec();
+}
+
+struct DicomStub
+{
+    QMutex lock;
+    int expected;
+    int associations;
+    int stored;
+    int queried;               // Images stored with the patient from --stub-query
+    int imageBoxes;
+    int films;
+    QVector<qint64> latencies; // Of the images sent by --benchmark-print
+    QElapsedTimer timer;       // Started with the first image stored
+    qint64 lastStored;
+};
+
+static void fillReferencedImageBoxes(DcmDataset* rqDataset, DcmDataset*& rspDataset)
+{
+    rspDataset = rqDataset? new DcmDataset(*rqDataset): new DcmDataset;
+    auto seq = new DcmSequenceOfItems(DCM_ReferencedImageBoxSequence);
+    char uid[100];
+    OFString fmt;
+    unsigned long count = 1;
+
+    if (rspDataset->findAndGetOFStringArray(DCM_ImageDisplayFormat, fmt).good() && fmt.substr(0, 9) == "STANDARD\\")
+    {
+        unsigned long rows = 0;
+        unsigned long cols = 0;
+        if (2 == sscanf(fmt.c_str() + 9, "%lu,%lu", &cols, &rows))
+        {
+            count = rows * cols;
+        }
+    }
+
+    while (count-- > 0)
+    {
+        auto item = new DcmItem();
+        item->putAndInsertString(DCM_ReferencedSOPClassUID, UID_BasicGrayscaleImageBoxSOPClass);
+        item->putAndInsertString(DCM_ReferencedSOPInstanceUID, dcmGenerateUniqueIdentifier(uid, SITE_INSTANCE_UID_ROOT));
+        seq->insert(item);
+    }
+
+    rspDataset->insert(seq);
+}
+
+static bool hasDataset(T_DIMSE_Message& rq)
+{
+    switch (rq.CommandField)
+    {
+    case DIMSE_C_STORE_RQ:  return rq.msg.CStoreRQ.DataSetType  != DIMSE_DATASET_NULL;
+    case DIMSE_N_CREATE_RQ: return rq.msg.NCreateRQ.DataSetType != DIMSE_DATASET_NULL;
+    case DIMSE_N_SET_RQ:    return rq.msg.NSetRQ.DataSetType    != DIMSE_DATASET_NULL;
+    case DIMSE_N_ACTION_RQ: return rq.msg.NActionRQ.DataSetType != DIMSE_DATASET_NULL;
+    default:
+        return false;
+    }
+}
+
+static void reportDicomStub(DicomStub& stub)
+{
+    auto latencies = stub.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](int p) -> double
+    {
+        return latencies.isEmpty()? 0.0: latencies[qMin(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+
+    QJsonObject latency;
+    latency["samples"] = latencies.size();
+    latency["p50-ms"] = percentile(50);
+    latency["p95-ms"] = percentile(95);
+    latency["p99-ms"] = percentile(99);
+    latency["max-ms"] = latencies.isEmpty()? 0.0: (double)latencies.last();
+
+    auto elapsed = qMax(1LL, stub.lastStored);
+    QJsonObject result;
+    result["version"] = PRODUCT_VERSION_STR;
+    result["associations"] = stub.associations;
+    result["films"] = stub.films;
+    result["image-boxes"] = stub.imageBoxes;
+    result["images-stored"] = stub.stored;
+    result["images-queried"] = stub.queried;
+    result["store-elapsed-ms"] = elapsed;
+    result["images-per-second"] = stub.stored * 1000.0 / elapsed;
+    result["print-to-store-latency"] = latency;
+
+    QTextStream(stdout) << QJsonDocument(result).toJson();
+}
+
+static void serveStubAssociation(T_ASC_Association* assoc, DicomStub& stub)
+{
+    Q_FOREVER
+    {
+        T_DIMSE_Message rq;
+        T_DIMSE_Message rsp;
+        T_ASC_PresentationContextID presId;
+        DcmDataset* statusDetail = nullptr;
+        DcmDataset* rqDataset = nullptr;
+        DcmDataset* rspDataset = nullptr;
+
+        auto cond = DIMSE_receiveCommand(assoc, DIMSE_BLOCKING, 0, &presId, &rq, &statusDetail);
+        delete statusDetail;
+        if (cond == DUL_PEERREQUESTEDRELEASE)
+        {
+            ASC_acknowledgeRelease(assoc);
+            break;
+        }
+
+        if (cond.bad())
+        {
+            if (cond != DUL_PEERABORTEDASSOCIATION)
+            {
+                qDebug() << "DIMSE_receiveCommand" << QString::fromLocal8Bit(cond.text());
+                ASC_abortAssociation(assoc);
+            }
+            break;
+        }
+
+        if (hasDataset(rq))
+        {
+            cond = DIMSE_receiveDataSetInMemory(assoc, DIMSE_BLOCKING, 0, &presId, &rqDataset, nullptr, nullptr);
+            if (cond.bad())
+            {
+                qDebug() << "DIMSE_receiveDataSetInMemory" << QString::fromLocal8Bit(cond.text());
+                ASC_abortAssociation(assoc);
+                break;
+            }
+        }
+
+        // Whatever is asked, it succeeds
+        //
+        memset(&rsp, 0, sizeof(rsp));
+        switch (rq.CommandField)
+        {
+        case DIMSE_C_ECHO_RQ:
+            rsp.CommandField = DIMSE_C_ECHO_RSP;
+            rsp.msg.CEchoRSP.MessageIDBeingRespondedTo = rq.msg.CEchoRQ.MessageID;
+            rsp.msg.CEchoRSP.DataSetType = DIMSE_DATASET_NULL;
+            rsp.msg.CEchoRSP.DimseStatus = STATUS_Success;
+            break;
+
+        case DIMSE_C_STORE_RQ:
+            {
+                rsp.CommandField = DIMSE_C_STORE_RSP;
+                rsp.msg.CStoreRSP.MessageIDBeingRespondedTo = rq.msg.CStoreRQ.MessageID;
+                strncpy(rsp.msg.CStoreRSP.AffectedSOPClassUID, rq.msg.CStoreRQ.AffectedSOPClassUID, sizeof(DIC_UI));
+                strncpy(rsp.msg.CStoreRSP.AffectedSOPInstanceUID, rq.msg.CStoreRQ.AffectedSOPInstanceUID, sizeof(DIC_UI));
+                rsp.msg.CStoreRSP.DataSetType = DIMSE_DATASET_NULL;
+                rsp.msg.CStoreRSP.DimseStatus = STATUS_Success;
+                rsp.msg.CStoreRSP.opts = O_STORE_AFFECTEDSOPCLASSUID | O_STORE_AFFECTEDSOPINSTANCEUID;
+
+                OFString comments;
+                qint64 sentAt = 0;
+                if (rqDataset && rqDataset->findAndGetOFString(DCM_ImageComments, comments).good()
+                    && comments.substr(0, 10) == "BENCHMARK ")
+                {
+                    sentAt = QString::fromUtf8(comments.c_str() + 10).toLongLong();
+                }
+
+                OFString patientId;
+                auto queried = rqDataset && rqDataset->findAndGetOFString(DCM_PatientID, patientId).good()
+                    && patientId.substr(0, 4) == "STUB";
+
+                QMutexLocker locker(&stub.lock);
+                if (queried)
+                {
+                    ++stub.queried;
+                }
+                if (!stub.timer.isValid())
+                {
+                    stub.timer.start();
+                }
+                if (sentAt > 0)
+                {
+                    stub.latencies.append(QDateTime::currentMSecsSinceEpoch() - sentAt);
+                }
+                stub.lastStored = stub.timer.elapsed();
+                if (++stub.stored == stub.expected)
+                {
+                    reportDicomStub(stub);
+                    QMetaObject::invokeMethod(qApp, "quit", Qt::QueuedConnection);
+                }
+            }
+            break;
+
+        case DIMSE_N_CREATE_RQ:
+            rsp.CommandField = DIMSE_N_CREATE_RSP;
+            rsp.msg.NCreateRSP.MessageIDBeingRespondedTo = rq.msg.NCreateRQ.MessageID;
+            rsp.msg.NCreateRSP.DimseStatus = STATUS_Success;
+            strncpy(rsp.msg.NCreateRSP.AffectedSOPClassUID, rq.msg.NCreateRQ.AffectedSOPClassUID, sizeof(DIC_UI));
+            if (rq.msg.NCreateRQ.opts & O_NCREATE_AFFECTEDSOPINSTANCEUID)
+            {
+                strncpy(rsp.msg.NCreateRSP.AffectedSOPInstanceUID, rq.msg.NCreateRQ.AffectedSOPInstanceUID, sizeof(DIC_UI));
+            }
+            else
+            {
+                dcmGenerateUniqueIdentifier(rsp.msg.NCreateRSP.AffectedSOPInstanceUID);
+            }
+            rsp.msg.NCreateRSP.opts = O_NCREATE_AFFECTEDSOPINSTANCEUID | O_NCREATE_AFFECTEDSOPCLASSUID;
+            rsp.msg.NCreateRSP.DataSetType = DIMSE_DATASET_NULL;
+            if (0 == strcmp(rq.msg.NCreateRQ.AffectedSOPClassUID, UID_BasicFilmBoxSOPClass))
+            {
+                fillReferencedImageBoxes(rqDataset, rspDataset);
+                rsp.msg.NCreateRSP.DataSetType = DIMSE_DATASET_PRESENT;
+            }
+            break;
+
+        case DIMSE_N_SET_RQ:
+            rsp.CommandField = DIMSE_N_SET_RSP;
+            rsp.msg.NSetRSP.MessageIDBeingRespondedTo = rq.msg.NSetRQ.MessageID;
+            rsp.msg.NSetRSP.DataSetType = DIMSE_DATASET_NULL;
+            rsp.msg.NSetRSP.DimseStatus = STATUS_Success;
+            if (QString(rq.msg.NSetRQ.RequestedSOPClassUID).startsWith(UID_BasicGrayscaleImageBoxSOPClass))
+            {
+                QMutexLocker locker(&stub.lock);
+                ++stub.imageBoxes;
+            }
+            break;
+
+        case DIMSE_N_ACTION_RQ:
+            rsp.CommandField = DIMSE_N_ACTION_RSP;
+            rsp.msg.NActionRSP.MessageIDBeingRespondedTo = rq.msg.NActionRQ.MessageID;
+            rsp.msg.NActionRSP.ActionTypeID = rq.msg.NActionRQ.ActionTypeID;
+            rsp.msg.NActionRSP.DataSetType = DIMSE_DATASET_NULL;
+            rsp.msg.NActionRSP.DimseStatus = STATUS_Success;
+            rsp.msg.NActionRSP.opts = O_NACTION_ACTIONTYPEID;
+            {
+                QMutexLocker locker(&stub.lock);
+                ++stub.films;
+            }
+            break;
+
+        case DIMSE_N_DELETE_RQ:
+            rsp.CommandField = DIMSE_N_DELETE_RSP;
+            rsp.msg.NDeleteRSP.MessageIDBeingRespondedTo = rq.msg.NDeleteRQ.MessageID;
+            rsp.msg.NDeleteRSP.DataSetType = DIMSE_DATASET_NULL;
+            rsp.msg.NDeleteRSP.DimseStatus = STATUS_Success;
+            break;
+
+        case DIMSE_N_GET_RQ:
+            rsp.CommandField = DIMSE_N_GET_RSP;
+            rsp.msg.NGetRSP.MessageIDBeingRespondedTo = rq.msg.NGetRQ.MessageID;
+            rsp.msg.NGetRSP.DimseStatus = STATUS_Success;
+            rsp.msg.NGetRSP.DataSetType = DIMSE_DATASET_PRESENT;
+            rspDataset = new DcmDataset;
+            rspDataset->putAndInsertString(DCM_PrinterStatus, "NORMAL");
+            rspDataset->putAndInsertString(DCM_PrinterStatusInfo, "NORMAL");
+            break;
+
+        default:
+            qDebug() << "Cannot handle command: 0x" << QString::number((unsigned)rq.CommandField, 16);
+            delete rqDataset;
+            ASC_abortAssociation(assoc);
+            return;
+        }
+
+        delete rqDataset;
+        cond = DIMSE_sendMessageUsingMemoryData(assoc, presId, &rsp, nullptr, rspDataset, nullptr, nullptr);
+        delete rspDataset;
+        if (cond.bad())
+        {
+            qDebug() << "DIMSE_sendMessageUsingMemoryData" << QString::fromLocal8Bit(cond.text());
+            break;
+        }
+    }
+}
+
+int stubDicom(const QStringList& args)
+{
+    QTextStream out(stdout);
+    auto port = args.value(0).toInt();
+    if (port <= 0)
+    {
+        out << "Usage: " << STUBS_SHORT_NAME << " --stub-dicom <port> [expected-images]" << endl;
+        return 1;
+    }
+
+    T_ASC_Network *net = nullptr;
+    auto cond = ASC_initializeNetwork(NET_ACCEPTOR, port, 30, &net);
+    if (cond.bad())
+    {
+        out << "Failed to listen on port " << port << ": " << QString::fromLocal8Bit(cond.text()) << endl;
+        return 1;
+    }
+
+    DicomStub stub;
+    stub.expected = args.value(1).toInt();
+    stub.associations = 0;
+    stub.stored = 0;
+    stub.queried = 0;
+    stub.imageBoxes = 0;
+    stub.films = 0;
+    stub.lastStored = 0;
+
+    // The printer keeps the storage associations open between the images,
+    // so each association needs a thread of its own
+    //
+    QThreadPool threads;
+    threads.setMaxThreadCount(STUB_MAX_ASSOCIATIONS);
+
+    // The associations are accepted by a thread of the pool as well,
+    // the main thread only waits for the expected images
+    //
+    auto acceptor = QtConcurrent::run(&threads, [net, &stub, &threads]()
+    {
+        Q_FOREVER
+        {
+            T_ASC_Association *assoc = nullptr;
+            auto cond = ASC_receiveAssociation(net, &assoc, STUB_MAXPDU);
+            if (cond.bad())
+            {
+                qDebug() << "Failed to receive association" << QString::fromLocal8Bit(cond.text());
+                ASC_dropSCPAssociation(assoc);
+                ASC_destroyAssociation(&assoc);
+                continue;
+            }
+
+            // Accept everything proposed: print management, verification, storage
+            //
+            auto count = ASC_countPresentationContexts(assoc->params);
+            for (int i = 0; i < count; ++i)
+            {
+                T_ASC_PresentationContext pc;
+                if (ASC_getPresentationContext(assoc->params, i, &pc).good())
+                {
+                    ASC_acceptPresentationContext(assoc->params, pc.presentationContextID, pc.proposedTransferSyntaxes[0]);
+                }
+            }
+
+            ASC_acknowledgeAssociation(assoc);
+            {
+                QMutexLocker locker(&stub.lock);
+                ++stub.associations;
+            }
+
+            QtConcurrent::run(&threads, [assoc, &stub]()
+            {
+                auto a = assoc;
+                serveStubAssociation(a, stub);
+                ASC_dropSCPAssociation(a);
+                ASC_destroyAssociation(&a);
+            });
+        }
+    });
+    Q_UNUSED(acceptor);
+
+    QTimer progress;
+    QObject::connect(&progress, &QTimer::timeout, [&stub]()
+    {
+        QMutexLocker locker(&stub.lock);
+        qDebug() << "DICOM stub:" << stub.associations << "associations," << stub.films << "films,"
+                 << stub.imageBoxes << "image boxes," << stub.stored << "images stored";
+    });
+    progress.start(STUB_REPORT_INTERVAL);
+
+    qDebug() << "DICOM stub listening on port" << port << "expecting" << stub.expected << "images";
+    auto ret = qApp->exec();
+
+    // The threads block in the network calls, don't wait for them
+    //
+    _exit(ret);
+}
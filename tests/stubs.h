@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUBS_H
+#define STUBS_H
+
+#include <QStringList>
+
+#define STUBS_SHORT_NAME   "virtual-dicom-printer-stubs"
+#define DEFAULT_STUB_ERROR "STUB-ERROR"
+
+// Stand-ins for the services around the printer, so the whole
+// print -> OCR -> query -> store path can be loaded on a single host.
+// Point [query] url, upstream-address and storage-servers at them.
+// They are a tool of their own, see tests.pro, and are never installed.
+
+/** serves the web query with configurable latency and errors.
+ *  Answers the single and the batch queries, JSON or XML
+ *  as the request is, errors are HTTP 500 with the message given,
+ *  so ignore-errors can be exercised too.
+ *  @param args command line arguments after --stub-query:
+ *  <port> [latency-ms] [error-percent] [error-message]
+ *  @return exit code
+ */
+int stubQuery(const QStringList& args);
+
+/** serves DICOM associations as the upstream printer and as the storage server:
+ *  every print request succeeds, every image is accepted and dropped.
+ *  Prints the report as JSON after the expected number of images was stored,
+ *  with the latency from the image box N-SET sent by --benchmark-print,
+ *  and how many images carry the patient given by --stub-query.
+ *  @param args command line arguments after --stub-dicom: <port> [expected-images]
+ *  @return exit code
+ */
+int stubDicom(const QStringList& args);
+
+#endif // STUBS_H
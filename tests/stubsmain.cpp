@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "product.h"
+#include "stubs.h"
+
+#include <QCoreApplication>
+#include <QTextStream>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(STUBS_SHORT_NAME);
+    app.setOrganizationName(ORGANIZATION_DOMAIN);
+
+    auto args = app.arguments();
+    if (args.size() > 1 && args[1] == "--stub-query")
+    {
+        return stubQuery(args.mid(2));
+    }
+
+    if (args.size() > 1 && args[1] == "--stub-dicom")
+    {
+        return stubDicom(args.mid(2));
+    }
+
+    QTextStream(stdout) << "Usage: " << STUBS_SHORT_NAME << " --stub-query|--stub-dicom <port> ..." << endl;
+    return 1;
+}
@@ -0,0 +1,45 @@
+# Copyright (C) 2013-2018 Softus Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; version 2.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Stand-ins for the web service and the DICOM peers, and the test
+# that prints through the virtual printer to them. Never installed.
+#
+#   cd tests && qmake && make check PRINTER=../virtual-dicom-printer
+
+lessThan(QT_MAJOR_VERSION, 5): error (QT 5.0 or newer is required)
+
+CONFIG      += c++11
+QT          += network concurrent
+QT          -= gui
+LIBS        += -ldcmpstat -ldcmnet -ldcmdata -ldcmimgle -ldcmdsig -ldcmsr -ldcmtls -ldcmqrdb -lxml2 -loflog -lofstd -lz
+unix:LIBS   += -lssl
+win32:LIBS  += -lws2_32 -ladvapi32 -lnetapi32
+
+TARGET   = virtual-dicom-printer-stubs
+CONFIG  += console
+CONFIG  -= app_bundle
+INCLUDEPATH += ..
+
+TEMPLATE = app
+SOURCES += \
+    stubs.cpp \
+    stubsmain.cpp
+
+HEADERS += \
+    stubs.h
+
+isEmpty(PRINTER): PRINTER = $$OUT_PWD/../virtual-dicom-printer
+check.commands = sh $$PWD/print-path.sh $$PRINTER $$OUT_PWD/$$TARGET
+check.depends = $$TARGET
+QMAKE_EXTRA_TARGETS += check
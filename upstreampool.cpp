@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "upstreampool.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QHash>
+#include <QLockFile>
+#include <QMutex>
+#include <QUtf8Settings>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+// How long to wait for other processes to update the state, in milliseconds
+//
+#define UPSTREAM_STATE_LOCK_TIMEOUT 1000
+
+// Jobs of this process by printer and index, if there are no other processes
+//
+static bool singleProcess = false;
+static QMutex jobCountsLock;
+static QHash<QString, int> jobCounts;
+
+// Other worker processes update the same state, so each read-modify-write
+// goes under a lock file, and the settings are synced before and after it.
+//
+class UpstreamStateLock
+{
+public:
+    explicit UpstreamStateLock(QSettings& settings)
+        : settings(settings)
+        , lockFile(settings.fileName() + ".upstream-state.lock")
+    {
+        if (!lockFile.tryLock(UPSTREAM_STATE_LOCK_TIMEOUT))
+        {
+            qWarning() << "Failed to lock" << lockFile.fileName() << "upstream state may be inaccurate";
+        }
+
+        // Get the state saved by others
+        //
+        settings.sync();
+    }
+
+    ~UpstreamStateLock()
+    {
+        settings.sync();
+    }
+
+private:
+    QSettings& settings;
+    QLockFile lockFile;
+};
+
+void UpstreamPool::setSingleProcess(bool on)
+{
+    singleProcess = on;
+}
+
+UpstreamPool::UpstreamPool(const QString& printer)
+    : printer(printer)
+    , balance(DEFAULT_UPSTREAM_BALANCE)
+    , retryInterval(DEFAULT_UPSTREAM_RETRY_INTERVAL)
+{
+    QUtf8Settings settings;
+    settings.beginGroup(printer);
+    addresses     = settings.value("upstream-address").toStringList();
+    aetitles      = settings.value("upstream-aetitle").toStringList();
+    balance       = settings.value("upstream-balance", balance).toString();
+    retryInterval = settings.value("upstream-retry-interval", retryInterval).toInt();
+    settings.endGroup();
+
+    if (aetitles.isEmpty())
+    {
+        // Without AETITLE there is no upstream connection at all
+        //
+        addresses.clear();
+    }
+
+    for (int idx = 0; idx < addresses.size(); ++idx)
+    {
+        addresses[idx] = addresses[idx].trimmed();
+    }
+
+    for (int idx = 0; idx < aetitles.size(); ++idx)
+    {
+        aetitles[idx] = aetitles[idx].trimmed();
+    }
+}
+
+int UpstreamPool::jobCount(QSettings& settings, int idx)
+{
+    if (singleProcess)
+    {
+        QMutexLocker lock(&jobCountsLock);
+        return jobCounts.value(printer + '/' + QString::number(idx));
+    }
+
+    return jobs(settings, idx).size();
+}
+
+QStringList UpstreamPool::jobs(QSettings& settings, int idx)
+{
+    // Forget about jobs of the processes that were terminated abnormally
+    //
+    QStringList alive;
+    Q_FOREACH (auto pid, settings.value(QString::number(idx) + "/jobs").toStringList())
+    {
+#ifdef Q_OS_UNIX
+        if (kill(pid.toInt(), 0) != 0 && errno == ESRCH)
+        {
+            continue;
+        }
+#endif
+        alive.append(pid);
+    }
+
+    return alive;
+}
+
+QList<int> UpstreamPool::candidates()
+{
+    QList<int> healthy;
+    QList<int> failed;
+
+    QUtf8Settings settings;
+    UpstreamStateLock lock(settings);
+    settings.beginGroup("upstream-state");
+    settings.beginGroup(printer);
+
+    auto now = QDateTime::currentDateTime();
+    auto first = 0;
+    if (balance == "round-robin" && !addresses.isEmpty())
+    {
+        first = (settings.value("last", -1).toInt() + 1) % addresses.size();
+        settings.setValue("last", first);
+    }
+
+    QList<int> load;
+    for (int i = 0; i < addresses.size(); ++i)
+    {
+        auto idx = (first + i) % addresses.size();
+        if (now < settings.value(QString::number(idx) + "/down-until").toDateTime())
+        {
+            failed.append(idx);
+        }
+        else if (balance == "least-jobs")
+        {
+            // Keep the order stable for printers with the same load
+            //
+            auto count = jobCount(settings, idx);
+            int pos = 0;
+            while (pos < healthy.size() && load[pos] <= count)
+            {
+                ++pos;
+            }
+            healthy.insert(pos, idx);
+            load.insert(pos, count);
+        }
+        else
+        {
+            healthy.append(idx);
+        }
+    }
+
+    settings.endGroup();
+    settings.endGroup();
+
+    return healthy + failed;
+}
+
+void UpstreamPool::markFailed(int idx)
+{
+    qDebug() << "Upstream printer" << aetitle(idx) << address(idx) << "is unavailable for" << retryInterval << "seconds";
+
+    QUtf8Settings settings;
+    UpstreamStateLock lock(settings);
+    settings.beginGroup("upstream-state");
+    settings.beginGroup(printer);
+    settings.setValue(QString::number(idx) + "/down-until", QDateTime::currentDateTime().addSecs(retryInterval));
+    settings.endGroup();
+    settings.endGroup();
+}
+
+void UpstreamPool::jobStarted(int idx)
+{
+    if (singleProcess)
+    {
+        QMutexLocker lock(&jobCountsLock);
+        ++jobCounts[printer + '/' + QString::number(idx)];
+    }
+
+    QUtf8Settings settings;
+    UpstreamStateLock lock(settings);
+    settings.beginGroup("upstream-state");
+    settings.beginGroup(printer);
+    if (!singleProcess)
+    {
+        auto list = jobs(settings, idx);
+        list.append(QString::number(getpid()));
+        settings.setValue(QString::number(idx) + "/jobs", list);
+    }
+    settings.remove(QString::number(idx) + "/down-until");
+    settings.endGroup();
+    settings.endGroup();
+}
+
+void UpstreamPool::jobFinished(int idx)
+{
+    if (singleProcess)
+    {
+        QMutexLocker lock(&jobCountsLock);
+        auto& count = jobCounts[printer + '/' + QString::number(idx)];
+        count = qMax(0, count - 1);
+        return;
+    }
+
+    QUtf8Settings settings;
+    UpstreamStateLock lock(settings);
+    settings.beginGroup("upstream-state");
+    settings.beginGroup(printer);
+    auto list = jobs(settings, idx);
+    list.removeOne(QString::number(getpid()));
+    settings.setValue(QString::number(idx) + "/jobs", list);
+    settings.endGroup();
+    settings.endGroup();
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPSTREAMPOOL_H
+#define UPSTREAMPOOL_H
+
+#include <QList>
+#include <QStringList>
+
+class QSettings;
+
+#define DEFAULT_UPSTREAM_BALANCE        "failover"
+#define DEFAULT_UPSTREAM_RETRY_INTERVAL 60
+
+// The set of identical physical printers behind a single virtual printer.
+//
+// upstream-address=10.0.0.31:6000, 10.0.0.32:6000
+// upstream-aetitle=KC_PLNK5_SCP
+// upstream-balance=failover|round-robin|least-jobs
+// upstream-retry-interval=60
+//
+// Health and outstanding jobs are kept in the settings file, so they are
+// shared by all worker processes. In the reactor mode there are no other
+// processes, so the jobs are counted in memory.
+//
+class UpstreamPool
+{
+public:
+    explicit UpstreamPool(const QString& printer);
+
+    /** tells all pools whether jobs of this process are the only ones.
+     *  @param on true for the reactor mode
+     */
+    static void setSingleProcess(bool on);
+
+    /** @return number of configured upstream printers.
+     */
+    int size() const { return addresses.size(); }
+
+    /** @return indexes of upstream printers in the order they should be tried.
+     *  Printers failed recently are moved to the end of the list.
+     */
+    QList<int> candidates();
+
+    /** @return network address of the upstream printer.
+     */
+    QString address(int idx) const { return addresses.value(idx); }
+
+    /** @return AETITLE of the upstream printer.
+     */
+    QString aetitle(int idx) const { return aetitles.value(qMin(idx, aetitles.size() - 1)); }
+
+    /** marks the upstream printer as unavailable for upstream-retry-interval seconds.
+     */
+    void markFailed(int idx);
+
+    /** accounts a print job started on the upstream printer.
+     */
+    void jobStarted(int idx);
+
+    /** accounts a print job finished on the upstream printer.
+     */
+    void jobFinished(int idx);
+
+private:
+    int jobCount(QSettings& settings, int idx);
+    QStringList jobs(QSettings& settings, int idx);
+
+    QString printer;
+    QStringList addresses;
+    QStringList aetitles;
+    QString balance;
+    int retryInterval;
+};
+
+#endif // UPSTREAMPOOL_H
@@ -17,7 +17,7 @@ lessThan(QT_MAJOR_VERSION, 5): error (QT 5.0 or newer is required)
 isEmpty(PREFIX): PREFIX = /usr
 DEFINES     += PREFIX=$$PREFIX
 CONFIG      += link_pkgconfig c++11
-QT          += network
+QT          += network concurrent
 QT          -= gui
 LIBS        += -ldcmpstat -ldcmnet -ldcmdata -ldcmimgle -ldcmdsig -ldcmsr -ldcmtls -ldcmqrdb -lxml2 -loflog -lofstd -lz
 unix:LIBS   += -lssl
@@ -40,16 +40,47 @@ CONFIG  += console
 CONFIG  -= app_bundle
 
 TEMPLATE = app
-SOURCES += main.cpp \
+SOURCES += \
+    attrcodec.cpp \
+    benchmark.cpp \
+    demographics.cpp \
+    glyphmatcher.cpp \
+    imageprep.cpp \
+    main.cpp \
+    ocrcache.cpp \
+    ocrengine.cpp \
+    ocrimage.cpp \
     printscp.cpp \
+    queryendpoints.cpp \
+    sessionattributes.cpp \
+    statistics.cpp \
     storescp.cpp \
-    transcyrillic.cpp
+    tagrules.cpp \
+    transcyrillic.cpp \
+    upstreampool.cpp \
+    webcache.cpp \
+    webclient.cpp
 
 HEADERS += \
+    attrcodec.h \
+    benchmark.h \
+    demographics.h \
+    glyphmatcher.h \
+    imageprep.h \
+    ocrcache.h \
+    ocrengine.h \
+    ocrimage.h \
     printscp.h \
+    queryendpoints.h \
+    sessionattributes.h \
     product.h \
+    statistics.h \
     storescp.h \
+    tagrules.h \
     transcyrillic.h \
+    upstreampool.h \
+    webcache.h \
+    webclient.h \
     qutf8settings.h \
     QUtf8Settings
 
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "webcache.h"
+#include "statistics.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QUtf8Settings>
+
+WebCache& WebCache::instance()
+{
+    static WebCache cache;
+    return cache;
+}
+
+WebCache::WebCache()
+{
+    QUtf8Settings settings;
+    settings.beginGroup("query");
+    cache.setMaxCost(settings.value("cache-size", DEFAULT_QUERY_CACHE_SIZE).toInt());
+    ttl = settings.value("cache-ttl", DEFAULT_QUERY_CACHE_TTL).toInt();
+    settings.endGroup();
+}
+
+QByteArray WebCache::key(const QString& url, const QString& contentType, const QByteArray& data)
+{
+    // Query parameters are kept in a QVariantMap, so the payload
+    // is already normalized: same parameters give the same bytes.
+    //
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(url.toUtf8());
+    hash.addData("\n", 1);
+    hash.addData(contentType.toUtf8());
+    hash.addData("\n", 1);
+    hash.addData(data);
+    return hash.result();
+}
+
+bool WebCache::find(const QByteArray& key, Response& response)
+{
+    if (ttl <= 0)
+    {
+        return false;
+    }
+
+    QMutexLocker locker(&lock);
+    auto entry = cache.object(key);
+    if (!entry || entry->expires < QDateTime::currentMSecsSinceEpoch())
+    {
+        cache.remove(key);
+        countEvent("query-cache-misses");
+        return false;
+    }
+
+    countEvent("query-cache-hits");
+    response = entry->response;
+    return true;
+}
+
+void WebCache::insert(const QByteArray& key, const Response& response)
+{
+    if (ttl <= 0)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&lock);
+    auto entry = new Entry;
+    entry->response = response;
+    entry->expires = QDateTime::currentMSecsSinceEpoch() + ttl * 1000LL;
+    cache.insert(key, entry);
+}
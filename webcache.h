@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBCACHE_H
+#define WEBCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
+#include <QString>
+
+#define DEFAULT_QUERY_CACHE_SIZE 64
+#define DEFAULT_QUERY_CACHE_TTL  60 // In seconds
+
+// Successful web service responses, shared by all sessions of the worker.
+// Every image box of a film carries the same patient, so the query payload
+// is the same too, and the service is asked once per film instead of once per box.
+// Hits and misses are counted as query-cache-hits and query-cache-misses.
+//
+class WebCache
+{
+public:
+    struct Response
+    {
+        QString contentType;
+        QByteArray body;
+    };
+
+    /** @return the cache of this process, query/cache-size entries at most,
+     *  each one lives for query/cache-ttl seconds. Zero TTL disables the cache.
+     */
+    static WebCache& instance();
+
+    /** builds the cache key from everything that is sent to the service.
+     *  @param url service address
+     *  @param contentType request content type
+     *  @param data request body
+     */
+    static QByteArray key(const QString& url, const QString& contentType, const QByteArray& data);
+
+    /** looks up the response received earlier.
+     *  @param key from key()
+     *  @param response the response found
+     *  @return true if found and not expired
+     */
+    bool find(const QByteArray& key, Response& response);
+
+    /** remembers the response.
+     *  @param key from key()
+     *  @param response the response
+     */
+    void insert(const QByteArray& key, const Response& response);
+
+private:
+    WebCache();
+
+    struct Entry
+    {
+        Response response;
+        qint64 expires;
+    };
+
+    QMutex lock;
+    QCache<QByteArray, Entry> cache;
+    int ttl;
+};
+
+#endif // WEBCACHE_H
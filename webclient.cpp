@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "webclient.h"
+
+#include <QEventLoop>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThreadStorage>
+#include <QTimer>
+#include <QUtf8Settings>
+
+static QThreadStorage<WebClient*> clients;
+
+static QSemaphore& connections()
+{
+    static QSemaphore semaphore(qMax(1,
+        QUtf8Settings().value("query/connections", DEFAULT_QUERY_CONNECTIONS).toInt()));
+    return semaphore;
+}
+
+WebClient& WebClient::instance()
+{
+    if (!clients.hasLocalData())
+    {
+        clients.setLocalData(new WebClient);
+    }
+    return *clients.localData();
+}
+
+bool WebClient::acquire()
+{
+    // A thread must not sleep while it has requests in flight: their slots are given
+    // back by the event loop of the same thread, which does not run while it sleeps.
+    //
+    auto& inFlight = connections();
+    if (held > 0)
+    {
+        return inFlight.tryAcquire();
+    }
+
+    inFlight.acquire();
+    return true;
+}
+
+void WebClient::track(QNetworkReply* reply)
+{
+    // The slot is given back once, whatever comes first:
+    // the reply is finished (or aborted), or it is deleted unfinished.
+    //
+    ++held;
+    QSharedPointer<bool> released(new bool(false));
+    auto release = [this, released]()
+    {
+        if (!*released)
+        {
+            *released = true;
+            --held;
+            connections().release();
+        }
+    };
+    QObject::connect(reply, &QNetworkReply::finished, release);
+    QObject::connect(reply, &QObject::destroyed, release);
+}
+
+QNetworkReply* WebClient::post(QNetworkRequest rq, const QByteArray& data)
+{
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 8, 0))
+    // HTTP/2 multiplexes the requests over a single connection, if the backend speaks it
+    //
+    if (!rq.attribute(QNetworkRequest::Http2AllowedAttribute).isValid())
+    {
+        rq.setAttribute(QNetworkRequest::Http2AllowedAttribute, true);
+    }
+#endif
+
+    if (!acquire())
+    {
+        return nullptr;
+    }
+
+    auto reply = mgr.post(rq, data);
+    track(reply);
+    return reply;
+}
+
+QNetworkReply* WebClient::get(const QNetworkRequest& rq)
+{
+    if (!acquire())
+    {
+        return nullptr;
+    }
+
+    auto reply = mgr.get(rq);
+    track(reply);
+    return reply;
+}
+
+bool WebClient::waitFor(QNetworkReply* reply, int msecs)
+{
+    return waitForAny(QList<QNetworkReply*>() << reply, msecs);
+}
+
+bool WebClient::waitForAny(const QList<QNetworkReply*>& replies, int msecs)
+{
+    QEventLoop loop;
+    Q_FOREACH (auto reply, replies)
+    {
+        if (reply->isFinished())
+        {
+            return true;
+        }
+        QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+    }
+
+    QTimer timer;
+    if (msecs > 0)
+    {
+        timer.setSingleShot(true);
+        timer.setTimerType(Qt::PreciseTimer);
+        QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+        timer.start(msecs);
+    }
+
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+
+    Q_FOREACH (auto reply, replies)
+    {
+        if (reply->isFinished())
+        {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014-2018 Softus Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBCLIENT_H
+#define WEBCLIENT_H
+
+#include <QList>
+#include <QNetworkAccessManager>
+
+#define DEFAULT_QUERY_CONNECTIONS 6 // Same as Qt opens per host
+
+class QNetworkReply;
+class QNetworkRequest;
+
+// HTTP client for the web queries. Lives as long as the thread does,
+// so the connections to the backend (and TLS sessions) are kept alive
+// between the images, the sessions and the spool retries.
+// At most query/connections requests of the process are in flight at a time.
+// A thread with no requests in flight waits for a free slot, a thread that has
+// some already does not wait, since only its own event loop frees them.
+//
+class WebClient
+{
+public:
+    /** @return the client of the current thread.
+     */
+    static WebClient& instance();
+
+    /** sends the POST request, waits if too many requests are in flight.
+     *  @param rq the request
+     *  @param data request body
+     *  @return the reply, the caller must delete it. NULL if the thread has
+     *  requests in flight already and there is no free slot for one more;
+     *  never NULL for a thread with no requests in flight.
+     */
+    QNetworkReply* post(QNetworkRequest rq, const QByteArray& data);
+
+    /** sends the GET request, see post.
+     *  @param rq the request
+     *  @return the reply, the caller must delete it
+     */
+    QNetworkReply* get(const QNetworkRequest& rq);
+
+    /** waits for the reply without polling, the thread sleeps until
+     *  either the reply is finished or the time is out.
+     *  @param reply to wait for
+     *  @param msecs milliseconds to wait, 0 for no limit
+     *  @return true if the reply is finished
+     */
+    static bool waitFor(QNetworkReply* reply, int msecs);
+
+    /** waits for any of the replies, see waitFor.
+     *  @param replies to wait for
+     *  @param msecs milliseconds to wait, 0 for no limit
+     *  @return true if at least one reply is finished
+     */
+    static bool waitForAny(const QList<QNetworkReply*>& replies, int msecs);
+
+private:
+    WebClient() : held(0) {}
+
+    /** takes a slot for a request, see post.
+     *  @return false if there is no free slot and the thread must not wait for one
+     */
+    bool acquire();
+
+    /** gives the slot back when the reply is finished or deleted.
+     */
+    void track(QNetworkReply* reply);
+
+    QNetworkAccessManager mgr;
+    int held; // Slots taken by the requests of this thread
+
+};
+
+#endif // WEBCLIENT_H